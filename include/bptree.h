@@ -35,18 +35,52 @@ extern "C" {
 #define BPTREE_API static // internal linkage, functions and variables only visible in this file
 #endif
 
+/*
+    BPTREE_PAGED use pread/pwrite/posix_fadvise which strict -std=c11 hide, ask for them before the first system include
+    BPTREE_IO_URING also need syscall and MAP_POPULATE which are outside posix (_DEFAULT_SOURCE)
+    it only works if this header is included before any other, otherwise define _XOPEN_SOURCE 700 (or -D_GNU_SOURCE) yourself
+*/
+#if defined(BPTREE_PAGED) && !defined(_XOPEN_SOURCE) && !defined(_GNU_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+#if defined(BPTREE_IO_URING) && !defined(_DEFAULT_SOURCE) && !defined(_GNU_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <assert.h>
+#include <limits.h>
 #include <stdalign.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifdef __GLIBC__
+#include <malloc.h> // malloc_trim, mallinfo2
+#endif
 
-#ifndef BPTREE_KEY_TYPE_STRING
+#ifdef BPTREE_PAGED
+#ifdef _WIN32
+#error "BPTREE_PAGED needs pread/pwrite, it is not supported on windows"
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef BPTREE_IO_URING
+#ifndef __linux__
+#error "BPTREE_IO_URING is only available on linux"
+#endif
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef BPTREE_KEY_TYPE_STRING
 #ifndef BPTREE_KEY_SIZE
 #error "Define BPTREE_KEY_SIZE for fixed size string keys"
 #endif
@@ -54,7 +88,24 @@ extern "C" {
 typedef struct {
     char data[BPTREE_KEY_SIZE];
 } bptree_key_t;
-#else // IF BPTREE_KEY_TYPE_STRING is not defined
+#elif defined(BPTREE_KEY_TYPE_VARLEN)
+#if defined(BPTREE_PAGED) || defined(BPTREE_MESSAGE_BUFFERS) || defined(BPTREE_MEMTABLE)
+#error "BPTREE_KEY_TYPE_VARLEN can't be combined with BPTREE_PAGED, BPTREE_MESSAGE_BUFFERS or BPTREE_MEMTABLE"
+#endif
+#define BPTREE_KEY_INLINE_PREFIX 4 // first key bytes kept in the slot itself
+#define BPTREE_KEY_INLINE_MAX 12 // keys up to this length are stored whole in the slot
+
+/*
+    a key slot is 16 bytes whatever the key length
+        len <= BPTREE_KEY_INLINE_MAX: bytes hold the whole key zero padded, nothing is allocated
+        longer keys: bytes hold the first BPTREE_KEY_INLINE_PREFIX bytes then a pointer to all the len bytes (an exact size allocation for keys the tree store)
+    truncated separators are short so most of them live in the slot and a descent compare them without following a pointer
+*/
+typedef struct {
+    uint32_t len; // key length in bytes
+    unsigned char bytes[BPTREE_KEY_INLINE_MAX];
+} bptree_key_t;
+#else // if BPTREE_KEY_TYPE_STRING is not defined keys are numbers
 #ifndef BPTREE_NUMERIC_TYPE
 #define BPTREE_NUMERIC_TYPE int64_t
 #endif
@@ -66,9 +117,96 @@ typedef BPTREE_NUMERIC_TYPE bptree_key_t;
 #define BPTREE_VALUE_TYPE void*
 #endif
 
+#ifdef BPTREE_PREFIX_COMPRESSION
+#ifndef BPTREE_KEY_TYPE_STRING
+#error "BPTREE_PREFIX_COMPRESSION is for fixed size string keys (BPTREE_KEY_TYPE_STRING)"
+#endif
+#ifdef BPTREE_PAGED
+#error "BPTREE_PREFIX_COMPRESSION is not maintained by the BPTREE_PAGED write path"
+#endif
+#endif
+
+#if defined(BPTREE_KEYS_ONLY) && defined(BPTREE_PAGED)
+#error "BPTREE_KEYS_ONLY is not supported by the page layout of BPTREE_PAGED"
+#endif
+
+#if defined(BPTREE_LAZY_REBALANCE) && defined(BPTREE_MESSAGE_BUFFERS)
+#error "BPTREE_MESSAGE_BUFFERS already rebalance the leaves its removes left small in one pass after each flush, there is nothing for BPTREE_LAZY_REBALANCE to defer"
+#endif
+
+#if defined(BPTREE_LAZY_REBALANCE) || defined(BPTREE_MESSAGE_BUFFERS)
+#define BPTREE_PENDING_MARKS // removes don't rebalance inline, the leaves they leave small are found later through pending marks on the nodes above
+#endif
+
+#ifdef BPTREE_COMPRESSED_LEAVES
+#if defined(BPTREE_KEY_TYPE_STRING) || defined(BPTREE_KEY_TYPE_VARLEN)
+#error "BPTREE_COMPRESSED_LEAVES is for integer keys (BPTREE_NUMERIC_TYPE)"
+#endif
+#if defined(BPTREE_PAGED) || defined(BPTREE_MESSAGE_BUFFERS) || defined(BPTREE_MEMTABLE) || defined(BPTREE_MULTIMAP)
+#error "BPTREE_COMPRESSED_LEAVES can't be combined with BPTREE_PAGED, BPTREE_MESSAGE_BUFFERS, BPTREE_MEMTABLE or BPTREE_MULTIMAP"
+#endif
+#endif
+
 
 typedef BPTREE_VALUE_TYPE bptree_value_t;
 
+#ifdef BPTREE_MULTIMAP
+#if defined(BPTREE_KEYS_ONLY) || defined(BPTREE_PAGED) || defined(BPTREE_MESSAGE_BUFFERS) || defined(BPTREE_MEMTABLE)
+#error "BPTREE_MULTIMAP can't be combined with BPTREE_KEYS_ONLY, BPTREE_PAGED, BPTREE_MESSAGE_BUFFERS or BPTREE_MEMTABLE"
+#endif
+#ifndef BPTREE_POSTING_INLINE
+#define BPTREE_POSTING_INLINE 2 // values a posting list hold in the leaf before it move to its own array
+#endif
+
+// the values of one key in insertion order, small lists live in the leaf slot
+typedef struct bptree_posting {
+    uint32_t count; // number of values, at least 1
+    uint32_t capacity; // size of the out of line array, 0 while the values are inline
+    union {
+        bptree_value_t inline_values[BPTREE_POSTING_INLINE];
+        bptree_value_t* values;
+    };
+} bptree_posting;
+
+typedef bptree_posting bptree_leaf_value_t; // what a leaf store per key
+#else
+typedef bptree_value_t bptree_leaf_value_t;
+#endif
+
+#ifndef BPTREE_MAX_HEIGHT
+#define BPTREE_MAX_HEIGHT 32 // deepest root to leaf path a descent can record
+#endif
+
+#ifndef BPTREE_SPLIT_RUN
+#define BPTREE_SPLIT_RUN 4 // inserts in a row at neighbour slots before a leaf split follow their direction instead of the median
+#endif
+
+#ifndef BPTREE_DEFRAG_CHUNK
+#define BPTREE_DEFRAG_CHUNK 64 // leaves bptree_defragment write one after the other in one allocation
+#endif
+#ifndef BPTREE_SHRINK_FILL
+#define BPTREE_SHRINK_FILL 90 // percent of a leaf bptree_shrink refill it to with keys of the next leaves under the same parent
+#endif
+#ifndef BPTREE_STATS_SAMPLES
+#define BPTREE_STATS_SAMPLES 256 // most leaves bptree_get_stats_ex sample for the fill percentiles
+#endif
+
+#if BPTREE_DEFRAG_CHUNK < 1 || BPTREE_DEFRAG_CHUNK > 65535
+#error "BPTREE_DEFRAG_CHUNK must fit the 16 bits slot of a node"
+#endif
+
+#ifdef BPTREE_PAGED
+#ifndef BPTREE_READAHEAD_LEAVES
+#define BPTREE_READAHEAD_LEAVES 8 // leaves a paged range scan keep in flight ahead of the leaf it read
+#endif
+
+typedef uint64_t bptree_page_id; // index of a fixed size page in the tree file
+#define BPTREE_INVALID_PAGE ((bptree_page_id)0) // page 0 hold the file header so it's never a node
+#define BPTREE_CHILD_REF_SIZE (sizeof(bptree_page_id) > sizeof(void*) ? sizeof(bptree_page_id) : sizeof(void*)) // children area hold page ids instead of pointers
+#else
+#define BPTREE_CHILD_REF_SIZE sizeof(void*) // children area hold node pointers
+#endif
+
 typedef enum { // STATUS CODE RETURNED BY B+TREE FUNCTIONS
     BPTREE_OK = 0, // operation succeded
     BPTREE_DUPLICATE_KEY, // duplicate key found
@@ -78,30 +216,151 @@ typedef enum { // STATUS CODE RETURNED BY B+TREE FUNCTIONS
     BPTREE_INTERNAL_ERROR // internal consistency error
 } bptree_status;
 
+#ifdef BPTREE_MESSAGE_BUFFERS
+#ifndef BPTREE_MESSAGE_BUFFER_SIZE
+#define BPTREE_MESSAGE_BUFFER_SIZE 64 // messages an internal node hold before a batch is moved down
+#endif
+
+typedef enum { // what a pending message do to its key when it reach the leaf
+    BPTREE_MESSAGE_PUT,
+    BPTREE_MESSAGE_REMOVE
+} bptree_message_op;
+
+typedef struct bptree_message {
+    bptree_key_t key;
+    bptree_value_t value; // only meaningful for BPTREE_MESSAGE_PUT
+    bptree_message_op op;
+} bptree_message;
+#endif
+
+#ifdef BPTREE_MEMTABLE
+#ifdef BPTREE_MESSAGE_BUFFERS
+#error "BPTREE_MEMTABLE and BPTREE_MESSAGE_BUFFERS are two different write buffers, pick one"
+#endif
+#ifndef BPTREE_MEMTABLE_SIZE
+#define BPTREE_MEMTABLE_SIZE 256 // keys the front buffer hold before it is merged into the tree
+#endif
+
+typedef struct bptree_memtable_entry {
+    bptree_key_t key;
+    bptree_value_t value;
+} bptree_memtable_entry;
+#endif
+
 typedef struct bptree_node bptree_node;
 struct bptree_node {
     bool is_leaf; // if node is leaf return true
-    int num_key; // number of keys stored in the node
+    uint16_t chunk_slot; // leaf rewritten by bptree_defragment: 1 + its slot in the chunk holding it, 0 for a node with its own allocation
+    int num_keys; // number of keys stored in the node
     bptree_node* next; // pointer to the next leaf (range querie)
-    char data[]; // flexible array member that holds keys and either values or child pointers
+#ifdef BPTREE_COMPRESSED_LEAVES
+    uint8_t key_width; // 0 for a normal node, 1, 2 or 4 for a packed leaf: bytes of each key delta
+#endif
+#ifdef BPTREE_PAGED
+    bptree_page_id page_id; // the page this node live in
+    bptree_page_id next_page; // page of the next leaf, replace next on disk
+#endif
+#ifdef BPTREE_PREFIX_COMPRESSION
+    int prefix_len; // every key of the node start with the same prefix_len bytes, it can be smaller than the real common prefix but never larger
+#endif
+#ifdef BPTREE_PENDING_MARKS
+    bool pending; // internal node with a leaf under the low watermark somewhere below it, bptree_compact_step only descend in those
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+    bptree_message* messages; // pending messages for the subtree of an internal node, sorted by key with at most one per key
+    int num_messages;
+    int message_capacity; // allocated size of messages
+#endif
+    alignas(max_align_t) char data[]; // flexible array member that holds keys and either values or child pointers, aligned for any key, value or child type whatever fields come before
 };
 
 typedef struct bptree {
-    int count; // total number of key/value pair in the tree
+    int count; // total number of key/value pair in the tree (BPTREE_MESSAGE_BUFFERS: in the leaves, pending messages are not counted yet)
     int height; // current height of the tree
     bool enable_debug; // if true debug message will be printed
     int max_keys;   // maximum keys allowed in node
     int min_leaf_keys;  // minimum keys nedded in a non root leaf node
     int min_internal_keys; // minimum keys nedded in a non root internal node
+    int leaf_low, internal_low; // low watermarks: a remove rebalance a node only once it has fewer keys (bptree_set_watermarks)
+    int leaf_high, internal_high; // high watermarks: a merge can't leave more keys than this in the node, it borrow instead
+    uint64_t rebalances_deferred; // removes that left a node under its minimum but not under the low watermark
+    uint64_t merges_deferred; // rebalances that borrowed a key because a merge would go over the high watermark
     bptree_node* root; // pointer to the root node of the tree
+    bptree_node* rightmost; // the last leaf, a put of a key above its maximum go straight there
+    uint64_t version; // changed by every split, merge, borrow or separator update: a path recorded before (bptree_finger) is stale
+    const bptree_node* run_leaf; // leaf and slot of the last insert, only compared to the next one
+    int run_idx;
+    int run; // > 0: that many inserts in a row each just after the previous one, < 0: just before it
+    int (*compare)(const bptree_key_t*, const bptree_key_t*); // key comparison function
+    struct bptree_chunk* chunk; // chunk bptree_defragment is filling, NULL before the first call
+    size_t chunk_size; // bytes of a chunk, its header and BPTREE_DEFRAG_CHUNK leaf slots
+    size_t memory_used; // node bytes only: the nodes, packed leaves and chunks allocated for the tree (bptree_memory_usage)
+    size_t memory_limit; // a node or chunk allocation that would take memory_used over it fail, 0 for no limit
+    size_t leaf_nodes, internal_nodes; // nodes in the tree, counted as they are allocated and released so the stats don't walk it
+    bptree_key_t defrag_cursor; // a pass stopped by its budget resume at the leaf that cover this key
+    bool defrag_has_cursor;
+    uint64_t sample_seed; // xorshift state of the bptree_get_stats_ex descents, never 0
+#ifdef BPTREE_PAGED
+    struct bptree_pager* pager; // page file and buffer pool, NULL for an in-memory tree
+#endif
+#ifdef BPTREE_KEY_TYPE_STRING
+    bool bytewise_order; // the comparison is the default memcmp so node searches can compare bytes directly (normalized keys, shared prefix)
+#endif
+#ifdef BPTREE_MEMTABLE
+    bptree_memtable_entry* memtable; // recent puts of keys not in the nodes, sorted by key (count include them)
+    int memtable_count;
+    uint64_t* filter; // bloom filter of the keys put since it was built, NULL when every put must descend (custom order, float keys)
+    size_t filter_bits; // a power of two
+    size_t filter_keys; // keys added since the build, rebuilt from the leaves by the merge once over filter_bits / 8
+#endif
 } bptree;
 
 typedef struct bptree_stats {
     int count;
     int height;
     int node_count;
+    int leaf_count;
+    double leaf_fill; // keys in the leaves / (leaf_count * max_keys), 1.0 when every leaf is full
+    uint64_t rebalances_deferred; // see bptree_set_watermarks
+    uint64_t merges_deferred;
 } bptree_stats;
 
+// bptree_get_stats_ex: the maintained counters and the fill of a sample of leaves
+typedef struct bptree_stats_ex {
+    size_t leaf_nodes;
+    size_t internal_nodes;
+    size_t bytes; // same as bptree_memory_usage, node bytes only
+    size_t key_slots; // (leaf_nodes + internal_nodes) * max_keys
+    size_t used_key_slots; // keys in the leaves and separators in the internal nodes, exact, from the counters
+    int sampled_leaves; // leaves the percentiles are taken from, all of them when there are no more than the samples asked
+    double sample_min; // leaf fill (num_keys / max_keys) of the emptiest sampled leaf, the tree minimum only if every leaf was sampled
+    double fill_p10, fill_p50, fill_p90; // leaf fill under or at which 10%, 50%, 90% of the sampled leaves are
+} bptree_stats_ex;
+
+#ifdef BPTREE_KEY_TYPE_VARLEN
+// key over len bytes of data, the bytes only have to live during the call: the tree copy the keys it store
+static inline bptree_key_t bptree_key_make(const void* data, const uint32_t len) {
+    bptree_key_t key;
+    key.len = len;
+    memset(key.bytes, 0, BPTREE_KEY_INLINE_MAX);
+    if (len <= BPTREE_KEY_INLINE_MAX) {
+        memcpy(key.bytes, data, len);
+    } else {
+        memcpy(key.bytes, data, BPTREE_KEY_INLINE_PREFIX);
+        memcpy(key.bytes + BPTREE_KEY_INLINE_PREFIX, &data, sizeof(data)); // the slot isn't aligned for a pointer so it's copied in
+    }
+    return key;
+}
+
+// the len bytes of a key
+static inline const unsigned char* bptree_key_data(const bptree_key_t* key) {
+    if (key->len <= BPTREE_KEY_INLINE_MAX) return key->bytes;
+    const unsigned char* data;
+    memcpy(&data, key->bytes + BPTREE_KEY_INLINE_PREFIX, sizeof(data));
+    return data;
+}
+#endif
+
 BPTREE_API bptree* bptree_create(int max_keys,
                                  int (*compare)(const bptree_key_t*, const bptree_key_t*), // a function pointer, custom key comparison
                                  bool enable_debug);
@@ -109,22 +368,242 @@ BPTREE_API bptree* bptree_create(int max_keys,
 
 BPTREE_API void bptree_free(bptree* tree);
 
+#ifdef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_put(bptree* tree, const bptree_key_t* key); // a set has no values, bptree_contains is the lookup
+#elif defined(BPTREE_MULTIMAP)
+BPTREE_API bptree_status bptree_put(bptree* tree, const bptree_key_t* key, bptree_value_t value); // append value to the values of key, BPTREE_DUPLICATE_KEY if the pair is already there
+
+BPTREE_API bptree_status bptree_get(const bptree* tree, const bptree_key_t* key, bptree_value_t* out); // the first value of key
+
+BPTREE_API bptree_status bptree_get_values(const bptree* tree, const bptree_key_t* key, const bptree_value_t** values, int* n_values); // every value of key in insertion order, valid until the tree is modified
+
+BPTREE_API bptree_status bptree_remove_value(bptree* tree, const bptree_key_t* key, bptree_value_t value); // remove one pair, the key go away with its last value
+#else
 BPTREE_API bptree_status bptree_put(bptree* tree, const bptree_key_t* key, bptree_value_t value); // using const in key to ensure that the content of key which is value will not be modified
 
 BPTREE_API bptree_status bptree_get(const bptree* tree, const bptree_key_t* key, bptree_value_t* out);
 
+/*
+    called once by bptree_upsert with the slot of the key
+        exists true: value point to the stored value and can be modified in place, the return is ignored
+        exists false: value point to a zeroed value, return true to insert it or false to leave the key absent
+*/
+typedef bool (*bptree_upsert_fn)(bptree_value_t* value, bool exists, void* ctx);
+
+BPTREE_API bptree_status bptree_upsert(bptree* tree, const bptree_key_t* key, bptree_upsert_fn fn, void* ctx); // read modify write in one descent, BPTREE_KEY_NOT_FOUND if fn don't create an absent key
+
+BPTREE_API bptree_status bptree_put_if_absent(bptree* tree, const bptree_key_t* key, bptree_value_t value, bptree_value_t* old_value); // BPTREE_DUPLICATE_KEY and the current value in old_value if the key exist
+
+BPTREE_API bptree_status bptree_replace(bptree* tree, const bptree_key_t* key, bptree_value_t value, bptree_value_t* old_value); // overwrite an existing key, the previous value go in old_value (can be NULL)
+#endif
+
+/*
+    BPTREE_KEY_NOT_FOUND when the key isn't in the tree, in BPTREE_MULTIMAP remove the key with all its values
+    BPTREE_MESSAGE_BUFFERS: once the root is internal the remove is only a message in the root buffer (no descent), it return
+    BPTREE_OK for a missing key too, and tree->count (bptree_get_stats) only drop when the message reach the leaf
+    after bptree_flush_messages the count is exact again
+*/
 BPTREE_API bptree_status bptree_remove(bptree* tree, const bptree_key_t* key);
 
-BPTREE_API bptree_status bptree_get_range(const bptree* tree, const bptree* start, const bptree* end, bptree_value_t** out_values, int* n_results); // bptree_value_t** out_values: c cant return an array directly so it's a pointer to array which is a pointer
+#ifndef BPTREE_KEYS_ONLY
+/*
+    values of the keys in [start, end] in key order (every value of each key in BPTREE_MULTIMAP), pending messages and memtable puts included
+    bptree_value_t** out_values: c cant return an array directly so it's a pointer to array which is a pointer, free it with bptree_free_range_results
+    a paged tree has bptree_paged_get_range
+*/
+BPTREE_API bptree_status bptree_get_range(const bptree* tree, const bptree_key_t* start, const bptree_key_t* end, bptree_value_t** out_values, int* n_results);
+#endif
 
 BPTREE_API void bptree_free_range_results(bptree_value_t* results); // free the the out_values in bptree_get_range
 
-BPTREE_API bptree_stats bptree_get_stats(const bptree* tree); // stat of the tree which is predefined
+BPTREE_API bptree_stats bptree_get_stats(const bptree* tree); // stat of the tree which is predefined, from counters kept up to date so it doesn't walk the tree
+
+/*
+    bptree_get_stats plus the node, byte and key slot counters, and leaf fill percentiles of at most samples leaves
+    (clamped to BPTREE_STATS_SAMPLES) reached by random descents from the root, so a poll cost samples * height node reads
+    the leaves are drawn uniformly and each call draw new ones (the tree keep the random state, hence the non const tree)
+*/
+BPTREE_API bptree_stats_ex bptree_get_stats_ex(bptree* tree, int samples);
+
+/*
+    split/merge hysteresis, both in percent of max_keys, call it on an empty tree
+        low_percent: a node that drop under its minimum (about 50%) is only rebalanced once it go under this fill
+        high_percent: a merge that would fill the node over this borrow a key from the sibling instead, so the next inserts don't split it again
+    (50, 100) is the default, BPTREE_INVALID_ARGUMENT unless 0 <= low_percent <= 50 and 2 * low_percent <= high_percent <= 100
+    low_percent 0 (or any fill under one key) is free at empty: a leaf is only merged away once its last key is removed, and an
+    internal node once it is down to one child, for insert heavy trees where the rebalance cost outweigh the half empty leaves
+*/
+BPTREE_API bptree_status bptree_set_watermarks(bptree* tree, int low_percent, int high_percent);
+
+/*
+    cap the node bytes of the tree (bptree_memory_usage), 0 remove the cap, a lower cap than the usage only stop the growth
+    a put that need a node over it fail with BPTREE_ALLOCATION_FAILURE before anything is split, a packed leaf is held to it too
+    removes are not: the packed leaves a remove turn back into normal ones can take the tree a few leaves over the cap
+    node bytes only: the bytes of BPTREE_KEY_TYPE_VARLEN keys over BPTREE_KEY_INLINE_MAX, the posting arrays of BPTREE_MULTIMAP,
+    the message buffers and the memtable are neither counted nor capped, with long keys they can be most of the memory held
+*/
+BPTREE_API bptree_status bptree_set_memory_limit(bptree* tree, size_t max_bytes);
+
+BPTREE_API size_t bptree_memory_usage(const bptree* tree); // node bytes only (see bptree_set_memory_limit), counted as they are allocated and freed
 
 BPTREE_API bool bptree_check_invariants(const bptree* tree); // check the tree constraintes predefined and return true or false
 
 BPTREE_API bool bptree_contains(const bptree* tree, const bptree_key_t* key); // check if the tree already contain the key
 
+#ifdef BPTREE_MESSAGE_BUFFERS
+BPTREE_API bptree_status bptree_flush_messages(bptree* tree); // apply every pending message to the leaves
+#endif
+
+#ifdef BPTREE_MEMTABLE
+/*
+    insert the buffered puts into the nodes
+    BPTREE_DUPLICATE_KEY if some buffered keys were already in a leaf: they are dropped and the leaf keep its value,
+    the puts refuse those keys so it only happen if the tree was broken
+*/
+BPTREE_API bptree_status bptree_merge_memtable(bptree* tree);
+#endif
+
+#ifdef BPTREE_COMPRESSED_LEAVES
+BPTREE_API bptree_status bptree_compress_leaves(bptree* tree); // pack every leaf whose key range fit in 32 bits as a base and narrow deltas
+#endif
+
+#ifdef BPTREE_LAZY_REBALANCE
+BPTREE_API bool bptree_compact(bptree* tree, int budget); // borrow/merge for at most budget leaves left under the low watermark by removes, true once none is left
+#endif
+
+/*
+    copy at most budget leaves, in key order, into chunks of BPTREE_DEFRAG_CHUNK consecutive leaves so a range scan read memory
+    in address order again after the splits and merges scattered them, the next call continue the pass and true mean it reached the last leaf
+    fill_percent > 0 also refill each leaf up to that fill with keys of the next leaves under the same parent, a leaf emptied that way is freed
+    (not with BPTREE_MESSAGE_BUFFERS, packed leaves are neither moved nor refilled)
+*/
+BPTREE_API bool bptree_defragment(bptree* tree, int budget, int fill_percent);
+
+/*
+    after a mass remove: refill each leaf to BPTREE_SHRINK_FILL percent with keys of the next leaves under the same parent, copy
+    the leaves of the chunks that lost a quarter of their leaves into a new chunk and free the leaves and chunks emptied, then give
+    the free heap pages back to the os (glibc malloc_trim), return the node bytes freed or, if more, what the trim took off the heap
+    as mallinfo2 report it (glibc 2.33+, the pages malloc_trim release inside the heap are not reported)
+    with BPTREE_MESSAGE_BUFFERS the leaves are not refilled, a tree never defragmented then only get the malloc_trim
+*/
+BPTREE_API size_t bptree_shrink(bptree* tree);
+
+#if !defined(BPTREE_PAGED) && !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+/*
+    finger: a cursor that remember the last root to leaf path it took and the key range of every node on it
+    the next operation climb the path to the deepest node whose range hold the new key and descend from there
+    so clustered keys mostly start at the leaf or its parent, a change of tree->version send it back to the root
+*/
+typedef struct bptree_finger {
+    bptree* tree;
+    uint64_t version; // tree->version when the path was recorded
+    int depth; // node_stack[depth] is the leaf, -1 before the first use
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    bptree_key_t low[BPTREE_MAX_HEIGHT]; // node_stack[d] cover the keys >= low[d] (if has_low[d]) and < high[d] (if has_high[d])
+    bptree_key_t high[BPTREE_MAX_HEIGHT];
+    bool has_low[BPTREE_MAX_HEIGHT];
+    bool has_high[BPTREE_MAX_HEIGHT];
+} bptree_finger;
+
+BPTREE_API void bptree_finger_init(bptree_finger* finger, bptree* tree);
+
+#ifdef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_finger_put(bptree_finger* finger, const bptree_key_t* key);
+#else
+BPTREE_API bptree_status bptree_finger_put(bptree_finger* finger, const bptree_key_t* key, bptree_value_t value);
+
+BPTREE_API bptree_status bptree_finger_get(bptree_finger* finger, const bptree_key_t* key, bptree_value_t* out);
+#endif
+
+BPTREE_API bool bptree_finger_contains(bptree_finger* finger, const bptree_key_t* key);
+#endif
+
+#if !defined(BPTREE_PAGED) && !defined(BPTREE_MULTIMAP)
+#ifndef BPTREE_CACHE_LINE
+#define BPTREE_CACHE_LINE 64 // bytes of a frozen block when the keys are numbers
+#endif
+
+/*
+    read only copy of a tree
+        keys and values are two arrays in key order, cut in leaves of leaf_keys keys: every leaf is full but the last and there is no next pointer
+        the index levels above them are one array, root level first, of nodes with fanout - 1 separator slots
+        child c of node j is node j * fanout + c of the level below (a leaf for the last level), no child pointer is stored
+    numbers in the default order use blocks instead (block_search): every index node and leaf is one cache line of keys
+    (unused separator slots repeat the last one) and a node is searched by counting the keys below the probe, without branches
+*/
+typedef struct bptree_frozen {
+    int count; // number of keys
+    int leaf_keys; // keys per leaf
+    int fanout; // children per index node
+    int levels; // index levels, 0 when all the keys fit in one leaf
+    size_t level_offset[BPTREE_MAX_HEIGHT]; // first slot of each index level in index
+    int level_nodes[BPTREE_MAX_HEIGHT + 1]; // nodes of each index level, level_nodes[levels] is the number of leaves
+    bptree_key_t* index;
+    bptree_key_t* keys;
+    bptree_value_t* values; // NULL with BPTREE_KEYS_ONLY
+    int (*compare)(const bptree_key_t*, const bptree_key_t*);
+    bool block_search; // cache line nodes searched with a branch free count, leaf_keys is BPTREE_CACHE_LINE / sizeof(bptree_key_t)
+} bptree_frozen;
+
+BPTREE_API bptree_frozen* bptree_freeze(bptree* tree); // pending writes are applied first, the tree is left as it is and can be freed
+
+BPTREE_API void bptree_frozen_free(bptree_frozen* frozen);
+
+#ifndef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_frozen_get(const bptree_frozen* frozen, const bptree_key_t* key, bptree_value_t* out);
+#endif
+
+BPTREE_API bool bptree_frozen_contains(const bptree_frozen* frozen, const bptree_key_t* key);
+
+// the keys in [start, end] and their values (values is NULL with BPTREE_KEYS_ONLY), they point into the frozen arrays so nothing is copied
+BPTREE_API bptree_status bptree_frozen_range(const bptree_frozen* frozen, const bptree_key_t* start, const bptree_key_t* end,
+                                             const bptree_key_t** keys, const bptree_value_t** values, int* n_results);
+#endif
+
+#ifdef BPTREE_PAGED
+typedef struct bptree_pager_stats {
+    uint64_t hits; // page requests served from the buffer pool
+    uint64_t misses; // page requests that had to read the file
+    uint64_t evictions; // frames recycled by the clock hand
+    uint64_t writes; // dirty pages written back to the file
+    uint64_t async_reads; // pages requested ahead of use (io_uring reads, or posix_fadvise hints without io_uring)
+    int frame_count; // pages the buffer pool can hold
+    size_t page_size; // size of one page in bytes
+    uint64_t page_count; // pages in the file, the header page included
+    uint64_t free_pages; // pages freed by removes that the next splits take before the file grow
+} bptree_pager_stats;
+
+/*
+    open or create a disk resident tree, nodes are pages in the file at path and at most pool_bytes of them are cached in memory
+    the tree has no in memory root: only the bptree_paged_* calls work on it, the generic ones return BPTREE_INVALID_ARGUMENT
+    (false for bptree_contains, nothing for the stats and maintenance calls), bptree_free close it like bptree_paged_close
+*/
+BPTREE_API bptree* bptree_paged_open(const char* path, int max_keys,
+                                     int (*compare)(const bptree_key_t*, const bptree_key_t*),
+                                     size_t pool_bytes, bool enable_debug);
+
+BPTREE_API bptree_status bptree_paged_flush(bptree* tree); // write every dirty page and the file header then fsync
+
+BPTREE_API bptree_status bptree_paged_close(bptree* tree); // flush, close the file and free the tree
+
+BPTREE_API bptree_status bptree_paged_put(bptree* tree, const bptree_key_t* key, bptree_value_t value);
+
+BPTREE_API bptree_status bptree_paged_get(const bptree* tree, const bptree_key_t* key, bptree_value_t* out);
+
+BPTREE_API bptree_status bptree_paged_remove(bptree* tree, const bptree_key_t* key);
+
+BPTREE_API bool bptree_paged_contains(const bptree* tree, const bptree_key_t* key);
+
+BPTREE_API bptree_pager_stats bptree_paged_get_io_stats(const bptree* tree);
+
+// values of the keys in [start, end], the leaves after the current one are read ahead, free the result with bptree_free_range_results
+BPTREE_API bptree_status bptree_paged_get_range(const bptree* tree, const bptree_key_t* start, const bptree_key_t* end, bptree_value_t** out_values, int* n_results);
+
+// lookup n keys with all their leaf misses in flight at once, out_status[i] is BPTREE_OK or BPTREE_KEY_NOT_FOUND
+BPTREE_API bptree_status bptree_paged_get_batch(const bptree* tree, const bptree_key_t* keys, int n, bptree_value_t* out_values, bptree_status* out_status);
+#endif
+
 #ifdef BPTREE_IMPLEMENTATION // to implement the tree not only read
 
 static void bptree_debug_print(const bool enable, const char* fmt, ...) {
@@ -142,7 +621,7 @@ static void bptree_debug_print(const bool enable, const char* fmt, ...) {
 
 static size_t bptree_keys_area_size(const int max_keys) {
     const size_t keys_size = (size_t)(max_keys + 1) * sizeof(bptree_key_t); // bptree offten store one extra key temporary for splitting, size_t unsigned integer for size
-    const size_t req_align = (sizeof(bptree_value_t) > sizeof(bptree_node*) ? sizeof(bptree_value_t) : sizeof(bptree_node*));
+    const size_t req_align = (sizeof(bptree_leaf_value_t) > BPTREE_CHILD_REF_SIZE ? sizeof(bptree_leaf_value_t) : BPTREE_CHILD_REF_SIZE);
 
     // calculate required padding to meet alignement constrainte
     const size_t pad = (req_align - (keys_size % req_align)) % req_align;
@@ -154,98 +633,498 @@ static size_t bptree_keys_area_size(const int max_keys) {
 static bptree_key_t* bptree_node_keys(const bptree_node* node) { return (bptree_key_t*)node->data; }
 
 
+#ifndef BPTREE_KEYS_ONLY
 // return the value stored in a node for leaf nodes
-static bptree_value_t* bptree_node_values(bptree_node* node, const int max_keys) {
+static bptree_leaf_value_t* bptree_node_values(bptree_node* node, const int max_keys) {
     const size_t offset = bptree_keys_area_size(max_keys); // how many bytes occuped bu keys in data[] in node
-    return (bptree_value_t*)(node->data + offset); // skip the keys and retrieve the value
+    return (bptree_leaf_value_t*)(node->data + offset); // skip the keys and retrieve the value
 }
+#endif
 
-// it retrive the pointer to the first element in children nodes array
-static bptree_node** bptree_node_children(bptree_node* node, const int max_keys) {
-    const size_t offset = bptree_keys_area_size(max_keys);
-    return (bptree**)(node->data + offset)
+#ifdef BPTREE_COMPRESSED_LEAVES
+_Static_assert((bptree_key_t)0.5 == 0, "BPTREE_COMPRESSED_LEAVES needs an integer BPTREE_NUMERIC_TYPE");
+
+/*
+    packed leaves (frame of reference)
+        data[] hold the smallest key (the base), then num_keys deltas key - base of key_width bytes, then the values
+        the allocation is exactly that size, a packed leaf has no room to grow
+        reads search the deltas directly, writes turn the leaf back into a normal one first (bptree_unpack_child)
+*/
+static size_t bptree_packed_deltas_offset(void) {
+    return (sizeof(bptree_key_t) + 3) & ~(size_t)3; // deltas up to 4 bytes stay aligned
 }
 
-#ifdef BPTREE_KEY_TYPE_STRING
+static size_t bptree_packed_values_offset(const int num_keys, const int key_width) {
+    const size_t end = bptree_packed_deltas_offset() + (size_t)num_keys * (size_t)key_width;
+    const size_t align = alignof(bptree_leaf_value_t);
+    return (end + align - 1) / align * align;
+}
 
-// comparing two keys as fixed-size strings
-static inline int bptree_default_compare(const bptree_key_t* a, const bptree_key_t* b) {
-    return memcmp(a->data, b->data, BPTREE_KEY_SIZE);
+// bytes of the allocation of a packed leaf
+static size_t bptree_packed_size(const int num_keys, const int key_width) {
+    size_t size = sizeof(bptree_node) + bptree_packed_values_offset(num_keys, key_width);
+#ifndef BPTREE_KEYS_ONLY
+    size += (size_t)num_keys * sizeof(bptree_leaf_value_t);
+#endif
+    return size;
 }
 
-#else
+static bptree_key_t bptree_packed_base(const bptree_node* leaf) {
+    bptree_key_t base;
+    memcpy(&base, leaf->data, sizeof(base));
+    return base;
+}
 
-// comparing two numeric keys
-static int bptree_default_compare(const bptree_key_t* a, const bptree_key_t* b) {
-    return (*a < *b) ? -1 : ((*a > *b) ? 1 : 0);
+static const void* bptree_packed_deltas(const bptree_node* leaf) { return leaf->data + bptree_packed_deltas_offset(); }
+
+#ifndef BPTREE_KEYS_ONLY
+static bptree_leaf_value_t* bptree_packed_values(bptree_node* leaf) {
+    return (bptree_leaf_value_t*)(leaf->data + bptree_packed_values_offset(leaf->num_keys, leaf->key_width));
+}
+#endif
+
+static bptree_key_t bptree_packed_key(const bptree_node* leaf, const int i) {
+    uint64_t delta;
+    switch (leaf->key_width) {
+        case 1: delta = ((const uint8_t*)bptree_packed_deltas(leaf))[i]; break;
+        case 2: delta = ((const uint16_t*)bptree_packed_deltas(leaf))[i]; break;
+        default: delta = ((const uint32_t*)bptree_packed_deltas(leaf))[i]; break;
+    }
+    return (bptree_key_t)((uint64_t)bptree_packed_base(leaf) + delta); // unsigned wrap so a negative base work too
+}
+
+/*
+    lower bound in a packed leaf: the key become one delta and the deltas below it are counted
+    the count has no branch so the compiler vectorize it, a 64 bytes line hold 64, 32 or 16 deltas
+*/
+static int bptree_packed_lower_bound(const bptree_node* leaf, const bptree_key_t* key) {
+    const bptree_key_t base = bptree_packed_base(leaf);
+    if (*key <= base) return 0;
+    const uint64_t delta = (uint64_t)*key - (uint64_t)base;
+    const int n = leaf->num_keys;
+    int below = 0;
+    switch (leaf->key_width) {
+        case 1: {
+            if (delta > UINT8_MAX) return n;
+            const uint8_t* deltas = bptree_packed_deltas(leaf);
+            const uint8_t d = (uint8_t)delta;
+            for (int i = 0; i < n; i++) below += deltas[i] < d;
+            break;
+        }
+        case 2: {
+            if (delta > UINT16_MAX) return n;
+            const uint16_t* deltas = bptree_packed_deltas(leaf);
+            const uint16_t d = (uint16_t)delta;
+            for (int i = 0; i < n; i++) below += deltas[i] < d;
+            break;
+        }
+        default: {
+            if (delta > UINT32_MAX) return n;
+            const uint32_t* deltas = bptree_packed_deltas(leaf);
+            const uint32_t d = (uint32_t)delta;
+            for (int i = 0; i < n; i++) below += deltas[i] < d;
+            break;
+        }
+    }
+    return below;
 }
 
+// index of key in a packed leaf or -1
+static int bptree_packed_find(const bptree_node* leaf, const bptree_key_t* key) {
+    const int idx = bptree_packed_lower_bound(leaf, key);
+    return idx < leaf->num_keys && bptree_packed_key(leaf, idx) == *key ? idx : -1;
+}
 #endif
 
-// finding the smallest key by going down in left
-static bptree_key_t bptree_find_smallest_key(bptree_node* node, const int max_keys) {
-    assert(node != NULL); // node is not null
-    while (!node->is_leaf) { // while the node is an internal node
-        assert(node->num_keys >= 0); // node is valid and has keys
-        node = bptree_node_children(node, max_keys)[0]; // get childrens and affect the very left one to variable nod
-        assert(node != NULL);
+// key i of a node whatever the way it is stored
+static bptree_key_t bptree_node_key_at(const bptree_node* node, const int i) {
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (node->key_width) return bptree_packed_key(node, i);
+#endif
+    return bptree_node_keys(node)[i];
+}
+
+#ifdef BPTREE_MULTIMAP
+/*
+    posting lists
+        a key own its values in insertion order, up to BPTREE_POSTING_INLINE of them sit in the leaf slot
+        a longer list move to its own array that double when full, and come back in the slot when it shrink enough
+        values are told apart bytewise (memcmp) so a value type with padding must be zeroed before use
+*/
+static bptree_value_t* bptree_posting_values(bptree_posting* posting) {
+    return posting->capacity ? posting->values : posting->inline_values;
+}
+
+// index of value in the list or -1
+static int bptree_posting_find(bptree_posting* posting, const bptree_value_t* value) {
+    const bptree_value_t* values = bptree_posting_values(posting);
+    for (uint32_t i = 0; i < posting->count; i++) {
+        if (memcmp(&values[i], value, sizeof(bptree_value_t)) == 0) return (int)i;
     }
-    assert(node->num_key > 0); // check if the node is valid and has keys
-    return bptree_node_keys(node)[0]; // return the very left key
+    return -1;
 }
 
-static bptree_key_t bptree_find_largest_key(bptree_node* node, const int max_keys) {
-    assert(node != NULL);
-    while (!node->is_leaf) {
-        assert(node->num_keys >= 0); // for simplicity 
-        node = bptree_node_children(node)[node->num_keys] // num_keys + 1 because noode has one extra key so last element: the very right element
-        assert(node != NULL);
+static bool bptree_posting_append(bptree_posting* posting, const bptree_value_t value) {
+    if (posting->capacity == 0 && posting->count < BPTREE_POSTING_INLINE) {
+        posting->inline_values[posting->count++] = value;
+        return true;
     }
-    assert(node->num_keys > 0);
-    return bptree_node_keys(node)[node->num_keys - 1]; // the normal last element
+    if (posting->capacity == 0) { // the slot is full: move out of line
+        const uint32_t capacity = BPTREE_POSTING_INLINE * 2;
+        bptree_value_t* values = malloc(capacity * sizeof(bptree_value_t));
+        if (!values) return false;
+        memcpy(values, posting->inline_values, posting->count * sizeof(bptree_value_t));
+        posting->values = values;
+        posting->capacity = capacity;
+    } else if (posting->count == posting->capacity) {
+        bptree_value_t* grown = realloc(posting->values, (size_t)posting->capacity * 2 * sizeof(bptree_value_t));
+        if (!grown) return false;
+        posting->values = grown;
+        posting->capacity *= 2;
+    }
+    posting->values[posting->count++] = value;
+    return true;
 }
 
-static int bptree_count_nodes(const bptree_node* node, const bptree* tree) {
-    if (!node) return 0;
-    if (node->is_leaf) return 1;
-    int count = 1;
-    bptree_node** children = bptree_node_children((bptree_node*)node, tree->max_keys);
+static void bptree_posting_remove_at(bptree_posting* posting, const int i) {
+    bptree_value_t* values = bptree_posting_values(posting);
+    memmove(&values[i], &values[i + 1], (posting->count - (uint32_t)i - 1) * sizeof(bptree_value_t));
+    posting->count--;
+    if (posting->capacity && posting->count <= BPTREE_POSTING_INLINE) { // small again, back in the slot
+        memcpy(posting->inline_values, values, posting->count * sizeof(bptree_value_t)); // values is the heap array, the union is overwritten after the read
+        free(values);
+        posting->capacity = 0;
+    }
+}
 
+static void bptree_posting_release(bptree_posting* posting) {
+    if (posting->capacity) free(posting->values);
+}
+#endif
 
+// move n leaf values from src[src_idx] to dst[dst_idx] (same node or not), nothing to do when leaves only hold keys
+static void bptree_leaf_move_values(const bptree* tree, bptree_node* dst, const int dst_idx, bptree_node* src, const int src_idx, const int n) {
+#ifdef BPTREE_KEYS_ONLY
+    (void)tree; (void)dst; (void)dst_idx; (void)src; (void)src_idx; (void)n;
+#else
+    bptree_leaf_value_t* dst_values = bptree_node_values(dst, tree->max_keys);
+    const bptree_leaf_value_t* src_values = bptree_node_values(src, tree->max_keys);
+    memmove(&dst_values[dst_idx], &src_values[src_idx], (size_t)n * sizeof(bptree_leaf_value_t));
+#endif
 }
 
-if (tree->compare(&max_in_child0, &keys[0]) >= 0) {
-    // Fails if max_in_child0 >= keys[0]
-    // This means equality (==) would FAIL!
+// it retrive the pointer to the first element in children nodes array
+static bptree_node** bptree_node_children(bptree_node* node, const int max_keys) {
+    const size_t offset = bptree_keys_area_size(max_keys);
+    return (bptree_node**)(node->data + offset);
 }
 
+#ifdef BPTREE_PAGED
+// same area as bptree_node_children but in a paged tree it hold the page ids of the childrens
+static bptree_page_id* bptree_node_child_ids(bptree_node* node, const int max_keys) {
+    const size_t offset = bptree_keys_area_size(max_keys);
+    return (bptree_page_id*)(node->data + offset);
+}
+#endif
 
+// binary search in the node keys: return the index of the first key >= key (num_keys if all keys are smaller)
+#ifdef BPTREE_PREFIX_COMPRESSION
 /*
-    the tree validator called after each interaction with the tree
-    validate :
-        structural properties (key ordering, node occupancy limites)
-        relational properties (parent-child key relationships)
-        tree properties (all leaves at same depth)
-    it checks :
-        sorted keys: keys within a node must be in ascending order
-        occupancy constraints: nodes must have appropriate number of keys (min <= keys <= max)
-        leaf depth uniformity: all leaves must be at the same depth
-        parent-child relationships:
-            all keys in child are <= key[i]
-            all keys in child are > key[i-1]
-        root special case: root has different occupancy rules
+    prefix compression of string keys
+        a node remember how many leading bytes all its keys share (the common prefix of its first and last key because they are sorted)
+        a search check the key against that prefix once, then the binary search compare only the suffixes
+        keys added to a node can shorten the prefix so every place that add keys refresh it, removing keys can only make it longer so a stale value stay correct
 */
 
+// the prefix check: 0 if key start with the node prefix, else where key go (before or after every key of the node)
+static inline int bptree_node_prefix_check(const bptree_node* node, const bptree_key_t* key) {
+    return memcmp(key->data, bptree_node_keys(node)[0].data, node->prefix_len);
+}
+#endif
 
+#ifdef BPTREE_KEY_TYPE_STRING
+/*
+    normalized keys
+        the 8 key bytes from skip read as a big endian integer: integer order is memcmp order so most probes are one integer compare
+        the rest of the key is only compared when those 8 bytes are equal
+*/
+static inline uint64_t bptree_key_norm(const bptree_key_t* key, const int skip) {
+    const unsigned char* bytes = (const unsigned char*)key->data + skip;
+    const int n = BPTREE_KEY_SIZE - skip < 8 ? BPTREE_KEY_SIZE - skip : 8;
+    uint64_t norm = 0;
+    for (int i = 0; i < 8; i++) { // compilers turn the full 8 bytes case into a load and a byte swap
+        norm = (norm << 8) | (i < n ? bytes[i] : 0); // past the key end count as zero for both sides
+    }
+    return norm;
+}
+
+// compare a to b when both share their first skip bytes and b_norm is the normalized key of b at skip
+static inline int bptree_norm_compare(const bptree_key_t* a, const bptree_key_t* b, const int skip, const uint64_t b_norm) {
+    const uint64_t a_norm = bptree_key_norm(a, skip);
+    if (a_norm != b_norm) return a_norm < b_norm ? -1 : 1;
+    if (skip + 8 >= BPTREE_KEY_SIZE) return 0;
+    return memcmp(a->data + skip + 8, b->data + skip + 8, (size_t)(BPTREE_KEY_SIZE - skip - 8));
+}
+#endif
+
+// recompute the shared prefix of a node after keys were added to it
+static void bptree_node_prefix_refresh(bptree_node* node) {
+#ifdef BPTREE_PREFIX_COMPRESSION
+    if (node->num_keys == 0) {
+        node->prefix_len = 0;
+        return;
+    }
+    const char* first = bptree_node_keys(node)[0].data;
+    const char* last = bptree_node_keys(node)[node->num_keys - 1].data;
+    int len = 0;
+    while (len < BPTREE_KEY_SIZE && first[len] == last[len]) len++;
+    node->prefix_len = len;
+#else
+    (void)node;
+#endif
+}
+
+static int bptree_node_lower_bound(const bptree* tree, const bptree_node* node, const bptree_key_t* key) {
+    const bptree_key_t* keys = bptree_node_keys(node);
+    int lo = 0, hi = node->num_keys; // search in [lo, hi)
+#ifdef BPTREE_KEY_TYPE_STRING
+    if (tree->bytewise_order && hi > 0) {
+        int skip = 0;
+#ifdef BPTREE_PREFIX_COMPRESSION
+        const int prefix = bptree_node_prefix_check(node, key);
+        if (prefix != 0) return prefix < 0 ? 0 : hi;
+        skip = node->prefix_len;
+#endif
+        const uint64_t needle = bptree_key_norm(key, skip); // computed once for the whole search
+        while (lo < hi) {
+            const int mid = lo + (hi - lo) / 2;
+            if (bptree_norm_compare(&keys[mid], key, skip, needle) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+#endif
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2; // avoid overflow of lo + hi
+        if (tree->compare(&keys[mid], key) < 0) lo = mid + 1; // keys[mid] < key so the answer is on the right
+        else hi = mid;
+    }
+    return lo;
+}
+
+// in an internal node return which child cover key: keys[i - 1] == min(child[i]) so a key equal to a separator go right
+static int bptree_node_child_index(const bptree* tree, const bptree_node* node, const bptree_key_t* key) {
+    const bptree_key_t* keys = bptree_node_keys(node);
+    int lo = 0, hi = node->num_keys; // count the separators <= key
+#ifdef BPTREE_KEY_TYPE_STRING
+    if (tree->bytewise_order && hi > 0) {
+        int skip = 0;
+#ifdef BPTREE_PREFIX_COMPRESSION
+        const int prefix = bptree_node_prefix_check(node, key);
+        if (prefix != 0) return prefix < 0 ? 0 : hi;
+        skip = node->prefix_len;
+#endif
+        const uint64_t needle = bptree_key_norm(key, skip);
+        while (lo < hi) {
+            const int mid = lo + (hi - lo) / 2;
+            if (bptree_norm_compare(&keys[mid], key, skip, needle) <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+#endif
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if (tree->compare(&keys[mid], key) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+#ifdef BPTREE_KEY_TYPE_STRING
+
+// comparing two keys as fixed-size strings, same order as memcmp
+static int bptree_default_compare(const bptree_key_t* a, const bptree_key_t* b) {
+    return bptree_norm_compare(a, b, 0, bptree_key_norm(b, 0));
+}
+
+#elif defined(BPTREE_KEY_TYPE_VARLEN)
+
+// bytewise order, a key that is a prefix of another is smaller
+// a difference in the inline prefix give the same answer as the full comparison because the padding is zero
+static int bptree_default_compare(const bptree_key_t* a, const bptree_key_t* b) {
+    const int cmp = memcmp(a->bytes, b->bytes, BPTREE_KEY_INLINE_PREFIX);
+    if (cmp != 0) return cmp;
+    const uint32_t common = a->len < b->len ? a->len : b->len;
+    if (common > BPTREE_KEY_INLINE_PREFIX) {
+        const int rest = memcmp(bptree_key_data(a) + BPTREE_KEY_INLINE_PREFIX, bptree_key_data(b) + BPTREE_KEY_INLINE_PREFIX, common - BPTREE_KEY_INLINE_PREFIX);
+        if (rest != 0) return rest;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+// copy the first len bytes of key for the tree, a short result fit in the slot and long ones get an allocation of exactly len bytes
+static bool bptree_key_clone(const bptree_key_t* key, const uint32_t len, bptree_key_t* out) {
+    if (len <= BPTREE_KEY_INLINE_MAX) {
+        *out = bptree_key_make(bptree_key_data(key), len);
+        return true;
+    }
+    unsigned char* data = malloc(len);
+    if (!data) return false;
+    memcpy(data, bptree_key_data(key), len);
+    *out = bptree_key_make(data, len);
+    return true;
+}
+
+// length of the shortest prefix of right that is still greater than left (left < right)
+static uint32_t bptree_separator_len(const bptree_key_t* left, const bptree_key_t* right) {
+    const uint32_t common = left->len < right->len ? left->len : right->len;
+    uint32_t i = 0;
+    const unsigned char* left_data = bptree_key_data(left);
+    const unsigned char* right_data = bptree_key_data(right);
+    while (i < common && left_data[i] == right_data[i]) i++;
+    return i + 1; // right can't be a prefix of left so it has a byte at i
+}
+
+#else
+
+// comparing two numeric keys
+static int bptree_default_compare(const bptree_key_t* a, const bptree_key_t* b) {
+    return (*a < *b) ? -1 : ((*a > *b) ? 1 : 0);
+}
+
+#endif
+
+// give back the bytes of a key stored in a node, only variable length keys own memory
+static void bptree_key_release(bptree_key_t* key) {
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    if (key->len > BPTREE_KEY_INLINE_MAX) free((void*)bptree_key_data(key));
+#else
+    (void)key;
+#endif
+}
+
+/*
+    store a separator between left_max and right_min in slot
+    variable length keys get the shortest prefix of right_min that is above left_max, it is only a bound of the right subtree
+    the rebalance can't report an allocation failure so a failed copy is fatal
+*/
+static void bptree_set_separator(bptree_key_t* slot, const bptree_key_t* left_max, const bptree_key_t* right_min) {
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    bptree_key_t separator;
+    if (!bptree_key_clone(right_min, bptree_separator_len(left_max, right_min), &separator)) {
+        fprintf(stderr, "[BPTree FATAL] Out of memory while copying a separator.\n");
+        abort();
+    }
+    bptree_key_release(slot);
+    *slot = separator;
+#else
+    (void)left_max;
+    *slot = *right_min;
+#endif
+}
+
+// the leftmost or rightmost leaf under node
+static bptree_node* bptree_edge_leaf(bptree_node* node, const int max_keys, const bool rightmost) {
+    while (!node->is_leaf) {
+        node = bptree_node_children(node, max_keys)[rightmost ? node->num_keys : 0];
+    }
+    return node;
+}
+
+// finding the smallest key by going down in left
+static bptree_key_t bptree_find_smallest_key(bptree_node* node, const int max_keys) {
+    assert(node != NULL); // node is not null
+    while (!node->is_leaf) { // while the node is an internal node
+        assert(node->num_keys >= 0); // node is valid and has keys
+        node = bptree_node_children(node, max_keys)[0]; // get childrens and affect the very left one to variable nod
+        assert(node != NULL);
+    }
+    assert(node->num_keys > 0); // check if the node is valid and has keys
+    return bptree_node_key_at(node, 0); // return the very left key
+}
+
+static bptree_key_t bptree_find_largest_key(bptree_node* node, const int max_keys) {
+    assert(node != NULL);
+    while (!node->is_leaf) {
+        assert(node->num_keys >= 0); // for simplicity 
+        node = bptree_node_children(node, max_keys)[node->num_keys]; // num_keys + 1 because noode has one extra key so last element: the very right element
+        assert(node != NULL);
+    }
+    assert(node->num_keys > 0);
+    return bptree_node_key_at(node, node->num_keys - 1); // the normal last element
+}
+
+// keys held in the leaves, count less the puts still in the memtable
+static size_t bptree_leaf_keys(const bptree* tree) {
+#ifdef BPTREE_MEMTABLE
+    return (size_t)(tree->count - tree->memtable_count);
+#else
+    return (size_t)tree->count;
+#endif
+}
+
+// separators in the internal nodes under node
+static size_t bptree_count_separators(const bptree_node* node, const bptree* tree) {
+    if (node->is_leaf) return 0;
+    size_t count = (size_t)node->num_keys;
+    bptree_node** children = bptree_node_children((bptree_node*)node, tree->max_keys);
+    for (int i = 0; i <= node->num_keys; i++) count += bptree_count_separators(children[i], tree);
+    return count;
+}
+
+static int bptree_count_nodes(const bptree_node* node, const bptree* tree) {
+    if (!node) return 0;
+    if (node->is_leaf) return 1;
+    int count = 1;
+    bptree_node** children = bptree_node_children((bptree_node*)node, tree->max_keys);
+    for (int i = 0; i <= node->num_keys; i++) {
+        count += bptree_count_nodes(children[i], tree); // internal node has num_keys + 1 childrens
+    }
+    return count;
+}
+
+
+/*
+    the tree validator called after each interaction with the tree
+    validate :
+        structural properties (key ordering, node occupancy limites)
+        relational properties (parent-child key relationships)
+        tree properties (all leaves at same depth)
+    it checks :
+        sorted keys: keys within a node must be in ascending order
+        occupancy constraints: nodes must have appropriate number of keys (min <= keys <= max)
+        leaf depth uniformity: all leaves must be at the same depth
+        parent-child relationships:
+            all keys in child are <= key[i]
+            all keys in child are > key[i-1]
+        root special case: root has different occupancy rules
+*/
+
+
+
+static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree, const int depth, int* leaf_depth) {
+    if (!node) return false; // if node pointer is NULL, tree is invalide
+    const bptree_key_t* keys = bptree_node_keys(node); // get pointer to the keys array
+    const bool is_root = (tree->root == node); // check if the node is root
+
+#ifdef BPTREE_PREFIX_COMPRESSION
+    for (int i = 1; i < node->num_keys; i++) { // the remembered prefix must really be shared
+        if (memcmp(keys[0].data, keys[i].data, node->prefix_len) != 0) {
+            bptree_debug_print(tree->enable_debug, "Invariant Fail: key %d of node %p don't start with its %d bytes prefix\n", i, (void*)node, node->prefix_len);
+            return false;
+        }
+    }
+#endif
 
-static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree, const int depth, int* leaf_depth) {
-    if (!node) return false; // if node pointer is NULL, tree is invalide
-    const ptree_key_t* keys = bptree_node_keys(node); // get pointer to the keys array
-    const bool is_root = (tree->root == node); // check if the node is root
-
     // check that keys are in sorted order: increasing from left to right
     for(int i = 1; i < node->num_keys; i++) {
+#ifdef BPTREE_COMPRESSED_LEAVES
+        const bptree_key_t prev = bptree_node_key_at(node, i - 1), cur = bptree_node_key_at(node, i); // a packed leaf decode its keys
+        if (tree->compare(&prev, &cur) >= 0) {
+#else
         if (tree->compare(&keys[i - 1], &keys[i]) >= 0) { // compare keys: previous key shuld be smaller that the key
+#endif
             bptree_debug_print(tree->enable_debug, "Invariant Fail: Keys not sorted in node %p\n", (void*)node);
             return false;
         }
@@ -258,11 +1137,27 @@ static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree,
             return false;
         }
 
-        if (!is_root && (node->num_keys < tree->min_leaf_keys || node->num_keys > tree->max_keys)) { // check the keys count in a non-root node should be > min_leaf_keys and < max_keys
-            bptree_debug_print(tree->enable_debug; "Invariant Fail: leaf node %p key count out of range [%d, %d] (%d keys)\n", (void*)node, tree->min_leaf_keys, tree->max_keys, node->num_keys);
+#ifdef BPTREE_LAZY_REBALANCE
+        const int min_leaf_keys = 0; // lazy removes wait for bptree_compact (bptree_check_pending)
+#else
+        const bool edge = !node->next || node == bptree_edge_leaf(tree->root, tree->max_keys, false);
+        const int min_leaf_keys = edge ? 1 : tree->leaf_low; // the first and last leaf can be left small by a skewed split (bptree_split_point, bptree_append)
+#endif
+        if (!is_root && (node->num_keys < min_leaf_keys || node->num_keys > tree->max_keys)) { // check the keys count in a non-root node should be > min_leaf_keys and < max_keys
+            bptree_debug_print(tree->enable_debug, "Invariant Fail: leaf node %p key count out of range [%d, %d] (%d keys)\n", (void*)node, min_leaf_keys, tree->max_keys, node->num_keys);
             return false;
         }
 
+#ifdef BPTREE_MULTIMAP
+        for (int i = 0; i < node->num_keys; i++) { // every key keep at least one value
+            bptree_posting* posting = &bptree_node_values(node, tree->max_keys)[i];
+            if (posting->count == 0 || (posting->capacity && posting->count > posting->capacity) || (!posting->capacity && posting->count > BPTREE_POSTING_INLINE)) {
+                bptree_debug_print(tree->enable_debug, "Invariant Fail: bad posting list for key %d of leaf %p (%u values)\n", i, (void*)node, posting->count);
+                return false;
+            }
+        }
+#endif
+
         if (is_root && (node->num_keys > tree->max_keys && tree->count > 0)) { // special case: root leaf node - num keys > max keys
             bptree_debug_print(tree->enable_debug, "Invariant Fail: root leaf node %p key count > max_keys (%d > %d)\n", (void*)node, node->num_keys, tree->max_keys);
             return false;
@@ -277,8 +1172,8 @@ static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree,
         return true;
     } else {
         // if it's an internal node, check occupancy constraint: occupancy are the keys occupying the node, constraints are the rules
-        if (!is_root && (node->num_keys < tree->min_internal_keys || node->num_keys > tree->max_keys)) { // out of range case : n_key should be < max and > min
-            bptree_debug_print(tree->enable_debug, "Invariant Fail: Internal node %p key count out of range [%d, %d] (%d keys)\n", (void*)node, tree->min_internal_keys, tree->max_keys, node->num_keys);
+        if (!is_root && (node->num_keys < tree->internal_low || node->num_keys > tree->max_keys)) { // out of range case : n_key should be < max and > low watermark
+            bptree_debug_print(tree->enable_debug, "Invariant Fail: Internal node %p key count out of range [%d, %d] (%d keys)\n", (void*)node, tree->internal_low, tree->max_keys, node->num_keys);
             return false;
         }
 
@@ -292,6 +1187,15 @@ static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree,
             return false;
         }
 
+#ifdef BPTREE_MESSAGE_BUFFERS
+        for (int i = 1; i < node->num_messages; i++) { // one message per key, sorted
+            if (tree->compare(&node->messages[i - 1].key, &node->messages[i].key) >= 0) {
+                bptree_debug_print(tree->enable_debug, "Invariant Fail: Messages not sorted in node %p\n", (void*)node);
+                return false;
+            }
+        }
+#endif
+
         // get a pointer to the array of child pointers from internal node
         bptree_node** children = bptree_node_children(node, tree->max_keys);
         if (node->num_keys >= 0) {
@@ -300,10 +1204,10 @@ static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree,
                 return false;
             }
 
-            if (node->num_keys > 0 && (children[0]->num_keys > 0 || !children[0]->is_leaf)) { // if the children is an anternal node that has keys
+            if (node->num_keys > 0 && bptree_edge_leaf(children[0], tree->max_keys, true)->num_keys > 0) { // if the children has keys on its right edge
                 const bptree_key_t max_in_child0 = bptree_find_largest_key(children[0], tree->max_keys); // largest key in child node
                 if (tree->compare(&max_in_child0, &keys[0]) >= 0) { // if not : all the keys in child[0] left most child should be less than the left parent key
-                    bptree_debug_print(tree->enable_debug, "Invariant Fail: max(child[0]) >= key[0] in node %p --" "MaxChild=%lld key=%lld\n", (void*)node, (long long)max_in_child0, (long long)keys[0]);
+                    bptree_debug_print(tree->enable_debug, "Invariant Fail: max(child[0]) >= key[0] in node %p\n", (void*)node);
                     return false;
                 }
             }
@@ -319,24 +1223,31 @@ static bool bptree_check_invariants_node(bptree_node* node, const bptree* tree,
                     return false;
                 }
 
-                if (children[i]->num_keys > 0 || !children[i]->is_leaf) { // children is an internal non-leaf or leaf and has keys node and has keys
+                if (bptree_edge_leaf(children[i], tree->max_keys, false)->num_keys > 0) { // children has keys on its left edge
                     bptree_key_t min_in_child = bptree_find_smallest_key(children[i], tree->max_keys); // smaller children keys
+#if defined(BPTREE_MESSAGE_BUFFERS) || defined(BPTREE_KEY_TYPE_VARLEN) || defined(BPTREE_LAZY_REBALANCE)
+                    if (tree->compare(&keys[i - 1], &min_in_child) > 0) { // stale (messages, lazy removes) or truncated (variable length keys) separators are only a lower bound
+#else
                     if (tree->compare(&keys[i - 1], &min_in_child) != 0) { // in a node the i - 1'th key must equal the i'th children's minimum key 
+#endif
                         bptree_debug_print(tree->enable_debug, "Invariante Fail: key[%d] != min(child[%d]) in node %p\n", i-1, i, (void*)node);
                         return false;
                     }
+                }
 
-                    if (i < node->num_keys) { // if the children is in between first and last childrens
-                        bptree_key_t max_in_child = bptree_find_largest_key(children[i], tree->max_keys); // find the largest key in that children
-                        if (tree->compare(&max_in_child, &keys[i]) >= 0) { // all children[i]'s keys must be less than key[i]
-                            bptree_debug_print(tree->enable_debug, "Invariant Fail: max(child[%d]) >= key[%d] in node %p\n", i, i, (void*)node);
-                            return false;
-                        }
+                if (i < node->num_keys && bptree_edge_leaf(children[i], tree->max_keys, true)->num_keys > 0) { // if the children is in between first and last childrens
+                    bptree_key_t max_in_child = bptree_find_largest_key(children[i], tree->max_keys); // find the largest key in that children
+                    if (tree->compare(&max_in_child, &keys[i]) >= 0) { // all children[i]'s keys must be less than key[i]
+                        bptree_debug_print(tree->enable_debug, "Invariant Fail: max(child[%d]) >= key[%d] in node %p\n", i, i, (void*)node);
+                        return false;
                     }
-                } else if (children[i]->is_leaf && children[i]->num_keys == 0 && tree->count > 0) { // internal nodes shouldn't point to empty leaf in non-empty tree
+                }
+#ifndef BPTREE_LAZY_REBALANCE
+                if (children[i]->is_leaf && children[i]->num_keys == 0 && tree->count > 0) { // internal nodes shouldn't point to empty leaf in non-empty tree
                     bptree_debug_print(tree->enable_debug, "Invariant Fail: Internal node %p points to empty leaf child[%d] in non-empty tree\n", (void*)node, i);
                     return false;
                 }
+#endif
 
                 if (!bptree_check_invariants_node(children[i], tree, depth + 1, leaf_depth))  // depth + 1 because 
                     return false;
@@ -359,23 +1270,43 @@ static size_t bptree_node_alloc_size(const bptree* tree, const bool is_leaf) {
     const size_t keys_area_size = bptree_keys_area_size(max_keys);
     size_t data_payload_size;
     if (is_leaf) {
-        data_payload_size = (size_t)(max_keys + 1) * sizeof(bptree_value_t); // if it's a leaf node it will hold values + one extra value for temporary overflow during the insertion
+#ifdef BPTREE_KEYS_ONLY
+        data_payload_size = 0; // a set: the leaf is only its keys
+#else
+        data_payload_size = (size_t)(max_keys + 1) * sizeof(bptree_leaf_value_t); // if it's a leaf node it will hold values + one extra value for temporary overflow during the insertion
+#endif
     } else {
-        data_payload_size = (size_t)(max_keys + 2)* sizeof(bptree_node*); // if it's internal it will hold pointers, for n keys it will hold n+1 keys so max_keys + 1, and for temporary n + 1 (extra key) keys we need (n + 1) + 1
+        data_payload_size = (size_t)(max_keys + 2)* BPTREE_CHILD_REF_SIZE; // if it's internal it will hold pointers, for n keys it will hold n+1 keys so max_keys + 1, and for temporary n + 1 (extra key) keys we need (n + 1) + 1
     }
     const size_t total_data_size_ = keys_area_size + data_payload_size; // keys + values or pointers
     return sizeof(bptree_node) + total_data_size_; // size of the header(the structure) + total
 }
 
-// this function allocate a bptree node iwth the alignement and alignement is ensuring that the data will start at a memory adress that is multiple of their size making it easier for cpu
-static bptree_node* bptree_node_alloc(const bptree* tree, const bool is_leaf) {
+// alignment a node must start at
+static size_t bptree_node_align(const bool is_leaf) {
     size_t max_align = alignof(bptree_node); // return the required alignement for a type
     max_align = (max_align > alignof(bptree_key_t)) ? max_align : alignof(bptree_key_t); // find the maximum align of bptree_node(the header) and bptree_key
     if (is_leaf) {
-        max_align = (max_align > alignof(bptree_value_t)) ? max_align : alignof(bptree_value_t); // for a leaf that holds values find the largest one and return it
+        max_align = (max_align > alignof(bptree_leaf_value_t)) ? max_align : alignof(bptree_leaf_value_t); // for a leaf that holds values find the largest one and return it
     } else {
         max_align = (max_align > alignof(bptree_node*)) ? max_align : alignof(bptree_node*); // for internal that holds pointer to node find the largest and return it
     }
+    return max_align;
+}
+
+// count bytes about to be allocated for the tree, false if they would take it over its memory limit
+static bool bptree_memory_charge(bptree* tree, const size_t bytes) {
+    if (tree->memory_limit && tree->memory_used + bytes > tree->memory_limit) {
+        bptree_debug_print(tree->enable_debug, "Memory limit reached (%zu + %zu > %zu bytes)\n", tree->memory_used, bytes, tree->memory_limit);
+        return false;
+    }
+    tree->memory_used += bytes;
+    return true;
+}
+
+// this function allocate a bptree node iwth the alignement and alignement is ensuring that the data will start at a memory adress that is multiple of their size making it easier for cpu
+static bptree_node* bptree_node_alloc(bptree* tree, const bool is_leaf) {
+    const size_t max_align = bptree_node_align(is_leaf);
     size_t size = bptree_node_alloc_size(tree, is_leaf); // the total size needed for a node
     
     /* IT WORKS ONLY ON POW2 BITES 2, 4, 8, 16 ...
@@ -388,17 +1319,85 @@ static bptree_node* bptree_node_alloc(const bptree* tree, const bool is_leaf) {
         01010000 = 80 > 76 divisible by 8
     */
     size = (size + max_align - 1) & ~(max_align - 1); // ~(max_align - 1) is the mask or the gate where (max_align - 1)'s bits will be reversed then applie the gate on size + max_align - 1
+    if (!bptree_memory_charge(tree, size)) return NULL;
     bptree_node* node = aligned_alloc(max_align, size); // located in stdlib : allocate size starting from an adress that is multiple of max_align
     if (node) {
-        node->is_leaf = is leaf;
+        if (is_leaf) tree->leaf_nodes++; else tree->internal_nodes++;
+        node->is_leaf = is_leaf;
+        node->chunk_slot = 0;
         node->num_keys = 0;
         node->next = NULL;
+#ifdef BPTREE_COMPRESSED_LEAVES
+        node->key_width = 0;
+#endif
+#ifdef BPTREE_PREFIX_COMPRESSION
+        node->prefix_len = 0;
+#endif
+#ifdef BPTREE_PENDING_MARKS
+        node->pending = false;
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+        node->messages = NULL;
+        node->num_messages = 0;
+        node->message_capacity = 0;
+#endif
     } else {
+        tree->memory_used -= size;
         bptree_debug_print(tree->enable_debug, "Node allocation failed (size: %zu, align: %zu)\n", size, max_align);
     }
     return node;
 }
 
+/*
+    chunk of leaves written by bptree_defragment, the leaf slots follow this header
+    a chunk is freed with the last of its leaves, but the one still being filled
+*/
+typedef struct bptree_chunk {
+    int used; // slots handed out
+    int live; // leaves still in the tree
+} bptree_chunk;
+
+// bytes from the start of a chunk to its first leaf and between two leaves
+static size_t bptree_chunk_header(void) {
+    const size_t align = bptree_node_align(true);
+    return (sizeof(bptree_chunk) + align - 1) & ~(align - 1);
+}
+
+static size_t bptree_chunk_stride(const bptree* tree) {
+    const size_t align = bptree_node_align(true);
+    return (bptree_node_alloc_size(tree, true) + align - 1) & ~(align - 1);
+}
+
+static bptree_chunk* bptree_node_chunk(const bptree* tree, const bptree_node* node) {
+    return (bptree_chunk*)((char*)node - bptree_chunk_header() - (size_t)(node->chunk_slot - 1) * bptree_chunk_stride(tree));
+}
+
+// bytes of the allocation of a node that isn't in a chunk
+static size_t bptree_node_bytes(const bptree* tree, const bptree_node* node) {
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (node->key_width) return bptree_packed_size(node->num_keys, node->key_width);
+#endif
+    const size_t align = bptree_node_align(node->is_leaf);
+    return (bptree_node_alloc_size(tree, node->is_leaf) + align - 1) & ~(align - 1);
+}
+
+static void bptree_chunk_free(bptree* tree, bptree_chunk* chunk) {
+    tree->memory_used -= tree->chunk_size;
+    free(chunk);
+}
+
+// a node that leave the tree: freed, or dropped from its chunk
+static void bptree_node_release(bptree* tree, bptree_node* node) {
+    if (node->is_leaf) tree->leaf_nodes--; else tree->internal_nodes--;
+    if (!node->chunk_slot) {
+        tree->memory_used -= bptree_node_bytes(tree, node);
+        free(node);
+        return;
+    }
+    bptree_chunk* chunk = bptree_node_chunk(tree, node);
+    if (--chunk->live == 0 && chunk != tree->chunk) bptree_chunk_free(tree, chunk);
+}
+
 // recursively free a node and it's childrens
 static void bptree_free_node(bptree_node* node, bptree* tree) {
     if (!node) return;
@@ -407,10 +1406,48 @@ static void bptree_free_node(bptree_node* node, bptree* tree) {
         for (int i = 0; i <= node->num_keys; i++) {
             bptree_free_node(children[i], tree);
         }
+#ifdef BPTREE_MESSAGE_BUFFERS
+        free(node->messages);
+#endif
+    }
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    for (int i = 0; i < node->num_keys; i++) bptree_key_release(&bptree_node_keys(node)[i]); // leaf keys and separators each own their bytes
+#endif
+#ifdef BPTREE_MULTIMAP
+    if (node->is_leaf) {
+        for (int i = 0; i < node->num_keys; i++) bptree_posting_release(&bptree_node_values(node, tree->max_keys)[i]);
+    }
+#endif
+    bptree_node_release(tree, node);
+}
+
+#ifdef BPTREE_MESSAGE_BUFFERS
+// messages of the node buffer for keys under key
+static int bptree_buffer_count_below(const bptree* tree, const bptree_node* node, const bptree_key_t* key) {
+    int lo = 0, hi = node->num_messages;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if (tree->compare(&node->messages[mid].key, key) < 0) lo = mid + 1;
+        else hi = mid;
     }
-    free(node);
+    return lo;
 }
 
+/*
+    a borrow or merge of internal nodes move subtrees from a node to its sibling, the messages for them follow
+    n messages from index from of src go to index at of dst, bptree_buffer_reserve_path already made the room
+*/
+static void bptree_buffer_move(bptree_node* dst, const int at, bptree_node* src, const int from, const int n) {
+    if (n == 0) return;
+    assert(dst->num_messages + n <= dst->message_capacity);
+    memmove(&dst->messages[at + n], &dst->messages[at], (size_t)(dst->num_messages - at) * sizeof(bptree_message));
+    memcpy(&dst->messages[at], &src->messages[from], (size_t)n * sizeof(bptree_message));
+    dst->num_messages += n;
+    memmove(&src->messages[from], &src->messages[from + n], (size_t)(src->num_messages - from - n) * sizeof(bptree_message));
+    src->num_messages -= n;
+}
+#endif
+
 // rebalancing the tree upward from a given node
 /*
     after deletion, this function walks up the node stack and rebalances by borrowing keys from siblings or merging node if needed
@@ -431,34 +1468,48 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
             break;
         }
 
+        const int low = child->is_leaf ? tree->leaf_low : tree->internal_low;
+        if (child->num_keys >= low) { // under the minimum but not the low watermark, a few inserts can bring it back without a merge
+            tree->rebalances_deferred++;
+            bptree_debug_print(tree->enable_debug, "Rebalancing deferred at depth %d, child %d has %d keys (low watermark %d)\n", d, child_idx, child->num_keys, low);
+            break;
+        }
+
         bptree_debug_print(tree->enable_debug, "Rebalancing needed at depth %d for child %d (%d keys < min %d)\n", d, child_idx, child->num_keys, min_keys);
+        tree->version++;
+
+        // the merge below take the left sibling if there is one, when it would go over the high watermark a sibling lend a key as long as it stay over the low one
+        const bptree_node* merge_sibling = children[child_idx > 0 ? child_idx - 1 : child_idx + 1];
+        const int merged_keys = child->num_keys + merge_sibling->num_keys + (child->is_leaf ? 0 : 1); // an internal merge pull the separator down
+        int lend_min = merged_keys > (child->is_leaf ? tree->leaf_high : tree->internal_high) ? low : min_keys;
+        if (child->is_leaf && child->num_keys == 0) lend_min = tree->max_keys; // an empty leaf is freed by the merge, a borrow would only refill it to the boundary
 
         //Try borrowing frim the left sibling
         if (child_idx > 0) { // if not leftmostchild
             bptree_node* left_sibling = children[child_idx - 1]; // child_idx current child_idx - 1 left sibling 
-            const int left_min = left_sibling->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys;
-            if (left_sibling->num_keys > left_min) {
+            if (left_sibling->num_keys > lend_min) {
+                if (lend_min < min_keys) tree->merges_deferred++;
                 bptree_debug_print(tree->enable_debug, "Attempting borrow from left sibling (idx %d)\n", child_idx - 1);
                 bptree_key_t* parent_keys = bptree_node_keys(parent); // get the parent keys to update separator later
                 if (child->is_leaf) {
                     bptree_key_t* child_keys = bptree_node_keys(child); // retrieve keys
-                    bptree_value_t* child_vals = bptree_node_values(child, tree->max_keys); // retrieve values array because it's leaf
                     const bptree_key_t* left_keys = bptree_node_keys(left_sibling); // retrieve left sibling's keys array 
-                    const bptree_value_t* left_vals = bptree_node_values(left_sibling, tree->max_keys); // retrieve left sibling's values array 
                     
                     // shift keys and values right, to open space at index 0
                     // memove(des, src, n_bytes);
                     memmove(&child_keys[1], &child_keys[0], child->num_keys * sizeof(bptree_key_t)); // move the bytes in adress &child_keys[0] to &child_keys[1] by child->num_keys * sizeof(bptree_key_t) bytes
-                    memmove(&child_vals[1], &child_vals[0], child->num_keys * sizeof(bptree_value_t)); // move the bytes in adress &child_vals[0] to &child_vals[1] by child->num_key * sizeof(bptree_value_t) bytes
+                    bptree_leaf_move_values(tree, child, 1, child, 0, child->num_keys); // same for the values
                     
                     // move the last key/value from the left sibling.
                     child_keys[0] = left_keys[left_sibling->num_keys - 1];
-                    child_vals[0] = left_keys[left_sibling->num_keys - 1];
+                    bptree_leaf_move_values(tree, child, 0, left_sibling, left_sibling->num_keys - 1, 1);
                     child->num_keys++; // update keys count
                     left_sibling->num_keys--;
 
                     // update the parent separator
-                    parent_keys[child_idx - 1] = child_keys[0];
+                    bptree_set_separator(&parent_keys[child_idx - 1], &left_keys[left_sibling->num_keys - 1], &child_keys[0]);
+                    bptree_node_prefix_refresh(child); // child got a key and the parent a new separator
+                    bptree_node_prefix_refresh(parent);
                     bptree_debug_print(tree->enable_debug, "Borrowed leaf key from left. Parent key updated.\n");
                     break;
                 } else {
@@ -476,10 +1527,19 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
                     child_children[0] = left_children[left_sibling->num_keys]; // move the right most child pointer from left sibling
 
                     parent_keys[child_idx - 1] = left_keys[left_sibling->num_keys - 1]; // move the largest key of sibling to up parent
+#ifdef BPTREE_MESSAGE_BUFFERS
+                    const int kept = bptree_buffer_count_below(tree, left_sibling, &parent_keys[child_idx - 1]); // the messages of the moved child go with it
+                    bptree_buffer_move(child, 0, left_sibling, kept, left_sibling->num_messages - kept);
+#endif
 
                     // update the count
                     child->num_keys++;
                     left_sibling->num_keys--;
+#ifdef BPTREE_PENDING_MARKS
+                    child->pending |= left_sibling->pending; // the moved subtree can hold a leaf to compact
+#endif
+                    bptree_node_prefix_refresh(child); // child got a key and the parent a new separator
+                    bptree_node_prefix_refresh(parent);
                     bptree_debug_print(tree->enable_debug, "Borrowed internal key/child from left. Parent key updated.\n");
                     break;
                 }
@@ -489,29 +1549,29 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
         // try borrowing from right siblings
         if (child_idx < parent->num_keys) { // if it's not the rightmost child
             bptree_node* right_sibling = children[child_idx + 1]; // get the right sibling
-            const int right_min = right_sibling->is_leaf ? tree->min_leaf_keys : tree->min_internal_keys; // check if leaf or internal and get minimum key
-            if (right_sibling->num_keys > right_min) { // if right sibling has more than minimum
+            if (right_sibling->num_keys > lend_min) { // if right sibling has more than minimum
+                if (lend_min < min_keys) tree->merges_deferred++;
                 bptree_debug_print(tree->enable_debug, "Attempting borrow from right sibling (idx %d)\n", child_idx + 1);
                 bptree_key_t* parent_keys = bptree_node_keys(parent); // get the key separator
                 if (child->is_leaf) {
                     // Leaf node borrow form right sibling
                     bptree_key_t* child_keys = bptree_node_keys(child); // get the keys
-                    bptree_value_t* child_vals = bptree_node_values(child, tree->max_keys); // get values
                     bptree_key_t* right_keys = bptree_node_keys(right_sibling); // get keys of right sibling
-                    bptree_value_t* right_vals = bptree_node_values(right_sibling, tree->max_keys); // get the values of right sibling
 
                     // borrow the first key/value from the right sibling
                     child_keys[child->num_keys] = right_keys[0]; // move the leftmost key in the right sibling to the extra key
-                    child_vals[child->num_keys] = right_vals[0]; // do the same with values
+                    bptree_leaf_move_values(tree, child, child->num_keys, right_sibling, 0, 1); // do the same with values
                     child->num_keys++; // update
-                    right_sibling->num_keys++; // update
+                    right_sibling->num_keys--; // update
 
                     // shift right sibling's keys/values left.
                     memmove(&right_keys[0], &right_keys[1], right_sibling->num_keys * sizeof(bptree_key_t));
-                    memmove(&right_vals[0], &right_vals[1], right_sibling->num_keys * sizeof(bptree_value_t));
+                    bptree_leaf_move_values(tree, right_sibling, 0, right_sibling, 1, right_sibling->num_keys);
 
                     // make the leftmost key in rightsibling as separator
-                    parent_keys[child_idx] = right_keys[0];
+                    bptree_set_separator(&parent_keys[child_idx], &child_keys[child->num_keys - 1], &right_keys[0]);
+                    bptree_node_prefix_refresh(child); // child got a key and the parent a new separator
+                    bptree_node_prefix_refresh(parent);
                     bptree_debug_print(tree->enable_debug, "Borrowed leaf key from right. Parent key updated.\n");
                     
                     break;
@@ -520,19 +1580,27 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
                     bptree_key_t* child_keys = bptree_node_keys(child); // get node keys
                     bptree_node** child_children = bptree_node_children(child, tree->max_keys); // get childrens
                     bptree_key_t* right_keys = bptree_node_keys(right_sibling); // get the rightsibling's keys
-                    bptree_node** right_children = bptree_node_children(right_children, tree->max_keys); // get the rightsibling childrens
+                    bptree_node** right_children = bptree_node_children(right_sibling, tree->max_keys); // get the rightsibling childrens
                     child_keys[child->num_keys] = parent_keys[child_idx]; // make the parent key as the extra node key
                     child_children[child->num_keys + 1] = right_children[0]; // make the extra child as the leftmost child of right sibling
-                    parent_key[child_idx] = right_keys[0];
+                    parent_keys[child_idx] = right_keys[0];
+#ifdef BPTREE_MESSAGE_BUFFERS
+                    bptree_buffer_move(child, child->num_messages, right_sibling, 0, bptree_buffer_count_below(tree, right_sibling, &parent_keys[child_idx]));
+#endif
                     
                     // update the counts
-                    child->num_key++;
+                    child->num_keys++;
                     right_sibling->num_keys--;
+#ifdef BPTREE_PENDING_MARKS
+                    child->pending |= right_sibling->pending;
+#endif
 
                     // make room in 0 key/childrens of right sibling
                     memmove(&right_keys[0], &right_keys[1], right_sibling->num_keys * sizeof(bptree_key_t));
-                    memmove(&right_children[0], &right_children[1], right_sibling->num_keys * sizeof(bptree_node*))
+                    memmove(&right_children[0], &right_children[1], (right_sibling->num_keys + 1) * sizeof(bptree_node*)); // one more child than keys
 
+                    bptree_node_prefix_refresh(child); // child got a key and the parent a new separator
+                    bptree_node_prefix_refresh(parent);
                     bptree_debug_print(tree->enable_debug, "Borrowed internal key/child from right. Parent key updated.\n");
                     break;
                 }
@@ -547,23 +1615,23 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
             bptree_debug_print(tree->enable_debug, "Merging child %d into left sibling %d\n", child_idx, child_idx - 1);
             if (child->is_leaf) {
                 bptree_key_t* left_keys = bptree_node_keys(left_sibling); // key left sibling's keys
-                bptree_value_t* left_vals = bptree_node_values(left_sibling, tree->max_keys); // get the leftsibling's values
                 const bptree_key_t* child_keys = bptree_node_keys(child);
-                const bptree_value_t* child_vals = bptree_node_values(child, tree->max_keys);
                 const int combined_keys = left_sibling->num_keys + child->num_keys;
                 if (combined_keys > tree->max_keys) {
                     fprintf(stderr, "[BPTree FATAL] Merge-Left (Leaf) Buffer Overflow PREVENTED! Combined keys %d > max_keys %d.\n", combined_keys, tree->max_keys);
-                    abord();
+                    abort();
                 }
 
                 // copy all keys and values from child to the left sibling
                 memcpy(left_keys + left_sibling->num_keys, child_keys, child->num_keys * sizeof(bptree_key_t)); // copy child_keys to left_keys[left_sibling->num_keys]
-                memcpy(left_vals + left_sibling->num_keys, child_vals, child->num_keys * sizeof(bptree_value_t)); // copy child_vals to left_vals[left_sibling->num_keys]
+                bptree_leaf_move_values(tree, left_sibling, left_sibling->num_keys, child, 0, child->num_keys); // copy child values to left values[left_sibling->num_keys]
 
                 left_sibling->num_keys = combined_keys;
                 left_sibling->next = child->next; // child will be deleted it's next is the leftsibling's next
+                bptree_key_release(&bptree_node_keys(parent)[child_idx - 1]); // the separator is dropped below, nothing take it
                 
-                free(child);
+                if (tree->rightmost == child) tree->rightmost = left_sibling;
+                bptree_node_release(tree, child);
                 children[child_idx] = NULL;
             } else { // if it's an internal node 
                 bptree_key_t* left_keys = bptree_node_keys(left_sibling); // again get the leftsibling's key
@@ -575,7 +1643,7 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
                 if (combined_keys > tree->max_keys) { // if combined keys are larger that max keys : overflow
                     fprintf(stderr, "[BPTree FATAL] Merge-Left (Internal) Key Buffer Overflow PREVENTED! Combined keys %d > buffer %d.\n",
                             combined_keys, tree->max_keys);
-                            abord();
+                            abort();
                 }
                 if (combined_children > tree->max_keys + 1) { // if combined childrens are larger that max childrens : overflow
                     fprintf(stderr,
@@ -586,6 +1654,7 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
                 }
 
                 // move the parent separator to the very right
+                const bptree_key_t* parent_keys = bptree_node_keys(parent);
                 left_keys[left_sibling->num_keys] = parent_keys[child_idx - 1];
                 
                 // move the keys/childrens in right node to the left node after parent separator
@@ -593,8 +1662,15 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
                 memcpy(left_children + left_sibling->num_keys + 1, child_children, (child->num_keys + 1) * sizeof(bptree_node*));
 
                 // update left node num keys and delete the child
-                left_sibling->num_keys = combined_children;
-                free(child);
+                left_sibling->num_keys = combined_keys;
+#ifdef BPTREE_PENDING_MARKS
+                left_sibling->pending |= child->pending;
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+                bptree_buffer_move(left_sibling, left_sibling->num_messages, child, 0, child->num_messages);
+                free(child->messages);
+#endif
+                bptree_node_release(tree, child);
                 children[child_idx] = NULL;
             }
 
@@ -603,36 +1679,37 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
             memmove(&parent_keys[child_idx - 1], &parent_keys[child_idx], (parent->num_keys - child_idx) * sizeof(bptree_key_t)); // move the key to the previous key which is the separator
             memmove(&children[child_idx], &children[child_idx + 1], (parent->num_keys - child_idx) * sizeof(bptree_node*)); // move the merged node into to deleted node
             parent->num_keys--; // keys dec
+            bptree_node_prefix_refresh(left_sibling);
             bptree_debug_print(tree->enable_debug, "Merge with left complete. Parent updated.\n");
         } else {
             // Merge with right sibling if no left sibling is available
             bptree_node* right_sibling = children[child_idx + 1];
             bptree_debug_print(tree->enable_debug, "Mergin right sibling %d into child %d\n", child_idx + 1, child_idx);
             if (child->is_leaf) {
-                bptree_key_t* child_key = bptree_node_keys(child);
-                bptree_value_t* child_vals = bptree_node_values(child, tree->max_keys);
+                bptree_key_t* child_keys = bptree_node_keys(child);
                 const bptree_key_t* right_keys = bptree_node_keys(right_sibling);
-                const bptree_value_t* right_vals = bptree_node_values(right_sibling, tree->max_keys);
-                const int combined_keys = child->num_keys + right_children->num_keys;
+                const int combined_keys = child->num_keys + right_sibling->num_keys;
                 if (combined_keys > tree->max_keys) {
                     fprintf(stderr, "[BPTree FATAL] Merge-Right (Leaf) Buffer Overflow PREVENTED! Combined keys %d > max_keys %d.\n", combined_keys, tree->max_keys);
-                    abord();
+                    abort();
                 }
 
                 memcpy(child_keys + child->num_keys, right_keys, right_sibling->num_keys * sizeof(bptree_key_t));
-                memcpy(child_vals + child->num_keys, right_vals, right_sibling->num_keys * sizeof(bptree_value_t));
+                bptree_leaf_move_values(tree, child, child->num_keys, right_sibling, 0, right_sibling->num_keys);
 
 
                 child->num_keys = combined_keys;
                 child->next = right_sibling->next;
+                bptree_key_release(&bptree_node_keys(parent)[child_idx]); // the separator is dropped below
 
-                free(right_children);
+                if (tree->rightmost == right_sibling) tree->rightmost = child;
+                bptree_node_release(tree, right_sibling);
                 children[child_idx + 1] = NULL;
             } else {
                 bptree_key_t* child_keys = bptree_node_keys(child);
                 bptree_node** child_children = bptree_node_children(child, tree->max_keys);
                 const bptree_key_t* right_keys = bptree_node_keys(right_sibling);
-                const bptree_node** right_children = bptree_node_children(right_children, tree->max_keys);
+                bptree_node** right_children = bptree_node_children(right_sibling, tree->max_keys);
                 const bptree_key_t* parent_keys = bptree_node_keys(parent);
                 const int combined_keys = child->num_keys + 1 + right_sibling->num_keys;
                 const int combined_children = child->num_keys + 1 + right_sibling->num_keys + 1;
@@ -652,12 +1729,19 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
                 }
                 child_keys[child->num_keys] = parent_keys[child_idx];
 
-                memcpy(child_keys + child->num_keys + 1, right_keys, (right_sibling->num_keys + 1) * sizeof(bptree_key_t));
+                memcpy(child_keys + child->num_keys + 1, right_keys, right_sibling->num_keys * sizeof(bptree_key_t));
                 memcpy(child_children + child->num_keys + 1, right_children, (right_sibling->num_keys + 1) * sizeof(bptree_node*));
                 
                 child->num_keys = combined_keys;
-                free(right_sibling);
-                children[child_idx] = NULL;
+#ifdef BPTREE_PENDING_MARKS
+                child->pending |= right_sibling->pending;
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+                bptree_buffer_move(child, child->num_messages, right_sibling, 0, right_sibling->num_messages);
+                free(right_sibling->messages);
+#endif
+                bptree_node_release(tree, right_sibling);
+                children[child_idx + 1] = NULL;
             }
             bptree_key_t* parent_keys = bptree_node_keys(parent);
             memmove(&parent_keys[child_idx], &parent_keys[child_idx + 1],
@@ -665,31 +1749,3397 @@ static void bptree_rebalance_up(bptree* tree, bptree_node** node_stack, // node_
             memmove(&children[child_idx + 1], &children[child_idx + 2],
                     (parent->num_keys - child_idx - 1) * sizeof(bptree_node*));
             parent->num_keys--;
+            bptree_node_prefix_refresh(child);
             bptree_debug_print(tree->enable_debug, "Merge with right complete. Parent updated.\n");
 
         }
     }
     
     // check a special case when root can became empty and depth is reduced
-    if (tree->root && !tree->root->is_leaf && tree->root->num_keys == 0 && tree->count > 0) {
+    if (tree->root && !tree->root->is_leaf && tree->root->num_keys == 0) {
         bptree_debug_print(tree->enable_debug, "root node is internal and empty, shrinking height.\n");
         bptree_node* old_root = tree->root;
         tree->root = bptree_node_children(old_root, tree->max_keys)[0];
         tree->height--;
-        free(old_root);
-    } else if (tree->count == 0 && tree->root && tree->root->num_keys != 0) {
+#ifdef BPTREE_MESSAGE_BUFFERS
+        assert(old_root->num_messages == 0); // bptree_compact_step flush a root with one key before it can collapse
+        free(old_root->messages);
+#endif
+        bptree_node_release(tree, old_root);
+    } else if (tree->count == 0 && tree->root && tree->root->is_leaf && tree->root->num_keys != 0) { // a lazy remove can empty the tree under internal nodes
         bptree_debug_print(tree->enable_debug, "Tree empty, ensuring root node is empty.\n");
         tree->root->num_keys = 0;
     }
 }
 
+// descend from the root to the leaf that cover key
+// node_stack/index_stack (optional) record the path like bptree_rebalance_up read it: node_stack[d] is the node at depth d and index_stack[d] the child taken in it
+static bptree_node* bptree_find_leaf(const bptree* tree, const bptree_key_t* key, bptree_node** node_stack, int* index_stack, int* depth) {
+    bptree_node* node = tree->root;
+    int d = 0;
+    while (!node->is_leaf) {
+        const int idx = bptree_node_child_index(tree, node, key);
+        if (node_stack) {
+            node_stack[d] = node;
+            index_stack[d] = idx;
+        }
+        node = bptree_node_children(node, tree->max_keys)[idx];
+        d++;
+    }
+    if (node_stack) node_stack[d] = node;
+    if (depth) *depth = d;
+    return node;
+}
 
+// the separator bounding on the right the leaf at the end of a recorded path, false for the rightmost leaf
+static bool bptree_path_high_key(bptree_node** node_stack, const int* index_stack, const int depth, bptree_key_t* high_key) {
+    for (int d = depth - 1; d >= 0; d--) {
+        if (index_stack[d] < node_stack[d]->num_keys) {
+            *high_key = bptree_node_keys(node_stack[d])[index_stack[d]];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    put leaf in place of child i of node_stack[d] (the root when d is -1), an other copy of the same keys
+    the path above node_stack[d] find the leaf before it, whose next pointer move to the new copy
+*/
+static void bptree_replace_leaf(bptree* tree, bptree_node** node_stack, const int* index_stack, const int d, const int i, bptree_node* leaf) {
+    bptree_node** slot = d < 0 ? &tree->root : &bptree_node_children(node_stack[d], tree->max_keys)[i];
+    bptree_node* prev = NULL;
+    if (d >= 0 && i > 0) {
+        prev = bptree_node_children(node_stack[d], tree->max_keys)[i - 1];
+    } else {
+        for (int up = d - 1; up >= 0 && !prev; up--) { // the closest ancestor where the path don't take the first child
+            if (index_stack[up] > 0) prev = bptree_edge_leaf(bptree_node_children(node_stack[up], tree->max_keys)[index_stack[up] - 1], tree->max_keys, true);
+        }
+    }
+    if (prev) prev->next = leaf;
+    if (tree->rightmost == *slot) tree->rightmost = leaf;
+    tree->version++;
+    *slot = leaf;
+}
+
+// open a slot at idx in a leaf and store the pair there, a leaf has room for one extra key before it's split
+static void bptree_leaf_insert_at(const bptree* tree, bptree_node* leaf, const int idx, const bptree_key_t* key, const bptree_value_t value) {
+    bptree_key_t* keys = bptree_node_keys(leaf);
+    memmove(&keys[idx + 1], &keys[idx], (size_t)(leaf->num_keys - idx) * sizeof(bptree_key_t));
+    bptree_leaf_move_values(tree, leaf, idx + 1, leaf, idx, leaf->num_keys - idx);
+    keys[idx] = *key;
+#ifdef BPTREE_KEYS_ONLY
+    (void)value;
+#elif defined(BPTREE_MULTIMAP)
+    bptree_posting* posting = &bptree_node_values(leaf, tree->max_keys)[idx]; // a new key start with a one value list
+    posting->count = 1;
+    posting->capacity = 0;
+    posting->inline_values[0] = value;
+#else
+    bptree_node_values(leaf, tree->max_keys)[idx] = value;
+#endif
+    leaf->num_keys++;
+    bptree_node_prefix_refresh(leaf);
 }
-    
 
+// close the slot at idx in a leaf
+static void bptree_leaf_remove_at(const bptree* tree, bptree_node* leaf, const int idx) {
+    bptree_key_t* keys = bptree_node_keys(leaf);
+    memmove(&keys[idx], &keys[idx + 1], (size_t)(leaf->num_keys - idx - 1) * sizeof(bptree_key_t));
+    bptree_leaf_move_values(tree, leaf, idx, leaf, idx + 1, leaf->num_keys - idx - 1);
+    leaf->num_keys--;
+}
+
+// nodes allocated before an insert touch the tree
+typedef struct bptree_split_reserve {
+    bptree_node* nodes[BPTREE_MAX_HEIGHT + 1]; // nodes[0] is the new leaf, then one internal node per level that split, then the new root
+    int count; // nodes allocated
+    int used; // nodes taken by the splits
+} bptree_split_reserve;
+
+static void bptree_release_split_nodes(bptree* tree, bptree_split_reserve* reserve) {
+    for (int i = reserve->used; i < reserve->count; i++) {
+#ifdef BPTREE_MESSAGE_BUFFERS
+        free(reserve->nodes[i]->messages);
+#endif
+        bptree_node_release(tree, reserve->nodes[i]);
+    }
+    reserve->count = reserve->used;
+}
 
+/*
+    allocate every node an insert in this leaf can need before anything is modified
+        a full leaf split, then each full ancestor split too, and if the root split a new root go on top
+    so an allocation failure leave the tree untouched instead of half split
+*/
+static bool bptree_reserve_split_nodes(bptree* tree, const bptree_node* leaf, bptree_node** node_stack, const int depth, bptree_split_reserve* reserve) {
+    reserve->count = 0;
+    reserve->used = 0;
+    if (leaf->num_keys < tree->max_keys) return true; // the key fit without split
+    int needed = 1; // the new leaf
+    int d = depth - 1;
+    while (d >= 0 && node_stack[d]->num_keys == tree->max_keys) { // this ancestor overflow when it get the separator
+        needed++;
+        d--;
+    }
+    if (d < 0) { // the root split: a new root on top
+        if (tree->height >= BPTREE_MAX_HEIGHT) {
+            bptree_debug_print(tree->enable_debug, "Tree can't grow over BPTREE_MAX_HEIGHT (%d)\n", BPTREE_MAX_HEIGHT);
+            return false;
+        }
+        needed++;
+    }
+    for (int i = 0; i < needed; i++) {
+        bptree_node* node = bptree_node_alloc(tree, i == 0);
+        if (!node) {
+            bptree_release_split_nodes(tree, reserve);
+            return false;
+        }
+        reserve->nodes[reserve->count++] = node;
+#ifdef BPTREE_MESSAGE_BUFFERS
+        const int level = depth - i; // the internal node this one is the right half of
+        // its buffer is split too, and the parent of the leaves get room for a batch a failed flush give back (bptree_buffer_restore)
+        const int capacity = level >= 0 ? node_stack[level]->num_messages + (i == 1 ? BPTREE_MESSAGE_BUFFER_SIZE : 0) : 0;
+        if (i > 0 && capacity > 0) {
+            node->messages = malloc((size_t)capacity * sizeof(bptree_message));
+            if (!node->messages) {
+                bptree_release_split_nodes(tree, reserve);
+                return false;
+            }
+            node->message_capacity = capacity;
+        }
+#endif
+    }
+    return true;
+}
 
+// move the keys after the first left_keys of an overflowing leaf to right and link right after it, return the separator (first key of right)
+static bptree_key_t bptree_split_leaf(const bptree* tree, bptree_node* leaf, bptree_node* right, const int left_keys) {
+    const int right_keys = leaf->num_keys - left_keys;
+    memcpy(bptree_node_keys(right), &bptree_node_keys(leaf)[left_keys], (size_t)right_keys * sizeof(bptree_key_t));
+    bptree_leaf_move_values(tree, right, 0, leaf, left_keys, right_keys);
+    right->num_keys = right_keys;
+    leaf->num_keys = left_keys;
+    right->next = leaf->next;
+    leaf->next = right;
+    bptree_node_prefix_refresh(leaf); // each half can share a longer prefix
+    bptree_node_prefix_refresh(right);
+    return bptree_node_keys(right)[0];
+}
 
+// move keys between two neighbour leaves until left hold left_keys of them, the parent separator is left to the caller
+static void bptree_leaf_shift(const bptree* tree, bptree_node* left, bptree_node* right, const int left_keys) {
+    bptree_key_t* left_keys_array = bptree_node_keys(left);
+    bptree_key_t* right_keys_array = bptree_node_keys(right);
+    if (left->num_keys > left_keys) { // the tail of left go to the front of right
+        const int n = left->num_keys - left_keys;
+        memmove(&right_keys_array[n], &right_keys_array[0], (size_t)right->num_keys * sizeof(bptree_key_t));
+        bptree_leaf_move_values(tree, right, n, right, 0, right->num_keys);
+        memcpy(&right_keys_array[0], &left_keys_array[left_keys], (size_t)n * sizeof(bptree_key_t));
+        bptree_leaf_move_values(tree, right, 0, left, left_keys, n);
+        left->num_keys -= n;
+        right->num_keys += n;
+    } else if (left->num_keys < left_keys) { // the head of right go to the end of left
+        const int n = left_keys - left->num_keys;
+        memcpy(&left_keys_array[left->num_keys], &right_keys_array[0], (size_t)n * sizeof(bptree_key_t));
+        bptree_leaf_move_values(tree, left, left->num_keys, right, 0, n);
+        memmove(&right_keys_array[0], &right_keys_array[n], (size_t)(right->num_keys - n) * sizeof(bptree_key_t));
+        bptree_leaf_move_values(tree, right, 0, right, n, right->num_keys - n);
+        left->num_keys += n;
+        right->num_keys -= n;
+    }
+    bptree_node_prefix_refresh(left);
+    bptree_node_prefix_refresh(right);
+}
 
+// split an overflowing internal node around its middle key, the middle key move up and is returned
+static bptree_key_t bptree_split_internal(const bptree* tree, bptree_node* node, bptree_node* right) {
+    bptree_key_t* keys = bptree_node_keys(node);
+    bptree_node** children = bptree_node_children(node, tree->max_keys);
+    const int mid = node->num_keys / 2;
+    const int right_keys = node->num_keys - mid - 1;
+    memcpy(bptree_node_keys(right), &keys[mid + 1], (size_t)right_keys * sizeof(bptree_key_t));
+    memcpy(bptree_node_children(right, tree->max_keys), &children[mid + 1], (size_t)(right_keys + 1) * sizeof(bptree_node*));
+    right->num_keys = right_keys;
+    node->num_keys = mid;
+#ifdef BPTREE_PENDING_MARKS
+    right->pending = node->pending; // the leaf to compact can be in either half
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+    int first_right = 0; // messages for keys >= the promoted key belong to the right half
+    while (first_right < node->num_messages && tree->compare(&node->messages[first_right].key, &keys[mid]) < 0) first_right++;
+    right->num_messages = node->num_messages - first_right;
+    if (right->num_messages > 0) memcpy(right->messages, &node->messages[first_right], (size_t)right->num_messages * sizeof(bptree_message));
+    node->num_messages = first_right;
+#endif
+    bptree_node_prefix_refresh(node);
+    bptree_node_prefix_refresh(right);
+    return keys[mid];
+}
+
+// insert separator/right after the child at depth d on the path, splitting the ancestors that overflow with the reserved nodes
+static void bptree_insert_into_parent(bptree* tree, bptree_node** node_stack, const int* index_stack, int d,
+                                      bptree_key_t separator, bptree_node* right, bptree_split_reserve* reserve) {
+    const int max_keys = tree->max_keys;
+    tree->version++;
+    while (d > 0) {
+        d--;
+        bptree_node* parent = node_stack[d];
+        bptree_key_t* keys = bptree_node_keys(parent);
+        bptree_node** children = bptree_node_children(parent, max_keys);
+        const int pos = index_stack[d]; // the split child, the new sibling go just after it
+        memmove(&keys[pos + 1], &keys[pos], (size_t)(parent->num_keys - pos) * sizeof(bptree_key_t));
+        memmove(&children[pos + 2], &children[pos + 1], (size_t)(parent->num_keys - pos) * sizeof(bptree_node*));
+        keys[pos] = separator;
+        children[pos + 1] = right;
+        parent->num_keys++;
+        bptree_node_prefix_refresh(parent);
+        if (parent->num_keys <= max_keys) return;
+
+        right = reserve->nodes[reserve->used++];
+        separator = bptree_split_internal(tree, parent, right);
+        bptree_debug_print(tree->enable_debug, "Split internal node %p at depth %d\n", (void*)parent, d);
+    }
+
+    // the root was split: a new root with one separator and two childrens
+    bptree_node* root = reserve->nodes[reserve->used++];
+    bptree_node_keys(root)[0] = separator;
+    bptree_node_children(root, max_keys)[0] = node_stack[0];
+    bptree_node_children(root, max_keys)[1] = right;
+    root->num_keys = 1;
+#ifdef BPTREE_PENDING_MARKS
+    root->pending = node_stack[0]->pending;
+#endif
+    bptree_node_prefix_refresh(root);
+    tree->root = root;
+    tree->height++;
+    bptree_debug_print(tree->enable_debug, "Root split, new height %d\n", tree->height);
+}
+
+#ifdef BPTREE_KEY_TYPE_VARLEN
+// truncated separator of the split a full leaf will do once key is inserted at idx
+static bool bptree_leaf_split_separator(const bptree* tree, const bptree_node* leaf, const int idx, const bptree_key_t* key, const int mid, bptree_key_t* out) {
+    (void)tree;
+    const bptree_key_t* keys = bptree_node_keys(leaf); // bptree_split_leaf keep mid keys on the left
+    const bptree_key_t* left_max = mid - 1 < idx ? &keys[mid - 1] : (mid - 1 == idx ? key : &keys[mid - 2]);
+    const bptree_key_t* right_min = mid < idx ? &keys[mid] : (mid == idx ? key : &keys[mid - 1]);
+    return bptree_key_clone(right_min, bptree_separator_len(left_max, right_min), out);
+}
+#endif
+
+// remember where this insert go, an insert at the next slot of the same leaf extend an ascending run, at the same slot a descending one
+static void bptree_track_insert(bptree* tree, const bptree_node* leaf, const int idx) {
+    if (leaf == tree->run_leaf && idx == tree->run_idx + 1) tree->run = tree->run > 0 ? tree->run + 1 : 1;
+    else if (leaf == tree->run_leaf && idx == tree->run_idx) tree->run = tree->run < 0 ? tree->run - 1 : -1;
+    else tree->run = 0;
+    tree->run_leaf = leaf;
+    tree->run_idx = idx;
+}
+
+/*
+    keys the left half keep when a full leaf split once the new key is at idx (max_keys + 1 keys)
+        random inserts: the median
+        ascending run: the split is just after the new key so the left leaf stay as full as possible
+        descending run: just before it so the right leaf does
+    each side keep min_leaf_keys, except the first and the last leaf of the tree that can go down to one key
+*/
+static int bptree_split_point(const bptree* tree, const bptree_node* leaf, const int idx, const int* index_stack, const int depth) {
+    const int n = leaf->num_keys + 1;
+    bool first_leaf = true;
+    for (int d = 0; d < depth && first_leaf; d++) first_leaf = index_stack[d] == 0;
+    const int min_left = first_leaf ? 1 : tree->min_leaf_keys;
+    const int min_right = leaf->next ? tree->min_leaf_keys : 1;
+    int left = n / 2;
+    if (tree->run >= BPTREE_SPLIT_RUN) left = idx + 1;
+    else if (tree->run <= -BPTREE_SPLIT_RUN) left = idx;
+    if (left < min_left) left = min_left;
+    if (left > n - min_right) left = n - min_right;
+    return left;
+}
+
+// the neighbour under the same parent a full leaf can spread its keys into, the one with the fewest keys, -1 when there is none
+static int bptree_spread_sibling(const bptree* tree, bptree_node** node_stack, const int* index_stack, const int depth) {
+    const bptree_node* parent = node_stack[depth - 1];
+    bptree_node** children = bptree_node_children((bptree_node*)parent, tree->max_keys);
+    const int pos = index_stack[depth - 1];
+    int best = -1;
+    for (int sibling = pos - 1; sibling <= pos + 1; sibling += 2) {
+        if (sibling < 0 || sibling > parent->num_keys) continue;
+#ifdef BPTREE_COMPRESSED_LEAVES
+        if (children[sibling]->key_width) continue; // a packed leaf is only rewritten by its own writes
+#endif
+        if (best < 0 || children[sibling]->num_keys < children[best]->num_keys) best = sibling;
+    }
+    return best;
+}
+
+#ifdef BPTREE_KEY_TYPE_VARLEN
+// truncated separator in front of key i of the pair left, right once key is inserted at ins
+static bool bptree_pair_separator(const bptree_node* left, const bptree_node* right, const int ins, const bptree_key_t* key, const int i, bptree_key_t* out) {
+    const bptree_key_t* around[2];
+    for (int k = 0; k < 2; k++) {
+        const int j = i - 1 + k;
+        const int stored = j < ins ? j : j - 1; // its slot before the insert
+        around[k] = j == ins ? key
+                  : stored < left->num_keys ? &bptree_node_keys(left)[stored] : &bptree_node_keys(right)[stored - left->num_keys];
+    }
+    return bptree_key_clone(around[1], bptree_separator_len(around[0], around[1]), out);
+}
+#endif
+
+/*
+    B* insert in a full leaf, with the neighbour picked by bptree_spread_sibling
+        the neighbour has room: the keys of both and the new one are spread evenly over the two, nothing is allocated
+        the neighbour is full too: the two become three leaves about 2/3 full instead of a split leaving two half full
+*/
+static bptree_status bptree_insert_spread(bptree* tree, const int idx, const bptree_key_t* key, const bptree_value_t value,
+                                          bptree_node** node_stack, const int* index_stack, const int depth, const int sibling) {
+    bptree_node* leaf = node_stack[depth];
+    bptree_node* parent = node_stack[depth - 1];
+    const int pos = index_stack[depth - 1] < sibling ? index_stack[depth - 1] : sibling; // the left one of the pair
+    bptree_node* left = bptree_node_children(parent, tree->max_keys)[pos];
+    bptree_node* right = bptree_node_children(parent, tree->max_keys)[pos + 1];
+    const int ins = leaf == left ? idx : left->num_keys + idx; // the new key position in the pair
+    const int total = left->num_keys + right->num_keys + 1;
+    const bool three = total > 2 * tree->max_keys;
+    const int left_keys = three ? total / 3 : total / 2;
+    const int middle_keys = three ? (total - left_keys) / 2 : total - left_keys;
+
+    bptree_split_reserve reserve;
+    reserve.count = 0;
+    reserve.used = 0;
+    if (three && !bptree_reserve_split_nodes(tree, leaf, node_stack, depth, &reserve)) return BPTREE_ALLOCATION_FAILURE;
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    bptree_key_t stored; // copies made before the leaves change, like bptree_insert_at
+    bptree_key_t first; // between left and right
+    bptree_key_t second; // between right and the new leaf
+    if (!bptree_key_clone(key, key->len, &stored)) {
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    if (!bptree_pair_separator(left, right, ins, key, left_keys, &first)) {
+        bptree_key_release(&stored);
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    if (three && !bptree_pair_separator(left, right, ins, key, left_keys + middle_keys, &second)) {
+        bptree_key_release(&first);
+        bptree_key_release(&stored);
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    key = &stored;
+#endif
+    bptree_leaf_insert_at(tree, leaf, idx, key, value);
+    tree->count++;
+    bptree_node* extra = NULL;
+    if (three) { // the tail of right start the new leaf, then left and right even out
+        extra = reserve.nodes[reserve.used++];
+        bptree_split_leaf(tree, right, extra, right->num_keys - (total - left_keys - middle_keys));
+        if (!extra->next) tree->rightmost = extra;
+    }
+    bptree_leaf_shift(tree, left, right, left_keys);
+    bptree_key_t* parent_keys = bptree_node_keys(parent);
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    bptree_key_release(&parent_keys[pos]);
+    parent_keys[pos] = first;
+#else
+    parent_keys[pos] = bptree_node_keys(right)[0];
+#endif
+    bptree_node_prefix_refresh(parent);
+    tree->version++;
+    if (ins < left_keys) { // the run go on where the key ended
+        tree->run_leaf = left;
+        tree->run_idx = ins;
+    } else if (ins < left_keys + middle_keys) {
+        tree->run_leaf = right;
+        tree->run_idx = ins - left_keys;
+    } else {
+        tree->run_leaf = extra;
+        tree->run_idx = ins - left_keys - middle_keys;
+    }
+    bptree_debug_print(tree->enable_debug, "Spread leaf %p over %d leaves\n", (void*)leaf, three ? 3 : 2);
+    if (three) {
+        int path[BPTREE_MAX_HEIGHT]; // the new leaf go after right, which is not always the child the descent took
+        memcpy(path, index_stack, (size_t)depth * sizeof(int));
+        path[depth - 1] = pos + 1;
+#ifdef BPTREE_KEY_TYPE_VARLEN
+        bptree_insert_into_parent(tree, node_stack, path, depth, second, extra, &reserve);
+#else
+        bptree_insert_into_parent(tree, node_stack, path, depth, bptree_node_keys(extra)[0], extra, &reserve);
+#endif
+    }
+    bptree_release_split_nodes(tree, &reserve);
+    return BPTREE_OK;
+}
+
+// insert a key that is not in the tree at position idx of the leaf found by bptree_find_leaf
+static bptree_status bptree_insert_at(bptree* tree, bptree_node* leaf, const int idx, const bptree_key_t* key, const bptree_value_t value,
+                                      bptree_node** node_stack, const int* index_stack, const int depth) {
+    bptree_track_insert(tree, leaf, idx);
+    if (leaf->num_keys == tree->max_keys && depth > 0 && bptree_split_point(tree, leaf, idx, index_stack, depth) == (tree->max_keys + 1) / 2) { // no run to follow
+        const int sibling = bptree_spread_sibling(tree, node_stack, index_stack, depth);
+        if (sibling >= 0) return bptree_insert_spread(tree, idx, key, value, node_stack, index_stack, depth, sibling);
+    }
+    bptree_split_reserve reserve;
+    if (!bptree_reserve_split_nodes(tree, leaf, node_stack, depth, &reserve)) return BPTREE_ALLOCATION_FAILURE;
+    const int left_keys = reserve.count > 0 ? bptree_split_point(tree, leaf, idx, index_stack, depth) : 0;
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    bptree_key_t stored; // the leaf own a copy of the key
+    bptree_key_t truncated; // made before the leaf change so a failed copy leave nothing half done
+    if (!bptree_key_clone(key, key->len, &stored)) {
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    if (reserve.count > 0 && !bptree_leaf_split_separator(tree, leaf, idx, key, left_keys, &truncated)) {
+        bptree_key_release(&stored);
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    key = &stored;
+#endif
+    bptree_leaf_insert_at(tree, leaf, idx, key, value);
+    tree->count++;
+    if (leaf->num_keys > tree->max_keys) {
+        bptree_node* right = reserve.nodes[reserve.used++];
+#ifdef BPTREE_KEY_TYPE_VARLEN
+        bptree_split_leaf(tree, leaf, right, left_keys);
+        const bptree_key_t separator = truncated;
+#else
+        const bptree_key_t separator = bptree_split_leaf(tree, leaf, right, left_keys);
+#endif
+        if (!right->next) tree->rightmost = right;
+        if (idx >= left_keys) { // the run go on in the half that got the key
+            tree->run_leaf = right;
+            tree->run_idx = idx - left_keys;
+        }
+        bptree_debug_print(tree->enable_debug, "Split leaf node %p\n", (void*)leaf);
+        bptree_insert_into_parent(tree, node_stack, index_stack, depth, separator, right, &reserve);
+    }
+    bptree_release_split_nodes(tree, &reserve);
+    return BPTREE_OK;
+}
+
+#ifndef BPTREE_MEMTABLE
+// a key above every key of the tree, it can go in tree->rightmost without a descent
+static bool bptree_is_append(const bptree* tree, const bptree_key_t* key) {
+    const bptree_node* leaf = tree->rightmost;
+    if (!leaf || leaf->num_keys == 0) return false;
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (leaf->key_width) return false; // the normal path unpack it
+#endif
+    return tree->compare(key, &bptree_node_keys(leaf)[leaf->num_keys - 1]) > 0;
+}
+
+/*
+    append fast path for ascending keys
+        the key go at the end of the rightmost leaf, no key is compared on the way
+        a full rightmost leaf is not split in halves: it stay full and the key start a new rightmost leaf (a 100/0 split)
+        the split walk the rightmost edge for the path, so a stream of ascending keys leave every leaf but the last one full
+*/
+static bptree_status bptree_append(bptree* tree, const bptree_key_t* key, const bptree_value_t value) {
+    bptree_node* leaf = tree->rightmost;
+    if (leaf->num_keys < tree->max_keys) return bptree_insert_at(tree, leaf, leaf->num_keys, key, value, NULL, NULL, 0); // no split, no path needed
+
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth = 0;
+    for (bptree_node* node = tree->root; !node->is_leaf; node = bptree_node_children(node, tree->max_keys)[node->num_keys]) {
+        node_stack[depth] = node;
+        index_stack[depth] = node->num_keys;
+        depth++;
+    }
+    node_stack[depth] = leaf;
+    bptree_split_reserve reserve;
+    if (!bptree_reserve_split_nodes(tree, leaf, node_stack, depth, &reserve)) return BPTREE_ALLOCATION_FAILURE;
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    bptree_key_t stored;
+    bptree_key_t separator;
+    if (!bptree_key_clone(key, key->len, &stored)) {
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    const bptree_key_t* left_max = &bptree_node_keys(leaf)[leaf->num_keys - 1];
+    if (!bptree_key_clone(key, bptree_separator_len(left_max, key), &separator)) {
+        bptree_key_release(&stored);
+        bptree_release_split_nodes(tree, &reserve);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    key = &stored;
+#else
+    const bptree_key_t separator = *key;
+#endif
+    bptree_node* right = reserve.nodes[reserve.used++];
+    bptree_leaf_insert_at(tree, right, 0, key, value);
+    leaf->next = right;
+    tree->rightmost = right;
+    bptree_track_insert(tree, leaf, leaf->num_keys); // one more after the last slot of leaf
+    tree->run_leaf = right;
+    tree->run_idx = 0;
+    tree->count++;
+    bptree_debug_print(tree->enable_debug, "Append split of leaf %p\n", (void*)leaf);
+    bptree_insert_into_parent(tree, node_stack, index_stack, depth, separator, right, &reserve);
+    bptree_release_split_nodes(tree, &reserve);
+    return BPTREE_OK;
+}
+#endif
+
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_LAZY_REBALANCE)
+// after a remove the deleted key can still be a separator (it was the minimum of a subtree), replace it with the new minimum
+static void bptree_fix_separator(bptree* tree, const bptree_key_t* key) {
+    bptree_node* node = tree->root;
+    while (!node->is_leaf) {
+        bptree_key_t* keys = bptree_node_keys(node);
+        bptree_node** children = bptree_node_children(node, tree->max_keys);
+        const int idx = bptree_node_lower_bound(tree, node, key);
+        if (idx < node->num_keys && tree->compare(&keys[idx], key) == 0) { // separators are unique, there is no other copy
+            const bptree_key_t left_max = bptree_find_largest_key(children[idx], tree->max_keys);
+            const bptree_key_t right_min = bptree_find_smallest_key(children[idx + 1], tree->max_keys);
+            bptree_set_separator(&keys[idx], &left_max, &right_min);
+            bptree_node_prefix_refresh(node);
+            tree->version++;
+            return;
+        }
+        node = children[idx];
+    }
+}
+#endif
+
+#ifdef BPTREE_COMPRESSED_LEAVES
+// a packed copy of a normal leaf in *out, NULL when its keys are too spread for 32 bits deltas
+static bptree_status bptree_pack_leaf(bptree* tree, const bptree_node* leaf, bptree_node** out) {
+    *out = NULL;
+    const int n = leaf->num_keys;
+    if (n == 0) return BPTREE_OK;
+    const bptree_key_t* keys = bptree_node_keys(leaf);
+    const uint64_t range = (uint64_t)keys[n - 1] - (uint64_t)keys[0];
+    const int width = range <= UINT8_MAX ? 1 : (range <= UINT16_MAX ? 2 : (range <= UINT32_MAX ? 4 : 0)); // the narrowest that fit this leaf
+    if (width == 0) return BPTREE_OK;
+    const size_t size = bptree_packed_size(n, width);
+    const size_t freed = leaf->chunk_slot ? 0 : bptree_node_bytes(tree, leaf); // the copy replace the leaf, a chunk slot free nothing
+    tree->memory_used -= freed;
+    const bool charged = bptree_memory_charge(tree, size);
+    tree->memory_used += freed;
+    if (!charged) return BPTREE_ALLOCATION_FAILURE;
+    bptree_node* packed = malloc(size);
+    if (!packed) {
+        tree->memory_used -= size;
+        bptree_debug_print(tree->enable_debug, "Packed leaf allocation failed (size: %zu)\n", size);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    tree->leaf_nodes++;
+    packed->is_leaf = true;
+    packed->chunk_slot = 0;
+    packed->num_keys = n;
+    packed->next = leaf->next;
+    packed->key_width = (uint8_t)width;
+    memcpy(packed->data, &keys[0], sizeof(bptree_key_t));
+    void* deltas = packed->data + bptree_packed_deltas_offset();
+    for (int i = 0; i < n; i++) {
+        const uint64_t delta = (uint64_t)keys[i] - (uint64_t)keys[0];
+        switch (width) {
+            case 1: ((uint8_t*)deltas)[i] = (uint8_t)delta; break;
+            case 2: ((uint16_t*)deltas)[i] = (uint16_t)delta; break;
+            default: ((uint32_t*)deltas)[i] = (uint32_t)delta; break;
+        }
+    }
+#ifndef BPTREE_KEYS_ONLY
+    memcpy(bptree_packed_values(packed), bptree_node_values((bptree_node*)leaf, tree->max_keys), (size_t)n * sizeof(bptree_leaf_value_t));
+#endif
+    *out = packed;
+    return BPTREE_OK;
+}
+
+/*
+    turn child i of node_stack[d] (the root when d is -1) back into a normal leaf if it is packed
+    the path above node_stack[d] find the leaf before it, whose next pointer move to the new copy
+*/
+static bool bptree_unpack_child(bptree* tree, bptree_node** node_stack, const int* index_stack, const int d, const int i) {
+    bptree_node** slot = d < 0 ? &tree->root : &bptree_node_children(node_stack[d], tree->max_keys)[i];
+    bptree_node* packed = *slot;
+    if (!packed->key_width) return true;
+    bptree_node* leaf = bptree_node_alloc(tree, true);
+    if (!leaf) return false;
+    bptree_key_t* keys = bptree_node_keys(leaf);
+    for (int k = 0; k < packed->num_keys; k++) keys[k] = bptree_packed_key(packed, k);
+#ifndef BPTREE_KEYS_ONLY
+    memcpy(bptree_node_values(leaf, tree->max_keys), bptree_packed_values(packed), (size_t)packed->num_keys * sizeof(bptree_leaf_value_t));
+#endif
+    leaf->num_keys = packed->num_keys;
+    leaf->next = packed->next;
+    bptree_replace_leaf(tree, node_stack, index_stack, d, i, leaf);
+    bptree_node_release(tree, packed);
+    return true;
+}
+
+// the leaf at the end of a path recorded by bptree_find_leaf as a normal leaf, NULL if the copy can't be allocated
+static bptree_node* bptree_unpack_path_leaf(bptree* tree, bptree_node** node_stack, const int* index_stack, const int depth) {
+    const int i = depth > 0 ? index_stack[depth - 1] : 0;
+    if (!bptree_unpack_child(tree, node_stack, index_stack, depth - 1, i)) return NULL;
+    node_stack[depth] = depth > 0 ? bptree_node_children(node_stack[depth - 1], tree->max_keys)[i] : tree->root;
+    return node_stack[depth];
+}
+
+static bool bptree_unpack_remove_path(bptree* tree, bptree_node** node_stack, const int* index_stack, const int depth, const bool siblings) {
+    const bptree_node* leaf = bptree_unpack_path_leaf(tree, node_stack, index_stack, depth);
+    if (!leaf) return false;
+    if (!siblings || depth == 0 || leaf->num_keys - 1 >= tree->leaf_low) return true;
+    bptree_node* parent = node_stack[depth - 1];
+    const int i = index_stack[depth - 1];
+    if (i > 0 && !bptree_unpack_child(tree, node_stack, index_stack, depth - 1, i - 1)) return false;
+    if (i < parent->num_keys && !bptree_unpack_child(tree, node_stack, index_stack, depth - 1, i + 1)) return false;
+    return true;
+}
+
+/*
+    a remove edit the leaf at depth and, when it underflow, borrow from or merge with a sibling: all of them must be normal leaves
+    (only the leaf with siblings false, when the rebalance is left to bptree_compact)
+    the copies are not held to the memory limit, a tree at its limit must still be able to shrink
+*/
+static bool bptree_unpack_for_remove(bptree* tree, bptree_node** node_stack, const int* index_stack, const int depth, const bool siblings) {
+    const size_t limit = tree->memory_limit;
+    tree->memory_limit = 0;
+    const bool unpacked = bptree_unpack_remove_path(tree, node_stack, index_stack, depth, siblings);
+    tree->memory_limit = limit;
+    return unpacked;
+}
+
+static bptree_status bptree_compress_subtree(bptree* tree, bptree_node** slot, bptree_node** prev, int* packed_leaves) {
+    bptree_node* node = *slot;
+    if (!node->is_leaf) {
+        bptree_node** children = bptree_node_children(node, tree->max_keys);
+        for (int i = 0; i <= node->num_keys; i++) {
+            const bptree_status status = bptree_compress_subtree(tree, &children[i], prev, packed_leaves);
+            if (status != BPTREE_OK) return status;
+        }
+        return BPTREE_OK;
+    }
+    if (!node->key_width) {
+        bptree_node* packed;
+        const bptree_status status = bptree_pack_leaf(tree, node, &packed);
+        if (status != BPTREE_OK) return status; // the leaves already packed stay valid
+        if (packed) {
+            if (*prev) (*prev)->next = packed;
+            if (tree->rightmost == node) tree->rightmost = packed;
+            tree->version++;
+            *slot = packed;
+            bptree_node_release(tree, node);
+            node = packed;
+            (*packed_leaves)++;
+        }
+    }
+    *prev = node;
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_compress_leaves(bptree* tree) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+    if (tree->compare != bptree_default_compare) { // deltas are searched in numeric order
+        bptree_debug_print(tree->enable_debug, "Packed leaves need the default comparison\n");
+        return BPTREE_INVALID_ARGUMENT;
+    }
+    bptree_node* prev = NULL;
+    int packed_leaves = 0;
+    const bptree_status status = bptree_compress_subtree(tree, &tree->root, &prev, &packed_leaves);
+    bptree_debug_print(tree->enable_debug, "Packed %d leaves\n", packed_leaves);
+    return status;
+}
+#endif
+
+#ifdef BPTREE_MESSAGE_BUFFERS
+/*
+    write optimized mode (b-epsilon tree)
+        puts and removes are stored as messages in the buffer of the root, one message per key: a newer message replace the older one
+        when a buffer hold more than BPTREE_MESSAGE_BUFFER_SIZE messages, the biggest group of messages going to the same child is moved down in one batch
+        batches coming out of the lowest internal level are applied to the leaves, so each leaf touch is amortized over the batch
+        lookups check the buffers on the way down, the first message found for the key is the newest one
+    a remove applied to a leaf only take the key out and mark the path pending when the leaf drop under the low watermark,
+    once the flush is over bptree_buffer_compact borrow or merge those leaves (bptree_compact_step), the messages of the moved subtrees follow them
+    bptree_put overwrite an existing value, and once the root is internal bptree_remove can't report a missing key
+    tree->count is the number of keys in the leaves, pending messages are counted when they reach a leaf
+*/
+
+// binary search of key in the node buffer, return its index or -1, *pos get the index where it would be inserted
+static int bptree_buffer_search(const bptree* tree, const bptree_node* node, const bptree_key_t* key, int* pos) {
+    int lo = 0, hi = node->num_messages;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        const int cmp = tree->compare(&node->messages[mid].key, key);
+        if (cmp == 0) {
+            if (pos) *pos = mid;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return -1;
+}
+
+static bool bptree_buffer_reserve(bptree_node* node, const int capacity) {
+    if (capacity <= node->message_capacity) return true;
+    int new_capacity = node->message_capacity ? node->message_capacity : BPTREE_MESSAGE_BUFFER_SIZE;
+    while (new_capacity < capacity) new_capacity *= 2;
+    bptree_message* grown = realloc(node->messages, (size_t)new_capacity * sizeof(bptree_message));
+    if (!grown) return false;
+    node->messages = grown;
+    node->message_capacity = new_capacity;
+    return true;
+}
+
+// store a message in a node buffer, it replace an older message for the same key
+static bool bptree_buffer_store(const bptree* tree, bptree_node* node, const bptree_message* message) {
+    int pos;
+    const int idx = bptree_buffer_search(tree, node, &message->key, &pos);
+    if (idx >= 0) {
+        node->messages[idx] = *message;
+        return true;
+    }
+    if (!bptree_buffer_reserve(node, node->num_messages + 1)) return false;
+    memmove(&node->messages[pos + 1], &node->messages[pos], (size_t)(node->num_messages - pos) * sizeof(bptree_message));
+    node->messages[pos] = *message;
+    node->num_messages++;
+    return true;
+}
+
+// merge a sorted batch coming from the parent into the node buffer, the batch is newer so it win on equal keys
+static bool bptree_buffer_merge(const bptree* tree, bptree_node* node, const bptree_message* batch, const int n) {
+    bptree_message* merged = malloc((size_t)(node->num_messages + n) * sizeof(bptree_message));
+    if (!merged) return false;
+    int i = 0, j = 0, k = 0;
+    while (i < node->num_messages && j < n) {
+        const int cmp = tree->compare(&node->messages[i].key, &batch[j].key);
+        if (cmp < 0) merged[k++] = node->messages[i++];
+        else if (cmp > 0) merged[k++] = batch[j++];
+        else { // same key: the older message is dropped
+            merged[k++] = batch[j++];
+            i++;
+        }
+    }
+    while (i < node->num_messages) merged[k++] = node->messages[i++];
+    while (j < n) merged[k++] = batch[j++];
+    free(node->messages);
+    node->messages = merged;
+    node->message_capacity = node->num_messages + n;
+    node->num_messages = k;
+    return true;
+}
+
+// find the child that receive the most messages of the node, [*first, *last) is its run in the sorted buffer
+static int bptree_buffer_largest_group(const bptree* tree, const bptree_node* node, int* first, int* last) {
+    const bptree_key_t* keys = bptree_node_keys(node);
+    int best = 0, i = 0;
+    *first = *last = 0;
+    for (int c = 0; c <= node->num_keys && i < node->num_messages; c++) {
+        const int start = i;
+        while (i < node->num_messages && (c == node->num_keys || tree->compare(&node->messages[i].key, &keys[c]) < 0)) i++; // child c cover keys < keys[c]
+        if (i - start > *last - *first) {
+            best = c;
+            *first = start;
+            *last = i;
+        }
+    }
+    return best;
+}
+
+/*
+    apply a batch to the leaves, it always come from the lowest internal level so there is no buffer between it and the leaves
+    each message use a plain descent because the splits of the previous ones can move its leaf, the internal levels are hot in cache
+    *applied get how many messages reached their leaf
+*/
+static bptree_status bptree_apply_to_leaves(bptree* tree, const bptree_message* batch, const int n, int* applied) {
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    for (int i = 0; i < n; i++) {
+        bptree_node* leaf = bptree_find_leaf(tree, &batch[i].key, node_stack, index_stack, &depth);
+        const int idx = bptree_node_lower_bound(tree, leaf, &batch[i].key);
+        const bool found = idx < leaf->num_keys && tree->compare(&bptree_node_keys(leaf)[idx], &batch[i].key) == 0;
+        if (batch[i].op == BPTREE_MESSAGE_PUT) {
+            if (found) {
+#ifndef BPTREE_KEYS_ONLY
+                bptree_node_values(leaf, tree->max_keys)[idx] = batch[i].value;
+#endif
+            } else {
+                const bptree_status status = bptree_insert_at(tree, leaf, idx, &batch[i].key, batch[i].value, node_stack, index_stack, depth);
+                if (status != BPTREE_OK) {
+                    *applied = i;
+                    return status;
+                }
+            }
+        } else if (found) {
+            bptree_leaf_remove_at(tree, leaf, idx);
+            tree->count--;
+            if (leaf->num_keys < tree->leaf_low) { // rebalanced by bptree_buffer_compact once the flush is over, a merge now could free a node it still use
+                for (int d = 0; d < depth; d++) node_stack[d]->pending = true;
+            }
+        }
+    }
+    *applied = n;
+    return BPTREE_OK;
+}
+
+/*
+    messages that could not reach their leaf go back to the lowest internal node above it, no newer message for their key can be there
+    it never allocate: the node the batch came from kept the capacity of the whole batch, and the nodes split off it
+    during the flush got a batch of room on top of their messages (bptree_reserve_split_nodes)
+*/
+static void bptree_buffer_restore(bptree* tree, const bptree_message* messages, const int n) {
+    for (int i = 0; i < n; i++) {
+        bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+        int index_stack[BPTREE_MAX_HEIGHT];
+        int depth;
+        bptree_find_leaf(tree, &messages[i].key, node_stack, index_stack, &depth);
+        assert(depth > 0 && node_stack[depth - 1]->num_messages < node_stack[depth - 1]->message_capacity);
+        const bool stored = bptree_buffer_store(tree, node_stack[depth - 1], &messages[i]);
+        assert(stored);
+        (void)stored;
+    }
+}
+
+/*
+    move batches down until the node buffer hold at most limit messages
+    a batch is capped to BPTREE_MESSAGE_BUFFER_SIZE so a child buffer never grow over twice that size before it flush itself
+    the node can be split by the splits of its subtree while it flush, it then keep flushing its left half
+*/
+static bptree_status bptree_buffer_flush(bptree* tree, bptree_node* node, const int limit) {
+    while (node->num_messages > limit) {
+        int first, last;
+        const int c = bptree_buffer_largest_group(tree, node, &first, &last);
+        if (last - first > BPTREE_MESSAGE_BUFFER_SIZE) last = first + BPTREE_MESSAGE_BUFFER_SIZE;
+        const int n = last - first;
+        bptree_message* batch = malloc((size_t)n * sizeof(bptree_message));
+        if (!batch) return BPTREE_ALLOCATION_FAILURE;
+        memcpy(batch, &node->messages[first], (size_t)n * sizeof(bptree_message));
+        memmove(&node->messages[first], &node->messages[last], (size_t)(node->num_messages - last) * sizeof(bptree_message));
+        node->num_messages -= n;
+
+        bptree_node* child = bptree_node_children(node, tree->max_keys)[c];
+        bptree_status status = BPTREE_OK;
+        if (!child->is_leaf) {
+            if (!bptree_buffer_merge(tree, child, batch, n)) {
+                status = BPTREE_ALLOCATION_FAILURE;
+                memmove(&node->messages[first + n], &node->messages[first], (size_t)(node->num_messages - first) * sizeof(bptree_message)); // put the batch back, the buffer kept its capacity
+                memcpy(&node->messages[first], batch, (size_t)n * sizeof(bptree_message));
+                node->num_messages += n;
+            } else {
+                status = bptree_buffer_flush(tree, child, BPTREE_MESSAGE_BUFFER_SIZE);
+            }
+        } else {
+            int applied;
+            status = bptree_apply_to_leaves(tree, batch, n, &applied);
+            if (status != BPTREE_OK) bptree_buffer_restore(tree, &batch[applied], n - applied);
+        }
+        bptree_debug_print(tree->enable_debug, "Flushed %d messages from node %p to child %d\n", n, (void*)node, c);
+        free(batch);
+        if (status != BPTREE_OK) return status;
+    }
+    return BPTREE_OK;
+}
+
+// room for the messages bptree_rebalance_up can move into the internal nodes of a recorded path and their siblings, so it never allocate
+static bool bptree_buffer_reserve_path(bptree_node** node_stack, const int* index_stack, const int depth, const int max_keys) {
+    for (int d = 1; d < depth; d++) {
+        bptree_node** children = bptree_node_children(node_stack[d - 1], max_keys);
+        const int first = index_stack[d - 1] > 0 ? index_stack[d - 1] - 1 : 0;
+        const int last = index_stack[d - 1] < node_stack[d - 1]->num_keys ? index_stack[d - 1] + 1 : index_stack[d - 1];
+        int total = 0; // a merge or borrow only move messages between these nodes
+        for (int i = first; i <= last; i++) total += children[i]->num_messages;
+        for (int i = first; i <= last; i++) {
+            if (!bptree_buffer_reserve(children[i], total)) return false;
+        }
+    }
+    return true;
+}
+
+static bool bptree_compact_step(bptree* tree, bptree_status* status);
+
+// rebalance the leaves the removes of a flush left under the low watermark, status is the flush one and win over a compaction failure
+static bptree_status bptree_buffer_compact(bptree* tree, const bptree_status status) {
+    bptree_status compact_status = BPTREE_OK;
+    while (bptree_compact_step(tree, &compact_status)) {}
+    return status != BPTREE_OK ? status : compact_status;
+}
+
+// a put or remove once the root is internal: a message in the root buffer
+static bptree_status bptree_buffer_put(bptree* tree, const bptree_key_t* key, const bptree_value_t value, const bptree_message_op op) {
+    bptree_message message;
+    message.key = *key;
+    message.value = value;
+    message.op = op;
+    if (!bptree_buffer_store(tree, tree->root, &message)) return BPTREE_ALLOCATION_FAILURE;
+    return bptree_buffer_compact(tree, bptree_buffer_flush(tree, tree->root, BPTREE_MESSAGE_BUFFER_SIZE));
+}
+
+// first internal node (preorder) that still hold messages
+static bptree_node* bptree_buffer_find_pending(bptree_node* node, const int max_keys) {
+    if (node->is_leaf) return NULL;
+    if (node->num_messages > 0) return node;
+    bptree_node** children = bptree_node_children(node, max_keys);
+    for (int i = 0; i <= node->num_keys; i++) {
+        bptree_node* pending = bptree_buffer_find_pending(children[i], max_keys);
+        if (pending) return pending;
+    }
+    return NULL;
+}
+
+BPTREE_API bptree_status bptree_flush_messages(bptree* tree) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+    bptree_node* node;
+    while ((node = bptree_buffer_find_pending(tree->root, tree->max_keys)) != NULL) { // splits during a flush can reshape the tree so search again each time
+        const bptree_status status = bptree_buffer_flush(tree, node, 0);
+        if (status != BPTREE_OK) return bptree_buffer_compact(tree, status);
+    }
+    return bptree_buffer_compact(tree, BPTREE_OK); // the root has no message left, the compaction has nothing to flush
+}
+#endif
+
+#ifdef BPTREE_MEMTABLE
+/*
+    front write buffer (memtable)
+        bptree_put of a new key only store it in a small sorted array, the nodes are not touched
+        when the array is full it is merged into the tree in key order, keys going to the same leaf share one descent
+        so a burst of random puts become one sorted batch and its splits happen together instead of one per put
+    the memtable only hold keys that are not in the nodes, get check it first and removing a buffered key just drop it
+    a put look the key up in a bloom filter of every key put so far and only descend when the filter may have it,
+    so a put of a new key skip the descent (a removed key stay in the filter, its next put descend)
+    the filter get 16 bits per key when the merge rebuild it from the leaves, after keys for 8 bits per key were added
+*/
+
+// binary search of key in the memtable, return its index or -1, *pos get the index where it would be inserted
+static int bptree_memtable_search(const bptree* tree, const bptree_key_t* key, int* pos) {
+    int lo = 0, hi = tree->memtable_count;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        const int cmp = tree->compare(&tree->memtable[mid].key, key);
+        if (cmp == 0) {
+            if (pos) *pos = mid;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return -1;
+}
+
+static uint64_t bptree_filter_hash(const bptree_key_t* key) {
+#ifdef BPTREE_KEY_TYPE_STRING
+    uint64_t h = 0xcbf29ce484222325ULL; // fnv-1a over the key bytes, the default order is bytewise
+    for (int i = 0; i < BPTREE_KEY_SIZE; i++) h = (h ^ (unsigned char)key->data[i]) * 0x100000001b3ULL;
+#else
+    uint64_t h = (uint64_t)*key;
+#endif
+    h ^= h >> 33; // murmur3 finalizer, the two probes are the two halves
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static void bptree_filter_add(uint64_t* filter, const size_t bits, const bptree_key_t* key) {
+    const uint64_t h = bptree_filter_hash(key);
+    const size_t a = (size_t)h & (bits - 1), b = (size_t)(h >> 32) & (bits - 1);
+    filter[a / 64] |= 1ULL << (a % 64);
+    filter[b / 64] |= 1ULL << (b % 64);
+}
+
+// false only if the key was never put since the filter was built
+static bool bptree_filter_may_contain(const bptree* tree, const bptree_key_t* key) {
+    if (!tree->filter) return true;
+    const uint64_t h = bptree_filter_hash(key);
+    const size_t a = (size_t)h & (tree->filter_bits - 1), b = (size_t)(h >> 32) & (tree->filter_bits - 1);
+    return (tree->filter[a / 64] >> (a % 64) & 1) && (tree->filter[b / 64] >> (b % 64) & 1);
+}
+
+// a fresh filter of the keys in the leaves and the memtable, the old one is kept if it can't be allocated
+static void bptree_filter_rebuild(bptree* tree) {
+    const size_t keys = (size_t)tree->count + BPTREE_MEMTABLE_SIZE;
+    size_t bits = 64 * 64;
+    while (bits < 16 * keys) bits <<= 1;
+    uint64_t* filter = calloc(bits / 64, sizeof(uint64_t));
+    if (!filter) return; // still right, only more puts descend
+    for (const bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++) bptree_filter_add(filter, bits, &bptree_node_keys((bptree_node*)leaf)[i]);
+    }
+    for (int i = 0; i < tree->memtable_count; i++) bptree_filter_add(filter, bits, &tree->memtable[i].key);
+    free(tree->filter);
+    tree->filter = filter;
+    tree->filter_bits = bits;
+    tree->filter_keys = (size_t)tree->count;
+    bptree_debug_print(tree->enable_debug, "Rebuilt the memtable filter, %zu bits for %d keys\n", bits, tree->count);
+}
+
+/*
+    insert sorted entries whose keys should not be in the tree
+    after a descent the next entries that belong to the same leaf go in directly while it has room,
+    only a full leaf need the recorded path to split, then the next entry descend again
+    an entry whose key is already in its leaf is dropped without touching the leaf, the call then return BPTREE_DUPLICATE_KEY
+    *inserted get the number of entries that are done with (in the tree or dropped)
+*/
+static bptree_status bptree_insert_sorted(bptree* tree, const bptree_memtable_entry* entries, const int n, int* inserted) {
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    int i = 0;
+    bool dropped = false;
+    while (i < n) {
+        bptree_node* leaf = bptree_find_leaf(tree, &entries[i].key, node_stack, index_stack, &depth);
+        bptree_key_t high_key;
+        const bool has_high_key = bptree_path_high_key(node_stack, index_stack, depth, &high_key);
+        while (i < n && (!has_high_key || tree->compare(&entries[i].key, &high_key) < 0)) {
+            const int idx = bptree_node_lower_bound(tree, leaf, &entries[i].key);
+            if (idx < leaf->num_keys && tree->compare(&bptree_node_keys(leaf)[idx], &entries[i].key) == 0) {
+                dropped = true; // not counted, the leaf keep its value
+            } else if (leaf->num_keys < tree->max_keys) {
+                bptree_leaf_insert_at(tree, leaf, idx, &entries[i].key, entries[i].value);
+                tree->count++;
+            } else {
+                break;
+            }
+            i++;
+        }
+        if (i == n || (has_high_key && tree->compare(&entries[i].key, &high_key) >= 0)) continue; // next entry is in another leaf
+
+        // the leaf is full, this entry split it
+        const int idx = bptree_node_lower_bound(tree, leaf, &entries[i].key);
+        const bptree_status status = bptree_insert_at(tree, leaf, idx, &entries[i].key, entries[i].value, node_stack, index_stack, depth);
+        if (status != BPTREE_OK) {
+            *inserted = i;
+            return status;
+        }
+        i++;
+    }
+    *inserted = n;
+    return dropped ? BPTREE_DUPLICATE_KEY : BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_merge_memtable(bptree* tree) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+    if (tree->memtable_count == 0) return BPTREE_OK;
+    int inserted;
+    const bptree_status status = bptree_insert_sorted(tree, tree->memtable, tree->memtable_count, &inserted);
+    tree->count -= inserted; // they were already counted while buffered, the leaves counted the new keys
+    tree->memtable_count -= inserted;
+    memmove(tree->memtable, &tree->memtable[inserted], (size_t)tree->memtable_count * sizeof(bptree_memtable_entry)); // on failure the rest stay buffered
+    bptree_debug_print(tree->enable_debug, "Merged %d buffered keys into the tree\n", inserted);
+    if (tree->filter && tree->filter_keys > tree->filter_bits / 8) bptree_filter_rebuild(tree);
+    return status;
+}
+
+// buffer a key that is in neither the memtable nor the nodes, a full memtable is merged first
+static bptree_status bptree_memtable_insert(bptree* tree, const bptree_key_t* key, const bptree_value_t value) {
+    if (tree->memtable_count == BPTREE_MEMTABLE_SIZE) {
+        const bptree_status status = bptree_merge_memtable(tree);
+        if (status != BPTREE_OK && status != BPTREE_DUPLICATE_KEY) return status; // dropped keys don't stop the put
+    }
+    if (tree->filter) {
+        bptree_filter_add(tree->filter, tree->filter_bits, key);
+        tree->filter_keys++;
+    }
+    int pos;
+    bptree_memtable_search(tree, key, &pos);
+    memmove(&tree->memtable[pos + 1], &tree->memtable[pos], (size_t)(tree->memtable_count - pos) * sizeof(bptree_memtable_entry));
+    tree->memtable[pos].key = *key;
+    tree->memtable[pos].value = value;
+    tree->memtable_count++;
+    tree->count++;
+    return BPTREE_OK;
+}
+#endif
+
+BPTREE_API bptree* bptree_create(const int max_keys,
+                                 int (*compare)(const bptree_key_t*, const bptree_key_t*),
+                                 const bool enable_debug) {
+    if (max_keys < 3) { // a split need at least 2 keys on each side
+        bptree_debug_print(enable_debug, "max_keys must be at least 3 (%d)\n", max_keys);
+        return NULL;
+    }
+    bptree* tree = calloc(1, sizeof(bptree));
+    if (!tree) return NULL;
+    tree->max_keys = max_keys;
+    tree->min_leaf_keys = (max_keys + 1) / 2; // a split of max_keys + 1 keys leave at least this much on each side
+    tree->min_internal_keys = max_keys / 2; // the middle key go up so one less key to share
+    tree->leaf_low = tree->min_leaf_keys; // no hysteresis until bptree_set_watermarks
+    tree->internal_low = tree->min_internal_keys;
+    tree->leaf_high = max_keys;
+    tree->internal_high = max_keys;
+    tree->compare = compare ? compare : bptree_default_compare;
+    tree->enable_debug = enable_debug;
+#ifdef BPTREE_KEY_TYPE_STRING
+    tree->bytewise_order = tree->compare == bptree_default_compare; // a custom order may not be bytewise
+#endif
+    tree->root = bptree_node_alloc(tree, true); // an empty tree is an empty leaf
+    if (!tree->root) {
+        free(tree);
+        return NULL;
+    }
+    tree->rightmost = tree->root;
+#ifdef BPTREE_MEMTABLE
+    tree->memtable = malloc(BPTREE_MEMTABLE_SIZE * sizeof(bptree_memtable_entry));
+#ifdef BPTREE_KEY_TYPE_STRING
+    const bool hashable = tree->compare == bptree_default_compare;
+#else
+    const bool hashable = tree->compare == bptree_default_compare && (bptree_key_t)0.5 == (bptree_key_t)0; // equal floats can differ in bits (-0.0)
+#endif
+    if (hashable) {
+        tree->filter_bits = 16 * BPTREE_MEMTABLE_SIZE;
+        tree->filter = calloc(tree->filter_bits / 64, sizeof(uint64_t));
+    }
+    if (!tree->memtable || (hashable && !tree->filter)) {
+        free(tree->memtable);
+        free(tree->filter);
+        free(tree->root);
+        free(tree);
+        return NULL;
+    }
+#endif
+    tree->height = 1;
+    tree->sample_seed = 0x9E3779B97F4A7C15ULL;
+    bptree_debug_print(enable_debug, "Tree created with max_keys %d\n", max_keys);
+    return tree;
+}
+
+BPTREE_API void bptree_free(bptree* tree) {
+    if (!tree) return;
+#ifdef BPTREE_PAGED
+    if (tree->pager) { // opened by bptree_paged_open, the file and the buffer pool go with it
+        bptree_paged_close(tree);
+        return;
+    }
+#endif
+    bptree_free_node(tree->root, tree);
+    free(tree->chunk); // every leaf is gone, the chunk being filled was kept for the next ones
+    if (tree->defrag_has_cursor) bptree_key_release(&tree->defrag_cursor);
+#ifdef BPTREE_MEMTABLE
+    free(tree->memtable);
+    free(tree->filter);
+#endif
+    free(tree);
+}
+
+// the end of a lookup, in the leaf that cover key
+static bptree_status bptree_leaf_lookup(const bptree* tree, bptree_node* node, const bptree_key_t* key, bptree_value_t* out) {
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (node->key_width) {
+        const int packed = bptree_packed_find(node, key);
+        if (packed < 0) return BPTREE_KEY_NOT_FOUND;
+#ifndef BPTREE_KEYS_ONLY
+        if (out) *out = bptree_packed_values(node)[packed];
+#endif
+        return BPTREE_OK;
+    }
+#endif
+    const int idx = bptree_node_lower_bound(tree, node, key);
+    if (idx >= node->num_keys || tree->compare(&bptree_node_keys(node)[idx], key) != 0) return BPTREE_KEY_NOT_FOUND;
+#ifdef BPTREE_KEYS_ONLY
+    (void)out; // nothing to read
+#elif defined(BPTREE_MULTIMAP)
+    if (out) *out = bptree_posting_values(&bptree_node_values(node, tree->max_keys)[idx])[0];
+#else
+    if (out) *out = bptree_node_values(node, tree->max_keys)[idx];
+#endif
+    return BPTREE_OK;
+}
+
+// lookup shared by get and contains, out can be NULL
+static bptree_status bptree_lookup(const bptree* tree, const bptree_key_t* key, bptree_value_t* out) {
+#ifdef BPTREE_MEMTABLE
+    const int buffered = bptree_memtable_search(tree, key, NULL);
+    if (buffered >= 0) {
+        if (out) *out = tree->memtable[buffered].value;
+        return BPTREE_OK;
+    }
+#endif
+    bptree_node* node = tree->root;
+    while (!node->is_leaf) {
+#ifdef BPTREE_MESSAGE_BUFFERS
+        const int m = bptree_buffer_search(tree, node, key, NULL);
+        if (m >= 0) { // the newest pending message decide
+            if (node->messages[m].op == BPTREE_MESSAGE_REMOVE) return BPTREE_KEY_NOT_FOUND;
+            if (out) *out = node->messages[m].value;
+            return BPTREE_OK;
+        }
+#endif
+        node = bptree_node_children(node, tree->max_keys)[bptree_node_child_index(tree, node, key)];
+    }
+    return bptree_leaf_lookup(tree, node, key, out);
+}
+
+#ifndef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_get(const bptree* tree, const bptree_key_t* key, bptree_value_t* out) {
+    if (!tree || !tree->root || !key || !out) return BPTREE_INVALID_ARGUMENT; // no root: a paged tree, see bptree_paged_get
+    return bptree_lookup(tree, key, out);
+}
+#endif
+
+BPTREE_API bool bptree_contains(const bptree* tree, const bptree_key_t* key) {
+    if (!tree || !tree->root || !key) return false;
+    return bptree_lookup(tree, key, NULL) == BPTREE_OK;
+}
+
+#ifndef BPTREE_MEMTABLE
+// the put once the path to the leaf of key is known (node_stack[depth] is the leaf)
+static bptree_status bptree_put_in_leaf(bptree* tree, const bptree_key_t* key, const bptree_value_t value, bptree_node** node_stack, const int* index_stack, const int depth) {
+    bptree_node* leaf = node_stack[depth];
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (leaf->key_width) {
+        if (bptree_packed_find(leaf, key) >= 0) return BPTREE_DUPLICATE_KEY;
+        leaf = bptree_unpack_path_leaf(tree, node_stack, index_stack, depth);
+        if (!leaf) return BPTREE_ALLOCATION_FAILURE;
+    }
+#endif
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx < leaf->num_keys && tree->compare(&bptree_node_keys(leaf)[idx], key) == 0) {
+#ifdef BPTREE_MESSAGE_BUFFERS
+#ifndef BPTREE_KEYS_ONLY
+        bptree_node_values(leaf, tree->max_keys)[idx] = value; // same overwrite semantic as a message
+#endif
+        return BPTREE_OK;
+#elif defined(BPTREE_MULTIMAP)
+        bptree_posting* posting = &bptree_node_values(leaf, tree->max_keys)[idx];
+        if (bptree_posting_find(posting, &value) >= 0) return BPTREE_DUPLICATE_KEY;
+        return bptree_posting_append(posting, value) ? BPTREE_OK : BPTREE_ALLOCATION_FAILURE;
+#else
+        return BPTREE_DUPLICATE_KEY;
+#endif
+    }
+    return bptree_insert_at(tree, leaf, idx, key, value, node_stack, index_stack, depth);
+}
+#endif
+
+// put shared by the map and the set api
+static bptree_status bptree_put_pair(bptree* tree, const bptree_key_t* key, const bptree_value_t value) {
+#ifdef BPTREE_MESSAGE_BUFFERS
+    if (!tree->root->is_leaf) return bptree_buffer_put(tree, key, value, BPTREE_MESSAGE_PUT);
+#endif
+#ifdef BPTREE_MEMTABLE
+    if (bptree_filter_may_contain(tree, key) && bptree_lookup(tree, key, NULL) == BPTREE_OK) return BPTREE_DUPLICATE_KEY; // a read only descent
+    return bptree_memtable_insert(tree, key, value);
+#else
+    if (bptree_is_append(tree, key)) return bptree_append(tree, key, value);
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    bptree_find_leaf(tree, key, node_stack, index_stack, &depth);
+    return bptree_put_in_leaf(tree, key, value, node_stack, index_stack, depth);
+#endif
+}
+
+#ifdef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_put(bptree* tree, const bptree_key_t* key) {
+    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT;
+    bptree_value_t none; // only carried by the internal helpers, never stored
+    memset(&none, 0, sizeof(none));
+    return bptree_put_pair(tree, key, none);
+}
+#else
+BPTREE_API bptree_status bptree_put(bptree* tree, const bptree_key_t* key, const bptree_value_t value) {
+    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT; // no root: a paged tree, see bptree_paged_put
+    return bptree_put_pair(tree, key, value);
+}
+#endif
+
+#if !defined(BPTREE_KEYS_ONLY) && !defined(BPTREE_MULTIMAP) // single value updates
+BPTREE_API bptree_status bptree_upsert(bptree* tree, const bptree_key_t* key, const bptree_upsert_fn fn, void* ctx) {
+    if (!tree || !tree->root || !key || !fn) return BPTREE_INVALID_ARGUMENT;
+#ifdef BPTREE_MESSAGE_BUFFERS
+    if (!tree->root->is_leaf) { // the current value can be in any buffer on the path, read it then send a put message
+        bptree_value_t value;
+        const bool exists = bptree_lookup(tree, key, &value) == BPTREE_OK;
+        if (!exists) memset(&value, 0, sizeof(value));
+        if (!fn(&value, exists, ctx) && !exists) return BPTREE_KEY_NOT_FOUND;
+        return bptree_buffer_put(tree, key, value, BPTREE_MESSAGE_PUT);
+    }
+#endif
+#ifdef BPTREE_MEMTABLE
+    const int buffered = bptree_memtable_search(tree, key, NULL);
+    if (buffered >= 0) {
+        fn(&tree->memtable[buffered].value, true, ctx);
+        return BPTREE_OK;
+    }
+#endif
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    bptree_node* leaf = bptree_find_leaf(tree, key, node_stack, index_stack, &depth);
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (leaf->key_width) {
+        const int packed = bptree_packed_find(leaf, key);
+        if (packed >= 0) { // values of a packed leaf are full size, no need to unpack
+            fn(&bptree_packed_values(leaf)[packed], true, ctx);
+            return BPTREE_OK;
+        }
+        leaf = bptree_unpack_path_leaf(tree, node_stack, index_stack, depth);
+        if (!leaf) return BPTREE_ALLOCATION_FAILURE;
+    }
+#endif
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx < leaf->num_keys && tree->compare(&bptree_node_keys(leaf)[idx], key) == 0) { // updated in place in the leaf
+        fn(&bptree_node_values(leaf, tree->max_keys)[idx], true, ctx);
+        return BPTREE_OK;
+    }
+    bptree_value_t value;
+    memset(&value, 0, sizeof(value));
+    if (!fn(&value, false, ctx)) return BPTREE_KEY_NOT_FOUND; // fn chose not to create it
+#ifdef BPTREE_MEMTABLE
+    return bptree_memtable_insert(tree, key, value);
+#else
+    return bptree_insert_at(tree, leaf, idx, key, value, node_stack, index_stack, depth); // the descent above is reused for the insert
+#endif
+}
+
+// put_if_absent and replace are upserts, the context carry the new value and get the old one back
+typedef struct bptree_swap_ctx {
+    bptree_value_t value;
+    bptree_value_t* old_value; // can be NULL
+    bool found;
+} bptree_swap_ctx;
+
+static bool bptree_put_if_absent_fn(bptree_value_t* value, const bool exists, void* ctx) {
+    bptree_swap_ctx* swap = ctx;
+    swap->found = exists;
+    if (exists) {
+        if (swap->old_value) *swap->old_value = *value;
+        return false;
+    }
+    *value = swap->value;
+    return true;
+}
+
+static bool bptree_replace_fn(bptree_value_t* value, const bool exists, void* ctx) {
+    bptree_swap_ctx* swap = ctx;
+    swap->found = exists;
+    if (!exists) return false;
+    if (swap->old_value) *swap->old_value = *value;
+    *value = swap->value;
+    return true;
+}
+
+BPTREE_API bptree_status bptree_put_if_absent(bptree* tree, const bptree_key_t* key, const bptree_value_t value, bptree_value_t* old_value) {
+    bptree_swap_ctx swap = {value, old_value, false};
+    const bptree_status status = bptree_upsert(tree, key, bptree_put_if_absent_fn, &swap);
+    if (status == BPTREE_OK && swap.found) return BPTREE_DUPLICATE_KEY;
+    return status;
+}
+
+BPTREE_API bptree_status bptree_replace(bptree* tree, const bptree_key_t* key, const bptree_value_t value, bptree_value_t* old_value) {
+    bptree_swap_ctx swap = {value, old_value, false};
+    return bptree_upsert(tree, key, bptree_replace_fn, &swap);
+}
+#endif
+
+BPTREE_API bptree_status bptree_remove(bptree* tree, const bptree_key_t* key) {
+    if (!tree || !tree->root || !key) return BPTREE_INVALID_ARGUMENT; // no root: a paged tree, see bptree_paged_remove
+#ifdef BPTREE_MESSAGE_BUFFERS
+    if (!tree->root->is_leaf) {
+        bptree_value_t none;
+        memset(&none, 0, sizeof(none));
+        return bptree_buffer_put(tree, key, none, BPTREE_MESSAGE_REMOVE);
+    }
+#endif
+#ifdef BPTREE_MEMTABLE
+    const int buffered = bptree_memtable_search(tree, key, NULL);
+    if (buffered >= 0) { // never reached the nodes, nothing to rebalance
+        memmove(&tree->memtable[buffered], &tree->memtable[buffered + 1], (size_t)(tree->memtable_count - buffered - 1) * sizeof(bptree_memtable_entry));
+        tree->memtable_count--;
+        tree->count--;
+        return BPTREE_OK;
+    }
+#endif
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    bptree_node* leaf = bptree_find_leaf(tree, key, node_stack, index_stack, &depth);
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (leaf->key_width && bptree_packed_find(leaf, key) < 0) return BPTREE_KEY_NOT_FOUND;
+#ifdef BPTREE_LAZY_REBALANCE
+    if (!bptree_unpack_for_remove(tree, node_stack, index_stack, depth, false)) return BPTREE_ALLOCATION_FAILURE; // the siblings wait for bptree_compact
+#else
+    if (!bptree_unpack_for_remove(tree, node_stack, index_stack, depth, true)) return BPTREE_ALLOCATION_FAILURE;
+#endif
+    leaf = node_stack[depth];
+#endif
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx >= leaf->num_keys || tree->compare(&bptree_node_keys(leaf)[idx], key) != 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_key_release(&bptree_node_keys(leaf)[idx]);
+#ifdef BPTREE_MULTIMAP
+    bptree_posting_release(&bptree_node_values(leaf, tree->max_keys)[idx]);
+#endif
+    bptree_leaf_remove_at(tree, leaf, idx);
+    tree->count--;
+#ifdef BPTREE_LAZY_REBALANCE
+    if (depth > 0 && leaf->num_keys < tree->leaf_low) { // the separators above stay valid lower bounds, the path is marked for bptree_compact
+        for (int d = 0; d < depth; d++) node_stack[d]->pending = true;
+    }
+#elif !defined(BPTREE_MESSAGE_BUFFERS)
+    if (depth > 0) bptree_rebalance_up(tree, node_stack, index_stack, depth);
+    if (idx == 0 && tree->count > 0) bptree_fix_separator(tree, key); // the key was the minimum of its leaf, it may be a separator
+#endif
+    return BPTREE_OK;
+}
+
+#ifdef BPTREE_PENDING_MARKS
+/*
+    rebalance the first leaf under the low watermark found below pending nodes, with bptree_rebalance_up like an inline remove
+    a pending node with nothing left to do below it lose its mark, return false once the root has none
+*/
+static bool bptree_compact_step(bptree* tree, bptree_status* status) {
+    (void)status; // only set when compressed leaves must be unpacked
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth = 0;
+    bptree_node* node = tree->root;
+    while (!node->is_leaf && node->pending) {
+        bptree_node** children = bptree_node_children(node, tree->max_keys);
+        int i = 0;
+        while (i <= node->num_keys && !(children[i]->is_leaf ? children[i]->num_keys < tree->leaf_low : children[i]->pending)) i++;
+        if (i > node->num_keys) { // nothing below, climb back from the root
+            node->pending = false;
+            depth = 0;
+            node = tree->root;
+            continue;
+        }
+        node_stack[depth] = node;
+        index_stack[depth] = i;
+        depth++;
+        node = children[i];
+    }
+    if (depth == 0) return false; // a root leaf has no minimum
+    node_stack[depth] = node;
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (!bptree_unpack_for_remove(tree, node_stack, index_stack, depth, true)) { // the leaf and its siblings must be normal leaves
+        *status = BPTREE_ALLOCATION_FAILURE;
+        return false;
+    }
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+    if (tree->root->num_keys == 1 && tree->root->num_messages > 0) { // a merge of its two children would collapse the root, its messages go down first
+        *status = bptree_buffer_flush(tree, tree->root, 0);
+        return *status == BPTREE_OK;
+    }
+    if (!bptree_buffer_reserve_path(node_stack, index_stack, depth, tree->max_keys)) {
+        *status = BPTREE_ALLOCATION_FAILURE;
+        return false;
+    }
+#endif
+    bptree_rebalance_up(tree, node_stack, index_stack, depth);
+    return true;
+}
+#endif
+
+#ifdef BPTREE_LAZY_REBALANCE
+BPTREE_API bool bptree_compact(bptree* tree, const int budget) {
+    if (!tree || !tree->root) return true;
+    bptree_status status = BPTREE_OK;
+    int done = 0;
+    while (done < budget && bptree_compact_step(tree, &status)) done++;
+    bptree_debug_print(tree->enable_debug, "Compacted %d leaves\n", done);
+    return status == BPTREE_OK && (tree->root->is_leaf || !tree->root->pending);
+}
+#endif
+
+// next leaf slot of the chunk being filled, a new chunk when it is full
+static bptree_node* bptree_chunk_slot(bptree* tree) {
+    if (!tree->chunk || tree->chunk->used == BPTREE_DEFRAG_CHUNK) {
+        if (!bptree_memory_charge(tree, tree->chunk_size)) return NULL;
+        bptree_chunk* chunk = aligned_alloc(bptree_node_align(true), tree->chunk_size);
+        if (!chunk) {
+            tree->memory_used -= tree->chunk_size;
+            bptree_debug_print(tree->enable_debug, "Chunk allocation failed (size: %zu)\n", tree->chunk_size);
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->live = 0;
+        if (tree->chunk && tree->chunk->live == 0) bptree_chunk_free(tree, tree->chunk);
+        tree->chunk = chunk;
+    }
+    bptree_node* node = (bptree_node*)((char*)tree->chunk + bptree_chunk_header() + (size_t)tree->chunk->used * bptree_chunk_stride(tree));
+    tree->chunk->used++;
+    tree->chunk->live++;
+    tree->leaf_nodes++;
+    node->chunk_slot = (uint16_t)tree->chunk->used;
+    return node;
+}
+
+// copy the leaf at the end of a recorded path into the next chunk slot, false if no chunk can be allocated
+static bool bptree_relocate_leaf(bptree* tree, bptree_node** node_stack, const int* index_stack, const int depth) {
+    bptree_node* leaf = node_stack[depth];
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (leaf->key_width) return true; // already a compact allocation of its own size
+#endif
+    bptree_node* copy = bptree_chunk_slot(tree);
+    if (!copy) return false;
+    const uint16_t slot = copy->chunk_slot;
+    memcpy(copy, leaf, bptree_node_alloc_size(tree, true));
+    copy->chunk_slot = slot;
+    bptree_replace_leaf(tree, node_stack, index_stack, depth - 1, depth > 0 ? index_stack[depth - 1] : 0, copy);
+    if (tree->run_leaf == leaf) tree->run_leaf = copy;
+    bptree_node_release(tree, leaf);
+    node_stack[depth] = copy;
+    return true;
+}
+
+#ifndef BPTREE_MESSAGE_BUFFERS
+/*
+    refill the leaf at the end of a recorded path and the next leaves under the same parent: each take the first keys of the
+    one after it until it hold target keys, so the keys gather in the first leaves and the last ones are emptied and freed
+    the last leaf that keep keys is merged into the one before it or take keys back from it if it end under the low watermark
+    the path is recorded again when the parent lose children, bptree_rebalance_up can merge it
+*/
+static void bptree_refill_leaf(bptree* tree, bptree_node** node_stack, int* index_stack, int* depth, const int target) {
+    bptree_node* leaf = node_stack[*depth];
+    if (*depth == 0 || leaf->num_keys == 0) return; // an empty leaf can't be found again by its keys, bptree_compact take it
+#ifdef BPTREE_COMPRESSED_LEAVES
+    if (leaf->key_width) return;
+#endif
+    bptree_node* parent = node_stack[*depth - 1];
+    bptree_node** children = bptree_node_children(parent, tree->max_keys);
+    bptree_key_t* parent_keys = bptree_node_keys(parent);
+    const int first = index_stack[*depth - 1];
+    int last = first;
+    while (last < parent->num_keys) {
+#ifdef BPTREE_COMPRESSED_LEAVES
+        if (children[last + 1]->key_width) break;
+#endif
+        last++;
+    }
+    if (last == first) return;
+
+    int k = first; // leaf being filled, the ones between it and src are empty
+    for (int src = first + 1; src <= last; src++) {
+        while (children[src]->num_keys > 0) {
+            if (children[k]->num_keys >= target) {
+                if (++k == src) break;
+                continue;
+            }
+            const int n = children[k]->num_keys + children[src]->num_keys;
+            bptree_leaf_shift(tree, children[k], children[src], n < target ? n : target);
+        }
+    }
+    while (children[k]->num_keys == 0) k--; // last leaf with keys
+    if (k > first && children[k]->num_keys < tree->leaf_low) {
+        const int n = children[k - 1]->num_keys + children[k]->num_keys;
+        bptree_leaf_shift(tree, children[k - 1], children[k], n <= tree->max_keys ? n : n - tree->leaf_low);
+        if (children[k]->num_keys == 0) k--;
+    }
+    for (int j = first; j < k; j++) {
+        bptree_set_separator(&parent_keys[j], &bptree_node_keys(children[j])[children[j]->num_keys - 1], &bptree_node_keys(children[j + 1])[0]);
+    }
+
+    const int gone = last - k;
+    if (gone > 0) { // children k + 1 to last are empty
+        children[k]->next = children[last]->next;
+        for (int j = k + 1; j <= last; j++) {
+            if (tree->rightmost == children[j]) tree->rightmost = children[k];
+            bptree_key_release(&parent_keys[j - 1]);
+            bptree_node_release(tree, children[j]);
+        }
+        memmove(&parent_keys[k], &parent_keys[last], (size_t)(parent->num_keys - last) * sizeof(bptree_key_t));
+        memmove(&children[k + 1], &children[last + 1], (size_t)(parent->num_keys - last) * sizeof(bptree_node*));
+        parent->num_keys -= gone;
+    }
+    bptree_node_prefix_refresh(parent);
+    tree->version++;
+    bptree_debug_print(tree->enable_debug, "Refilled leaves %d to %d, %d freed\n", first, last, gone);
+    if (gone > 0) {
+        do { // the parent may be under its minimum now, a borrow only give it back one key
+            bptree_rebalance_up(tree, node_stack, index_stack, *depth - 1);
+            bptree_find_leaf(tree, &bptree_node_keys(leaf)[0], node_stack, index_stack, depth);
+        } while (*depth > 1 && node_stack[*depth - 1]->num_keys < tree->internal_low);
+        assert(node_stack[*depth] == leaf);
+    }
+#ifdef BPTREE_LAZY_REBALANCE
+    if (*depth > 0 && leaf->num_keys < tree->leaf_low) { // all the keys under the parent were less than a leaf
+        for (int d = 0; d < *depth; d++) node_stack[d]->pending = true;
+    }
+#endif
+}
+#endif
+
+// keys a leaf is refilled to for fill_percent, at least the low watermark so a refilled leaf don't need a rebalance
+static int bptree_fill_target(const bptree* tree, const int fill_percent) {
+    int target = fill_percent <= 0 ? 0 : (fill_percent >= 100 ? tree->max_keys : (int)((int64_t)tree->max_keys * fill_percent / 100));
+    if (target > 0 && target < tree->leaf_low) target = tree->leaf_low;
+    return target;
+}
+
+/*
+    a leaf bptree_shrink move: one in a chunk, other than the one being filled, that lost a quarter of its leaves
+    a malloc'd leaf stay, a chunk for them would cost up to BPTREE_DEFRAG_CHUNK - 1 unused slots and malloc_trim already release the pages the freed ones leave
+*/
+static bool bptree_leaf_sparse(const bptree* tree, const bptree_node* leaf) {
+    if (!leaf->chunk_slot) return false;
+    const bptree_chunk* chunk = bptree_node_chunk(tree, leaf);
+    return chunk != tree->chunk && chunk->live * 4 <= BPTREE_DEFRAG_CHUNK * 3;
+}
+
+// the leaf walk of bptree_defragment, sparse_only copy only the leaves bptree_leaf_sparse pick but every leaf is refilled
+static bool bptree_defragment_leaves(bptree* tree, const int budget, const int target, const bool sparse_only) {
+#ifdef BPTREE_MESSAGE_BUFFERS
+    (void)target; // leaves of a buffered tree are only refilled by the messages
+#endif
+    tree->chunk_size = bptree_chunk_header() + (size_t)BPTREE_DEFRAG_CHUNK * bptree_chunk_stride(tree);
+    bptree_node* node_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth = 0;
+    if (tree->defrag_has_cursor) { // resume where the last call stopped
+        bptree_find_leaf(tree, &tree->defrag_cursor, node_stack, index_stack, &depth);
+        bptree_key_release(&tree->defrag_cursor);
+        tree->defrag_has_cursor = false;
+    } else {
+        bptree_node* node = tree->root;
+        while (!node->is_leaf) {
+            node_stack[depth] = node;
+            index_stack[depth] = 0;
+            node = bptree_node_children(node, tree->max_keys)[0];
+            depth++;
+        }
+        node_stack[depth] = node;
+    }
+
+    int done = 0;
+    while (true) {
+        if ((!sparse_only || bptree_leaf_sparse(tree, node_stack[depth])) && !bptree_relocate_leaf(tree, node_stack, index_stack, depth)) {
+            bptree_node* leaf = node_stack[depth];
+            if (leaf->num_keys > 0) { // this leaf is the next one to copy
+#ifdef BPTREE_KEY_TYPE_VARLEN
+                tree->defrag_has_cursor = bptree_key_clone(&bptree_node_keys(leaf)[0], bptree_node_keys(leaf)[0].len, &tree->defrag_cursor);
+#else
+                tree->defrag_cursor = bptree_node_keys(leaf)[0];
+                tree->defrag_has_cursor = true;
+#endif
+            }
+            break;
+        }
+#ifndef BPTREE_MESSAGE_BUFFERS
+        if (target > 0) bptree_refill_leaf(tree, node_stack, index_stack, &depth, target);
+#endif
+        done++;
+        bptree_key_t high_key;
+        if (!bptree_path_high_key(node_stack, index_stack, depth, &high_key)) {
+            bptree_debug_print(tree->enable_debug, "Defragmented %d leaves, pass complete\n", done);
+            return true;
+        }
+        if (done == budget) { // the separator can be freed or moved before the next call, it's copied
+#ifdef BPTREE_KEY_TYPE_VARLEN
+            tree->defrag_has_cursor = bptree_key_clone(&high_key, high_key.len, &tree->defrag_cursor);
+#else
+            tree->defrag_cursor = high_key;
+            tree->defrag_has_cursor = true;
+#endif
+            break;
+        }
+        bptree_find_leaf(tree, &high_key, node_stack, index_stack, &depth);
+    }
+    bptree_debug_print(tree->enable_debug, "Defragmented %d leaves\n", done);
+    return false;
+}
+
+BPTREE_API bool bptree_defragment(bptree* tree, const int budget, const int fill_percent) {
+    if (!tree || !tree->root) return true;
+    if (budget <= 0) return false;
+    return bptree_defragment_leaves(tree, budget, bptree_fill_target(tree, fill_percent), false);
+}
+
+BPTREE_API size_t bptree_shrink(bptree* tree) {
+    if (!tree || !tree->root) return 0;
+    const size_t used = tree->memory_used;
+    if (tree->defrag_has_cursor) { // a shrink walk every leaf, a bptree_defragment pass start over after it
+        bptree_key_release(&tree->defrag_cursor);
+        tree->defrag_has_cursor = false;
+    }
+    if (!bptree_defragment_leaves(tree, INT_MAX, bptree_fill_target(tree, BPTREE_SHRINK_FILL), true)) {
+        bptree_debug_print(tree->enable_debug, "Shrink stopped, no memory for a new chunk\n");
+        if (tree->defrag_has_cursor) bptree_key_release(&tree->defrag_cursor);
+        tree->defrag_has_cursor = false;
+    }
+    if (tree->chunk && tree->chunk->live == 0) { // kept for the next leaves but there may be none
+        bptree_chunk_free(tree, tree->chunk);
+        tree->chunk = NULL;
+    }
+    size_t reclaimed = used > tree->memory_used ? used - tree->memory_used : 0;
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    // the nodes freed by removes stay in the heap until it is trimmed, mallinfo2 see what leave the top of it and the mmaps
+    const struct mallinfo2 before = mallinfo2();
+    malloc_trim(0);
+    const struct mallinfo2 after = mallinfo2();
+    const size_t trimmed = before.arena + before.hblkhd > after.arena + after.hblkhd ? before.arena + before.hblkhd - after.arena - after.hblkhd : 0;
+    if (trimmed > reclaimed) reclaimed = trimmed; // the trim can give back what the walk freed, it's not added twice
+#else
+    malloc_trim(0);
+#endif
+#endif
+    bptree_debug_print(tree->enable_debug, "Shrink reclaimed %zu bytes\n", reclaimed);
+    return reclaimed;
+}
+
+#if !defined(BPTREE_PAGED) && !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+BPTREE_API void bptree_finger_init(bptree_finger* finger, bptree* tree) {
+    finger->tree = tree;
+    finger->version = 0;
+    finger->depth = -1;
+}
+
+static bool bptree_finger_covers(const bptree_finger* finger, const int d, const bptree_key_t* key) {
+    const bptree* tree = finger->tree;
+    if (finger->has_low[d] && tree->compare(key, &finger->low[d]) < 0) return false;
+    if (finger->has_high[d] && tree->compare(key, &finger->high[d]) >= 0) return false;
+    return true;
+}
+
+// the leaf of key, the descent start at the deepest node of the recorded path that cover key and record the new path
+static bptree_node* bptree_finger_descend(bptree_finger* finger, const bptree_key_t* key) {
+    const bptree* tree = finger->tree;
+    int d = 0;
+    if (finger->depth >= 0 && finger->version == tree->version) {
+        d = finger->depth;
+        while (d > 0 && !bptree_finger_covers(finger, d, key)) d--;
+    }
+    bptree_node* node = d > 0 ? finger->node_stack[d] : tree->root;
+    if (d == 0) {
+        finger->has_low[0] = false;
+        finger->has_high[0] = false;
+    }
+    while (!node->is_leaf) {
+        const bptree_key_t* keys = bptree_node_keys(node);
+        const int idx = bptree_node_child_index(tree, node, key);
+        finger->node_stack[d] = node;
+        finger->index_stack[d] = idx;
+        // the child range is its two separators, a missing one is inherited from node
+        finger->has_low[d + 1] = idx > 0 || finger->has_low[d];
+        finger->low[d + 1] = idx > 0 ? keys[idx - 1] : finger->low[d];
+        finger->has_high[d + 1] = idx < node->num_keys || finger->has_high[d];
+        finger->high[d + 1] = idx < node->num_keys ? keys[idx] : finger->high[d];
+        node = bptree_node_children(node, tree->max_keys)[idx];
+        d++;
+    }
+    finger->node_stack[d] = node;
+    finger->depth = d;
+    finger->version = tree->version;
+    return node;
+}
+
+static bptree_status bptree_finger_put_pair(bptree_finger* finger, const bptree_key_t* key, const bptree_value_t value) {
+    bptree_finger_descend(finger, key);
+    return bptree_put_in_leaf(finger->tree, key, value, finger->node_stack, finger->index_stack, finger->depth); // a split change tree->version and the path is recorded again next time
+}
+
+#ifdef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_finger_put(bptree_finger* finger, const bptree_key_t* key) {
+    if (!finger || !finger->tree || !key) return BPTREE_INVALID_ARGUMENT;
+    bptree_value_t none; // only carried by the internal helpers, never stored
+    memset(&none, 0, sizeof(none));
+    return bptree_finger_put_pair(finger, key, none);
+}
+#else
+BPTREE_API bptree_status bptree_finger_put(bptree_finger* finger, const bptree_key_t* key, const bptree_value_t value) {
+    if (!finger || !finger->tree || !key) return BPTREE_INVALID_ARGUMENT;
+    return bptree_finger_put_pair(finger, key, value);
+}
+
+BPTREE_API bptree_status bptree_finger_get(bptree_finger* finger, const bptree_key_t* key, bptree_value_t* out) {
+    if (!finger || !finger->tree || !key || !out) return BPTREE_INVALID_ARGUMENT;
+    return bptree_leaf_lookup(finger->tree, bptree_finger_descend(finger, key), key, out);
+}
+#endif
+
+BPTREE_API bool bptree_finger_contains(bptree_finger* finger, const bptree_key_t* key) {
+    if (!finger || !finger->tree || !key) return false;
+    return bptree_leaf_lookup(finger->tree, bptree_finger_descend(finger, key), key, NULL) == BPTREE_OK;
+}
+#endif
+
+#ifdef BPTREE_MULTIMAP
+BPTREE_API bptree_status bptree_get_values(const bptree* tree, const bptree_key_t* key, const bptree_value_t** values, int* n_values) {
+    if (!tree || !key || !values || !n_values) return BPTREE_INVALID_ARGUMENT;
+    bptree_node* leaf = bptree_find_leaf(tree, key, NULL, NULL, NULL);
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx >= leaf->num_keys || tree->compare(&bptree_node_keys(leaf)[idx], key) != 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_posting* posting = &bptree_node_values(leaf, tree->max_keys)[idx];
+    *values = bptree_posting_values(posting);
+    *n_values = (int)posting->count;
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_remove_value(bptree* tree, const bptree_key_t* key, const bptree_value_t value) {
+    if (!tree || !key) return BPTREE_INVALID_ARGUMENT;
+    bptree_node* leaf = bptree_find_leaf(tree, key, NULL, NULL, NULL);
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx >= leaf->num_keys || tree->compare(&bptree_node_keys(leaf)[idx], key) != 0) return BPTREE_KEY_NOT_FOUND;
+    bptree_posting* posting = &bptree_node_values(leaf, tree->max_keys)[idx];
+    const int i = bptree_posting_find(posting, &value);
+    if (i < 0) return BPTREE_KEY_NOT_FOUND;
+    if (posting->count == 1) return bptree_remove(tree, key); // the last value take the key with it, that path rebalance
+    bptree_posting_remove_at(posting, i);
+    return BPTREE_OK;
+}
+#endif
+
+#ifdef BPTREE_PENDING_MARKS
+// every leaf under the low watermark (but the edge ones a skewed split leave small) must be reachable by bptree_compact through pending nodes
+static bool bptree_check_pending(const bptree* tree, bptree_node* node, const bool marked) {
+    if (node->is_leaf) {
+        const bool edge = !node->next || node == bptree_edge_leaf(tree->root, tree->max_keys, false);
+        if (marked || node == tree->root || node->num_keys >= (edge ? 1 : tree->leaf_low)) return true;
+        bptree_debug_print(tree->enable_debug, "Invariant Fail: leaf %p has %d keys but no pending mark above it\n", (void*)node, node->num_keys);
+        return false;
+    }
+    for (int i = 0; i <= node->num_keys; i++) {
+        if (!bptree_check_pending(tree, bptree_node_children(node, tree->max_keys)[i], marked && node->pending)) return false;
+    }
+    return true;
+}
+#endif
+
+BPTREE_API bool bptree_check_invariants(const bptree* tree) {
+    if (!tree || !tree->root) return false;
+    int leaf_depth = -1;
+    if (!bptree_check_invariants_node(tree->root, tree, 0, &leaf_depth)) return false;
+#ifdef BPTREE_PENDING_MARKS
+    if (!bptree_check_pending(tree, tree->root, true)) return false;
+#endif
+    if (leaf_depth + 1 != tree->height) {
+        bptree_debug_print(tree->enable_debug, "Invariant Fail: leaves at depth %d but height is %d\n", leaf_depth, tree->height);
+        return false;
+    }
+    if (tree->rightmost != bptree_edge_leaf(tree->root, tree->max_keys, true)) {
+        bptree_debug_print(tree->enable_debug, "Invariant Fail: rightmost hint %p is not the last leaf\n", (void*)tree->rightmost);
+        return false;
+    }
+    size_t leaves = 0, leaf_keys = 0;
+    for (const bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf; leaf = leaf->next) {
+        leaves++;
+        leaf_keys += (size_t)leaf->num_keys;
+    }
+    if (leaves != tree->leaf_nodes || (size_t)bptree_count_nodes(tree->root, tree) != tree->leaf_nodes + tree->internal_nodes || leaf_keys != bptree_leaf_keys(tree)) {
+        bptree_debug_print(tree->enable_debug, "Invariant Fail: node counters (%zu leaves, %zu internal) or key count don't match the tree\n", tree->leaf_nodes, tree->internal_nodes);
+        return false;
+    }
+    if (bptree_count_separators(tree->root, tree) != tree->leaf_nodes - 1) { // what bptree_get_stats_ex count in used_key_slots
+        bptree_debug_print(tree->enable_debug, "Invariant Fail: separators don't number one less than the leaves\n");
+        return false;
+    }
+#ifdef BPTREE_MEMTABLE
+    for (int i = 0; i < tree->memtable_count; i++) { // the count above is the leaf keys plus these, each of them once
+        if (i > 0 && tree->compare(&tree->memtable[i - 1].key, &tree->memtable[i].key) >= 0) {
+            bptree_debug_print(tree->enable_debug, "Invariant Fail: memtable not sorted at %d\n", i);
+            return false;
+        }
+        const bptree_node* leaf = bptree_find_leaf(tree, &tree->memtable[i].key, NULL, NULL, NULL);
+        const int idx = bptree_node_lower_bound(tree, leaf, &tree->memtable[i].key);
+        if (idx < leaf->num_keys && tree->compare(&bptree_node_keys(leaf)[idx], &tree->memtable[i].key) == 0) {
+            bptree_debug_print(tree->enable_debug, "Invariant Fail: buffered key %d is also in a leaf\n", i);
+            return false;
+        }
+        if (!bptree_filter_may_contain(tree, &tree->memtable[i].key)) {
+            bptree_debug_print(tree->enable_debug, "Invariant Fail: buffered key %d is missing from the filter\n", i);
+            return false;
+        }
+    }
+    for (const bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++) {
+            if (!bptree_filter_may_contain(tree, &bptree_node_keys((bptree_node*)leaf)[i])) {
+                bptree_debug_print(tree->enable_debug, "Invariant Fail: a leaf key is missing from the filter, its next put would not be refused\n");
+                return false;
+            }
+        }
+    }
+#endif
+    return true;
+}
+
+#ifndef BPTREE_KEYS_ONLY
+// append n_values values to the range results, the array double when full
+static bool bptree_range_push(bptree_value_t** results, int* n, int* capacity, const bptree_value_t* values, const int n_values) {
+    if (*n + n_values > *capacity) {
+        int new_capacity = *capacity;
+        while (*n + n_values > new_capacity) new_capacity *= 2;
+        bptree_value_t* grown = realloc(*results, (size_t)new_capacity * sizeof(bptree_value_t));
+        if (!grown) return false;
+        *results = grown;
+        *capacity = new_capacity;
+    }
+    memcpy(&(*results)[*n], values, (size_t)n_values * sizeof(bptree_value_t));
+    *n += n_values;
+    return true;
+}
+
+#ifdef BPTREE_MESSAGE_BUFFERS
+/*
+    pending messages for the keys in [start, end] below node, sorted with one per key: the newest, the one a lookup would find
+    the messages of the children in the range are gathered in key order, then the node own messages (newer) are merged over them
+*/
+static bptree_status bptree_buffer_range(const bptree* tree, const bptree_node* node, const bptree_key_t* start, const bptree_key_t* end, bptree_message** out, int* n_out) {
+    *out = NULL;
+    *n_out = 0;
+    if (node->is_leaf) return BPTREE_OK;
+    bptree_message* below = NULL;
+    int n_below = 0;
+    const int last = bptree_node_child_index(tree, node, end);
+    for (int c = bptree_node_child_index(tree, node, start); c <= last; c++) {
+        bptree_message* part;
+        int n_part;
+        const bptree_status status = bptree_buffer_range(tree, bptree_node_children((bptree_node*)node, tree->max_keys)[c], start, end, &part, &n_part);
+        if (status != BPTREE_OK) {
+            free(below);
+            return status;
+        }
+        if (n_part == 0) continue;
+        bptree_message* grown = realloc(below, (size_t)(n_below + n_part) * sizeof(bptree_message));
+        if (!grown) {
+            free(part);
+            free(below);
+            return BPTREE_ALLOCATION_FAILURE;
+        }
+        below = grown;
+        memcpy(&below[n_below], part, (size_t)n_part * sizeof(bptree_message));
+        n_below += n_part;
+        free(part);
+    }
+    const int first_own = bptree_buffer_count_below(tree, node, start);
+    int last_own = first_own;
+    while (last_own < node->num_messages && tree->compare(&node->messages[last_own].key, end) <= 0) last_own++;
+    if (last_own == first_own) {
+        *out = below;
+        *n_out = n_below;
+        return BPTREE_OK;
+    }
+    bptree_message* merged = malloc((size_t)(n_below + last_own - first_own) * sizeof(bptree_message));
+    if (!merged) {
+        free(below);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    int i = first_own, j = 0, k = 0;
+    while (i < last_own && j < n_below) {
+        const int cmp = tree->compare(&node->messages[i].key, &below[j].key);
+        if (cmp <= 0) {
+            if (cmp == 0) j++; // the message of the node is newer
+            merged[k++] = node->messages[i++];
+        } else {
+            merged[k++] = below[j++];
+        }
+    }
+    while (i < last_own) merged[k++] = node->messages[i++];
+    while (j < n_below) merged[k++] = below[j++];
+    free(below);
+    *out = merged;
+    *n_out = k;
+    return BPTREE_OK;
+}
+#endif
+
+BPTREE_API bptree_status bptree_get_range(const bptree* tree, const bptree_key_t* start, const bptree_key_t* end, bptree_value_t** out_values, int* n_results) {
+    if (!tree || !tree->root || !start || !end || !out_values || !n_results) return BPTREE_INVALID_ARGUMENT;
+    *out_values = NULL;
+    *n_results = 0;
+    if (tree->compare(start, end) > 0) return BPTREE_OK; // empty range
+    int capacity = 16, n = 0;
+    bptree_value_t* results = malloc((size_t)capacity * sizeof(bptree_value_t));
+    if (!results) return BPTREE_ALLOCATION_FAILURE;
+#ifdef BPTREE_MESSAGE_BUFFERS
+    bptree_message* pending;
+    int n_pending, p = 0;
+    const bptree_status status = bptree_buffer_range(tree, tree->root, start, end, &pending, &n_pending);
+    if (status != BPTREE_OK) {
+        free(results);
+        return status;
+    }
+#elif defined(BPTREE_MEMTABLE)
+    int p; // the buffered keys are never in a leaf, they are interleaved with the leaf keys
+    bptree_memtable_search(tree, start, &p);
+#endif
+    bool ok = true, done = false;
+    bptree_node* leaf = bptree_find_leaf(tree, start, NULL, NULL, NULL);
+#ifdef BPTREE_COMPRESSED_LEAVES
+    int i = leaf->key_width ? bptree_packed_lower_bound(leaf, start) : bptree_node_lower_bound(tree, leaf, start);
+#else
+    int i = bptree_node_lower_bound(tree, leaf, start);
+#endif
+    for (; leaf && ok && !done; leaf = leaf->next, i = 0) {
+        for (; i < leaf->num_keys && ok; i++) {
+            const bptree_key_t key = bptree_node_key_at(leaf, i);
+            if (tree->compare(&key, end) > 0) {
+                done = true;
+                break;
+            }
+#ifdef BPTREE_MESSAGE_BUFFERS
+            for (; ok && p < n_pending && tree->compare(&pending[p].key, &key) < 0; p++) {
+                if (pending[p].op == BPTREE_MESSAGE_PUT) ok = bptree_range_push(&results, &n, &capacity, &pending[p].value, 1);
+            }
+            if (p < n_pending && tree->compare(&pending[p].key, &key) == 0) { // the message is newer than the leaf
+                if (ok && pending[p].op == BPTREE_MESSAGE_PUT) ok = bptree_range_push(&results, &n, &capacity, &pending[p].value, 1);
+                p++;
+                continue;
+            }
+#elif defined(BPTREE_MEMTABLE)
+            for (; ok && p < tree->memtable_count && tree->compare(&tree->memtable[p].key, &key) < 0; p++) {
+                ok = bptree_range_push(&results, &n, &capacity, &tree->memtable[p].value, 1);
+            }
+#endif
+            if (!ok) break;
+#ifdef BPTREE_MULTIMAP
+            bptree_posting* posting = &bptree_node_values(leaf, tree->max_keys)[i];
+            ok = bptree_range_push(&results, &n, &capacity, bptree_posting_values(posting), (int)posting->count);
+#elif defined(BPTREE_COMPRESSED_LEAVES)
+            ok = bptree_range_push(&results, &n, &capacity, leaf->key_width ? &bptree_packed_values(leaf)[i] : &bptree_node_values(leaf, tree->max_keys)[i], 1);
+#else
+            ok = bptree_range_push(&results, &n, &capacity, &bptree_node_values(leaf, tree->max_keys)[i], 1);
+#endif
+        }
+    }
+#ifdef BPTREE_MESSAGE_BUFFERS
+    for (; ok && p < n_pending; p++) { // puts of keys after the last leaf key of the range
+        if (pending[p].op == BPTREE_MESSAGE_PUT) ok = bptree_range_push(&results, &n, &capacity, &pending[p].value, 1);
+    }
+    free(pending);
+#elif defined(BPTREE_MEMTABLE)
+    for (; ok && p < tree->memtable_count && tree->compare(&tree->memtable[p].key, end) <= 0; p++) {
+        ok = bptree_range_push(&results, &n, &capacity, &tree->memtable[p].value, 1);
+    }
+#endif
+    if (!ok) {
+        free(results);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    *out_values = results;
+    *n_results = n;
+    return BPTREE_OK;
+}
+#endif
+
+BPTREE_API void bptree_free_range_results(bptree_value_t* results) {
+    free(results); // the results are a single malloc'd array
+}
+
+BPTREE_API bptree_stats bptree_get_stats(const bptree* tree) {
+    bptree_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (!tree || !tree->root) return stats; // a paged tree keeps its nodes in the file
+    stats.count = tree->count;
+    stats.height = tree->height;
+    stats.node_count = (int)(tree->leaf_nodes + tree->internal_nodes);
+    stats.leaf_count = (int)tree->leaf_nodes;
+    stats.leaf_fill = (double)bptree_leaf_keys(tree) / ((double)tree->leaf_nodes * tree->max_keys);
+    stats.rebalances_deferred = tree->rebalances_deferred;
+    stats.merges_deferred = tree->merges_deferred;
+    return stats;
+}
+
+BPTREE_API bptree_stats_ex bptree_get_stats_ex(bptree* tree, int samples) {
+    bptree_stats_ex stats;
+    memset(&stats, 0, sizeof(stats));
+    if (!tree || !tree->root) return stats;
+    stats.leaf_nodes = tree->leaf_nodes;
+    stats.internal_nodes = tree->internal_nodes;
+    stats.bytes = tree->memory_used;
+    stats.key_slots = (tree->leaf_nodes + tree->internal_nodes) * (size_t)tree->max_keys;
+    /*
+        every node but the root is the child of one internal node which has one child more than separators, so the separators
+        number leaf_nodes + internal_nodes - 1 - internal_nodes, exact whatever the fill (lazy removes, packed leaves, empty leaves freed)
+        and the leaf keys are the count without the memtable, bptree_check_invariants walk the tree to check both
+    */
+    stats.used_key_slots = bptree_leaf_keys(tree) + tree->leaf_nodes - 1;
+    if (samples > BPTREE_STATS_SAMPLES) samples = BPTREE_STATS_SAMPLES;
+    if (samples < 1) return stats;
+    int fills[BPTREE_STATS_SAMPLES];
+    int n = 0;
+    if (tree->leaf_nodes <= (size_t)samples) {
+        for (const bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf; leaf = leaf->next) fills[n++] = leaf->num_keys;
+    } else {
+        /*
+            rejection sampling: each level draw one of the max_keys + 1 child slots and the descent restart on an empty one
+            so every leaf is reached with the same probability, a uniform child per level would favor the leaves of sparse nodes
+        */
+        uint64_t seed = tree->sample_seed;
+        for (int tries = 0; n < samples && tries < 64 * samples; tries++) { // bounded, a very sparse tree can return fewer samples
+            bptree_node* node = tree->root;
+            while (node && !node->is_leaf) {
+                seed ^= seed << 13; // xorshift64
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                const int slot = (int)(seed % (uint64_t)(tree->max_keys + 1));
+                node = slot <= node->num_keys ? bptree_node_children(node, tree->max_keys)[slot] : NULL;
+            }
+            if (node) fills[n++] = node->num_keys;
+        }
+        tree->sample_seed = seed; // the next call draw other leaves
+        if (n == 0) return stats;
+    }
+    for (int i = 1; i < n; i++) { // insertion sort, n is small
+        const int fill = fills[i];
+        int j = i;
+        for (; j > 0 && fills[j - 1] > fill; j--) fills[j] = fills[j - 1];
+        fills[j] = fill;
+    }
+    stats.sampled_leaves = n;
+    stats.sample_min = (double)fills[0] / tree->max_keys;
+    stats.fill_p10 = (double)fills[(n - 1) * 10 / 100] / tree->max_keys;
+    stats.fill_p50 = (double)fills[(n - 1) * 50 / 100] / tree->max_keys;
+    stats.fill_p90 = (double)fills[(n - 1) * 90 / 100] / tree->max_keys;
+    return stats;
+}
+
+BPTREE_API bptree_status bptree_set_watermarks(bptree* tree, const int low_percent, const int high_percent) {
+    if (!tree || !tree->root || low_percent < 0 || low_percent > 50 || high_percent < 2 * low_percent || high_percent > 100) return BPTREE_INVALID_ARGUMENT;
+    if (tree->count > 0) return BPTREE_INVALID_ARGUMENT; // nodes already under a raised low watermark would break the invariants
+    int low = (tree->max_keys * low_percent + 99) / 100; // rounded up so 50% is the minimum itself
+    if (low < 1) low = 1; // free at empty, a node with no key left is still rebalanced
+    tree->leaf_low = low < tree->min_leaf_keys ? low : tree->min_leaf_keys;
+    tree->internal_low = low < tree->min_internal_keys ? low : tree->min_internal_keys;
+    tree->leaf_high = tree->max_keys * high_percent / 100;
+    tree->internal_high = tree->leaf_high;
+    bptree_debug_print(tree->enable_debug, "Watermarks: leaves rebalanced under %d keys, internal nodes under %d, merges up to %d keys\n",
+                       tree->leaf_low, tree->internal_low, tree->leaf_high);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_status bptree_set_memory_limit(bptree* tree, const size_t max_bytes) {
+    if (!tree) return BPTREE_INVALID_ARGUMENT;
+    tree->memory_limit = max_bytes;
+    bptree_debug_print(tree->enable_debug, "Memory limit %zu bytes (%zu used)\n", max_bytes, tree->memory_used);
+    return BPTREE_OK;
+}
+
+BPTREE_API size_t bptree_memory_usage(const bptree* tree) {
+    return tree ? tree->memory_used : 0;
+}
+
+#if !defined(BPTREE_PAGED) && !defined(BPTREE_MULTIMAP)
+BPTREE_API void bptree_frozen_free(bptree_frozen* frozen) {
+    if (!frozen) return;
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    if (frozen->keys) {
+        for (int i = 0; i < frozen->count; i++) bptree_key_release(&frozen->keys[i]); // the index slots are shallow copies of these
+    }
+#endif
+    free(frozen->index);
+    free(frozen->keys);
+    free(frozen->values);
+    free(frozen);
+}
+
+// children of node j of index level l, only the last node of a level can have less than fanout
+static int bptree_frozen_children(const bptree_frozen* frozen, const int l, const int j) {
+    const int below = frozen->level_nodes[l + 1] - j * frozen->fanout;
+    return below < frozen->fanout ? below : frozen->fanout;
+}
+
+#if !defined(BPTREE_KEY_TYPE_STRING) && !defined(BPTREE_KEY_TYPE_VARLEN)
+#define BPTREE_FROZEN_BLOCK_KEYS ((int)(BPTREE_CACHE_LINE / sizeof(bptree_key_t))) // separators in a block node, fanout is one more
+
+/*
+    block descent, the count over a full block has a constant trip count
+    so the compiler unroll it into a few vector compares and the only branch per level is the loop
+*/
+static int bptree_frozen_block_lower_bound(const bptree_frozen* frozen, const bptree_key_t key) {
+    int node = 0;
+    for (int l = 0; l < frozen->levels; l++) {
+        const bptree_key_t* block = frozen->index + frozen->level_offset[l] + (size_t)node * BPTREE_FROZEN_BLOCK_KEYS;
+        int below = 0;
+        for (int i = 0; i < BPTREE_FROZEN_BLOCK_KEYS; i++) below += block[i] <= key;
+        const int last = bptree_frozen_children(frozen, l, node) - 1;
+        node = node * frozen->fanout + (below < last ? below : last); // the padding repeat the last separator
+    }
+    const int first = node * frozen->leaf_keys;
+    const int n = first + frozen->leaf_keys < frozen->count ? frozen->leaf_keys : frozen->count - first;
+    const bptree_key_t* leaf = frozen->keys + first;
+    int below = 0;
+    for (int i = 0; i < n; i++) below += leaf[i] < key;
+    return first + below;
+}
+#endif
+
+// position in keys of the first key >= key, count when there is none
+static int bptree_frozen_lower_bound(const bptree_frozen* frozen, const bptree_key_t* key) {
+#if !defined(BPTREE_KEY_TYPE_STRING) && !defined(BPTREE_KEY_TYPE_VARLEN)
+    if (frozen->block_search) return bptree_frozen_block_lower_bound(frozen, *key);
+#endif
+    int node = 0;
+    for (int l = 0; l < frozen->levels; l++) {
+        const bptree_key_t* separators = frozen->index + frozen->level_offset[l] + (size_t)node * (size_t)(frozen->fanout - 1);
+        int lo = 0;
+        int hi = bptree_frozen_children(frozen, l, node) - 1;
+        while (lo < hi) { // a key equal to a separator go right
+            const int mid = lo + (hi - lo) / 2;
+            if (frozen->compare(&separators[mid], key) <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        node = node * frozen->fanout + lo; // computed, not read
+    }
+    int lo = node * frozen->leaf_keys;
+    int hi = lo + frozen->leaf_keys < frozen->count ? lo + frozen->leaf_keys : frozen->count;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if (frozen->compare(&frozen->keys[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+#ifndef BPTREE_KEYS_ONLY
+BPTREE_API bptree_status bptree_frozen_get(const bptree_frozen* frozen, const bptree_key_t* key, bptree_value_t* out) {
+    if (!frozen || !key || !out) return BPTREE_INVALID_ARGUMENT;
+    const int idx = bptree_frozen_lower_bound(frozen, key);
+    if (idx >= frozen->count || frozen->compare(&frozen->keys[idx], key) != 0) return BPTREE_KEY_NOT_FOUND;
+    *out = frozen->values[idx];
+    return BPTREE_OK;
+}
+#endif
+
+BPTREE_API bool bptree_frozen_contains(const bptree_frozen* frozen, const bptree_key_t* key) {
+    if (!frozen || !key) return false;
+    const int idx = bptree_frozen_lower_bound(frozen, key);
+    return idx < frozen->count && frozen->compare(&frozen->keys[idx], key) == 0;
+}
+
+BPTREE_API bptree_status bptree_frozen_range(const bptree_frozen* frozen, const bptree_key_t* start, const bptree_key_t* end,
+                                             const bptree_key_t** keys, const bptree_value_t** values, int* n_results) {
+    if (!frozen || !start || !end || !keys || !n_results) return BPTREE_INVALID_ARGUMENT;
+    const int first = bptree_frozen_lower_bound(frozen, start);
+    int last = bptree_frozen_lower_bound(frozen, end);
+    if (last < frozen->count && frozen->compare(&frozen->keys[last], end) == 0) last++; // end is included
+    *n_results = last > first ? last - first : 0;
+    *keys = frozen->keys + first;
+    if (values) *values = frozen->values ? frozen->values + first : NULL;
+    return BPTREE_OK;
+}
+
+// an array that start on a cache line, so each block of a block search frozen copy is exactly one line
+static void* bptree_frozen_array(const size_t bytes) {
+    const size_t size = ((bytes ? bytes : 1) + BPTREE_CACHE_LINE - 1) / BPTREE_CACHE_LINE * BPTREE_CACHE_LINE;
+    return aligned_alloc(BPTREE_CACHE_LINE, size);
+}
+
+// copy the keys and values of every leaf in order, the tree is walked through the leaf chain
+static bool bptree_frozen_copy_leaves(const bptree* tree, bptree_frozen* frozen) {
+    int n = 0;
+    for (bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++, n++) {
+            const bptree_key_t key = bptree_node_key_at(leaf, i);
+#ifdef BPTREE_KEY_TYPE_VARLEN
+            if (!bptree_key_clone(&key, key.len, &frozen->keys[n])) {
+                frozen->count = n; // the keys cloned so far are released by bptree_frozen_free
+                return false;
+            }
+#else
+            frozen->keys[n] = key;
+#endif
+#ifndef BPTREE_KEYS_ONLY
+#ifdef BPTREE_COMPRESSED_LEAVES
+            frozen->values[n] = leaf->key_width ? bptree_packed_values(leaf)[i] : bptree_node_values(leaf, tree->max_keys)[i];
+#else
+            frozen->values[n] = bptree_node_values(leaf, tree->max_keys)[i];
+#endif
+#endif
+        }
+    }
+    frozen->count = n;
+    return true;
+}
+
+BPTREE_API bptree_frozen* bptree_freeze(bptree* tree) {
+    if (!tree) return NULL;
+#ifdef BPTREE_MESSAGE_BUFFERS
+    if (bptree_flush_messages(tree) != BPTREE_OK) return NULL;
+#endif
+#ifdef BPTREE_MEMTABLE
+    const bptree_status merged = bptree_merge_memtable(tree);
+    if (merged != BPTREE_OK && merged != BPTREE_DUPLICATE_KEY) return NULL;
+#endif
+    bptree_frozen* frozen = calloc(1, sizeof(bptree_frozen));
+    if (!frozen) return NULL;
+    frozen->leaf_keys = tree->max_keys;
+    frozen->compare = tree->compare;
+#if !defined(BPTREE_KEY_TYPE_STRING) && !defined(BPTREE_KEY_TYPE_VARLEN)
+    frozen->block_search = tree->compare == bptree_default_compare && BPTREE_FROZEN_BLOCK_KEYS >= 2;
+    if (frozen->block_search) frozen->leaf_keys = BPTREE_FROZEN_BLOCK_KEYS;
+#endif
+    frozen->fanout = frozen->leaf_keys + 1;
+    const size_t count = (size_t)tree->count;
+    frozen->keys = bptree_frozen_array(count * sizeof(bptree_key_t));
+#ifndef BPTREE_KEYS_ONLY
+    frozen->values = malloc((count ? count : 1) * sizeof(bptree_value_t));
+    if (!frozen->values) {
+        bptree_frozen_free(frozen);
+        return NULL;
+    }
+#endif
+    if (!frozen->keys || !bptree_frozen_copy_leaves(tree, frozen)) {
+        bptree_frozen_free(frozen);
+        return NULL;
+    }
+
+    // size the levels bottom up: ceil(nodes below / fanout) until one node is left
+    const int leaves = (frozen->count + frozen->leaf_keys - 1) / frozen->leaf_keys;
+    int sizes[BPTREE_MAX_HEIGHT];
+    int levels = 0;
+    for (int nodes = leaves; nodes > 1 && levels < BPTREE_MAX_HEIGHT; levels++) {
+        nodes = (nodes + frozen->fanout - 1) / frozen->fanout;
+        sizes[levels] = nodes;
+    }
+    frozen->levels = levels;
+    size_t slots = 0;
+    for (int l = 0; l < levels; l++) {
+        frozen->level_nodes[l] = sizes[levels - 1 - l]; // root level first
+        frozen->level_offset[l] = slots;
+        slots += (size_t)frozen->level_nodes[l] * (size_t)(frozen->fanout - 1);
+    }
+    frozen->level_nodes[levels] = leaves;
+    frozen->index = bptree_frozen_array(slots * sizeof(bptree_key_t));
+    if (!frozen->index) {
+        bptree_frozen_free(frozen);
+        return NULL;
+    }
+
+    // separator c of node j at level l is the first key of its child c, that child start at leaf (j * fanout + c) * span
+    size_t span = 1; // leaves under one child of a node of level l
+    for (int l = levels - 1; l >= 0; l--) {
+        bptree_key_t* level = frozen->index + frozen->level_offset[l];
+        for (int j = 0; j < frozen->level_nodes[l]; j++) {
+            const int children = bptree_frozen_children(frozen, l, j);
+            for (int slot = 1; slot < frozen->fanout; slot++) {
+                const int c = slot < children ? slot : children - 1; // every slot is set, the unused ones repeat the last child
+                const size_t first_leaf = ((size_t)j * (size_t)frozen->fanout + (size_t)c) * span;
+                level[(size_t)j * (size_t)(frozen->fanout - 1) + (size_t)(slot - 1)] = frozen->keys[first_leaf * (size_t)frozen->leaf_keys];
+            }
+        }
+        span *= (size_t)frozen->fanout;
+    }
+    bptree_debug_print(tree->enable_debug, "Frozen %d keys in %d leaves under %d index levels\n", frozen->count, leaves, levels);
+    return frozen;
+}
+#endif
+
+#ifdef BPTREE_PAGED
+/*
+    disk resident mode
+        every node is a fixed size page in a file, page 0 hold the file header
+        childrens of an internal page are page ids (bptree_node_child_ids) and leaves are chained with next_page
+        a buffer pool of frames cache the pages, a page is pinned while a caller use it and unpinned after
+        eviction is a clock sweep that skip internal pages on the first round so the upper levels stay in memory
+        and leaves are paged in on demand, internal pages are only evicted when the pool hold nothing else
+    removes don't borrow or merge, that would cost extra reads and writes, but a leaf they empty is unlinked from its parent
+    and from the leaf chain, its page and the ones of the ancestors left without children go on a free list in the header
+    that new pages are taken from before the file grow
+*/
+
+#define BPTREE_PAGER_MAGIC 0x4750454552545042ULL // "BPTREEPG" read as little endian bytes
+#define BPTREE_PAGE_ALIGN 512 // page size and frame adresses are multiple of a sector so the file can be opened with O_DIRECT
+#define BPTREE_PAGER_MIN_FRAMES 8 // a split keep its path and its new pages pinned, a put that need more frames fail untouched
+
+typedef struct bptree_page_header { // content of page 0
+    uint64_t magic; // BPTREE_PAGER_MAGIC, to reject files that are not a tree
+    uint64_t page_size; // size of every page
+    uint64_t page_count; // pages in the file (header included)
+    uint64_t root_page; // page of the root node
+    int64_t count; // key/value pairs in the tree
+    int32_t height; // height of the tree
+    int32_t max_keys; // the layout of a page depend on it so it must match on reopen
+    uint64_t free_page; // first freed page, each link the next one with next_page, BPTREE_INVALID_PAGE (0 in older files) if none
+    uint64_t free_count; // pages on that list
+} bptree_page_header;
+
+typedef struct bptree_frame {
+    bptree_page_id page_id; // page held by the frame, BPTREE_INVALID_PAGE if the frame is empty
+    int pin_count; // number of users of the page, a pinned frame can't be evicted
+    bool dirty; // page was modified and must be written before eviction
+    bool referenced; // clock bit, set on every access and cleared by the clock hand
+    bool io_pending; // an asynchronous read is filling the frame, it can't be used or evicted before it complete
+    bptree_node* node; // page_size bytes of page content
+} bptree_frame;
+
+typedef struct bptree_pager {
+    int fd; // the tree file
+    size_t page_size; // bytes per page
+    bptree_page_header header; // in memory copy of page 0
+    bptree_frame* frames; // the buffer pool
+    int frame_count; // number of frames
+    int used_frames; // frames that already hold a page, frames are filled in order before the clock start to evict
+    int clock_hand; // next frame examined by the clock
+    int* table; // page id -> frame index, open addressing with linear probing, -1 is an empty slot
+    int table_mask; // table size - 1, table size is a power of 2
+    void* pool_memory; // aligned memory of all the frames
+    bool enable_debug;
+    bptree_pager_stats stats;
+#ifdef BPTREE_IO_URING
+    struct bptree_uring* ring; // NULL if the kernel refused io_uring, reads ahead fall back to posix_fadvise
+#endif
+} bptree_pager;
+
+// multiplicative hash of a page id into the table
+static int bptree_pager_slot(const bptree_pager* pager, const bptree_page_id id) {
+    return (int)((id * 0x9E3779B97F4A7C15ULL) >> 32) & pager->table_mask;
+}
+
+// return the frame that hold the page or -1
+static int bptree_pager_lookup(const bptree_pager* pager, const bptree_page_id id) {
+    for (int slot = bptree_pager_slot(pager, id);; slot = (slot + 1) & pager->table_mask) {
+        const int f = pager->table[slot];
+        if (f < 0) return -1; // reached an empty slot: page is not cached
+        if (pager->frames[f].page_id == id) return f;
+    }
+}
+
+static void bptree_pager_table_insert(bptree_pager* pager, const int frame) {
+    int slot = bptree_pager_slot(pager, pager->frames[frame].page_id);
+    while (pager->table[slot] >= 0) slot = (slot + 1) & pager->table_mask; // table is twice the frames so there's always a free slot
+    pager->table[slot] = frame;
+}
+
+// remove a page from the table, the following entries of the probe chain are shifted back so lookups don't need tombstones
+static void bptree_pager_table_remove(bptree_pager* pager, const bptree_page_id id) {
+    int slot = bptree_pager_slot(pager, id);
+    while (pager->frames[pager->table[slot]].page_id != id) slot = (slot + 1) & pager->table_mask;
+    int hole = slot;
+    for (int next = (hole + 1) & pager->table_mask; pager->table[next] >= 0; next = (next + 1) & pager->table_mask) {
+        const int home = bptree_pager_slot(pager, pager->frames[pager->table[next]].page_id);
+        // the entry can fill the hole only if its home slot is not between the hole and its current slot (cyclic)
+        const bool movable = (hole <= next) ? (home <= hole || home > next) : (home <= hole && home > next);
+        if (movable) {
+            pager->table[hole] = pager->table[next];
+            hole = next;
+        }
+    }
+    pager->table[hole] = -1;
+}
+
+static bptree_status bptree_pager_write_page(bptree_pager* pager, const bptree_page_id id, const void* page) {
+    const ssize_t n = pwrite(pager->fd, page, pager->page_size, (off_t)(id * pager->page_size));
+    if (n != (ssize_t)pager->page_size) {
+        bptree_debug_print(pager->enable_debug, "Page write failed (page %llu)\n", (unsigned long long)id);
+        return BPTREE_INTERNAL_ERROR;
+    }
+    pager->stats.writes++;
+    return BPTREE_OK;
+}
+
+static bptree_status bptree_pager_read_page(bptree_pager* pager, const bptree_page_id id, void* page) {
+    const ssize_t n = pread(pager->fd, page, pager->page_size, (off_t)(id * pager->page_size));
+    if (n != (ssize_t)pager->page_size) {
+        bptree_debug_print(pager->enable_debug, "Page read failed (page %llu)\n", (unsigned long long)id);
+        return BPTREE_INTERNAL_ERROR;
+    }
+    return BPTREE_OK;
+}
+
+static bptree_status bptree_pager_write_header(bptree_pager* pager) {
+    void* page = calloc(1, pager->page_size); // header is written as a full page so the pages after it stay aligned
+    if (!page) return BPTREE_ALLOCATION_FAILURE;
+    memcpy(page, &pager->header, sizeof(bptree_page_header));
+    const bptree_status status = bptree_pager_write_page(pager, 0, page);
+    free(page);
+    return status;
+}
+
+/*
+    find a frame to load a page in
+        empty frames are used first
+        then the clock hand go around the frames: pinned frames are skipped, referenced frames get a second chance
+        in the first round only leaf pages are candidates, internal pages are evicted only if no leaf can be
+    a dirty victim is written back before the frame is reused
+*/
+static int bptree_pager_victim(bptree_pager* pager) {
+    if (pager->used_frames < pager->frame_count) return pager->used_frames++;
+    for (int round = 0; round < 2; round++) {
+        for (int step = 0; step < 2 * pager->frame_count; step++) { // two turns: the first one may only clear referenced bits
+            const int f = pager->clock_hand;
+            pager->clock_hand = (pager->clock_hand + 1) % pager->frame_count;
+            bptree_frame* frame = &pager->frames[f];
+            if (frame->pin_count > 0 || frame->io_pending) continue;
+            if (frame->page_id == BPTREE_INVALID_PAGE) return f; // emptied by a failed read
+            if (round == 0 && !frame->node->is_leaf) continue; // keep the upper levels resident
+            if (frame->referenced) {
+                frame->referenced = false;
+                continue;
+            }
+            if (frame->dirty && bptree_pager_write_page(pager, frame->page_id, frame->node) != BPTREE_OK) return -1;
+            bptree_pager_table_remove(pager, frame->page_id);
+            frame->page_id = BPTREE_INVALID_PAGE;
+            frame->dirty = false;
+            pager->stats.evictions++;
+            return f;
+        }
+    }
+    bptree_debug_print(pager->enable_debug, "Buffer pool exhausted: all %d frames are pinned\n", pager->frame_count);
+    return -1;
+}
+
+// put a page in a frame and pin it
+static bptree_node* bptree_pager_install(bptree_pager* pager, const int f, const bptree_page_id id, const bool dirty) {
+    bptree_frame* frame = &pager->frames[f];
+    frame->page_id = id;
+    frame->pin_count = 1;
+    frame->dirty = dirty;
+    frame->referenced = true;
+    frame->node->next = NULL; // a pointer read from disk mean nothing
+    bptree_pager_table_insert(pager, f);
+    return frame->node;
+}
+
+#ifdef BPTREE_IO_URING
+static void bptree_uring_reap(bptree_pager* pager, bool wait);
+#endif
+
+// return the node stored in page id pinned in the pool, NULL on I/O error or when every frame is pinned
+static bptree_node* bptree_pager_fetch(bptree_pager* pager, const bptree_page_id id) {
+    int cached = bptree_pager_lookup(pager, id);
+#ifdef BPTREE_IO_URING
+    while (cached >= 0 && pager->frames[cached].io_pending) { // read ahead but not arrived yet: wait for it instead of reading again
+        bptree_uring_reap(pager, true);
+        cached = bptree_pager_lookup(pager, id); // a failed read leave the page uncached
+    }
+#endif
+    if (cached >= 0) {
+        bptree_frame* frame = &pager->frames[cached];
+        frame->pin_count++;
+        frame->referenced = true;
+        pager->stats.hits++;
+        return frame->node;
+    }
+    pager->stats.misses++;
+    const int f = bptree_pager_victim(pager);
+    if (f < 0) return NULL;
+    if (bptree_pager_read_page(pager, id, pager->frames[f].node) != BPTREE_OK) return NULL; // frame stay empty
+    return bptree_pager_install(pager, f, id, false);
+}
+
+// release a page returned by fetch or new_page, dirty if the caller modified it
+static void bptree_pager_unpin(bptree_pager* pager, const bptree_node* node, const bool dirty) {
+    const int f = bptree_pager_lookup(pager, node->page_id);
+    assert(f >= 0 && pager->frames[f].pin_count > 0);
+    pager->frames[f].pin_count--;
+    pager->frames[f].dirty |= dirty;
+}
+
+// allocate a page for a new node, a freed one first then at the end of the file, and return it pinned and dirty
+static bptree_node* bptree_pager_new_page(bptree_pager* pager, const bool is_leaf) {
+    bptree_node* node;
+    bptree_page_id id = pager->header.free_page;
+    if (id != BPTREE_INVALID_PAGE) {
+        node = bptree_pager_fetch(pager, id); // read for its link to the next free page
+        if (!node) return NULL;
+        pager->header.free_page = node->next_page;
+        pager->header.free_count--;
+        pager->frames[bptree_pager_lookup(pager, id)].dirty = true;
+    } else {
+        const int f = bptree_pager_victim(pager);
+        if (f < 0) return NULL;
+        id = pager->header.page_count++; // grow the file, the page is written on eviction or flush
+        node = bptree_pager_install(pager, f, id, true);
+    }
+    memset(node, 0, pager->page_size);
+    node->is_leaf = is_leaf;
+    node->num_keys = 0;
+    node->page_id = id;
+    node->next_page = BPTREE_INVALID_PAGE;
+    return node;
+}
+
+// put a pinned page on the free list and unpin it, nothing may point to it anymore
+static void bptree_pager_free_page(bptree_pager* pager, bptree_node* node) {
+    node->num_keys = 0;
+    node->next_page = pager->header.free_page;
+    pager->header.free_page = node->page_id;
+    pager->header.free_count++;
+    bptree_pager_unpin(pager, node, true);
+}
+
+#ifdef BPTREE_IO_URING
+/*
+    minimal io_uring driven with the raw syscalls so the header don't depend on liburing
+    a read ahead reserve a frame, register the page in the table with io_pending set and queue an IORING_OP_READ into the frame
+    completions clear io_pending, a failed or short read drop the page from the pool so the next fetch read it with pread
+*/
+#ifndef BPTREE_URING_ENTRIES
+#define BPTREE_URING_ENTRIES 64 // submission queue size, the kernel give a completion queue twice as large
+#endif
+
+typedef struct bptree_uring {
+    int fd; // the ring
+    unsigned* sq_head; // advanced by the kernel when it consume submissions
+    unsigned* sq_tail; // advanced by us when we add submissions
+    unsigned sq_mask;
+    unsigned* sq_array; // indices of the sqes in submission order
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head; // advanced by us when we consume completions
+    unsigned* cq_tail; // advanced by the kernel when it post completions
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe* cqes;
+    void* sq_ring; // mmap of the submission ring
+    size_t sq_ring_size;
+    void* cq_ring; // mmap of the completion ring, same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned sq_entries;
+    unsigned queued; // sqes written but not submitted yet
+    unsigned in_flight; // reads submitted and not completed
+} bptree_uring;
+
+static void bptree_uring_setup(bptree_pager* pager) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int fd = (int)syscall(__NR_io_uring_setup, BPTREE_URING_ENTRIES, &params);
+    if (fd < 0) { // old kernel or disabled by seccomp: keep the blocking reads
+        bptree_debug_print(pager->enable_debug, "io_uring unavailable, read ahead use posix_fadvise\n");
+        return;
+    }
+    bptree_uring* ring = calloc(1, sizeof(bptree_uring));
+    if (!ring) {
+        close(fd);
+        return;
+    }
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+    ring->cq_entries = params.cq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) { // one mapping hold both rings, it must be large enough for the bigger one
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring
+                                : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        if (!single_mmap && ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        close(fd);
+        free(ring);
+        bptree_debug_print(pager->enable_debug, "io_uring ring mapping failed, read ahead use posix_fadvise\n");
+        return;
+    }
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    pager->ring = ring;
+}
+
+// hand the queued sqes to the kernel
+static void bptree_uring_submit(bptree_pager* pager) {
+    bptree_uring* ring = pager->ring;
+    while (ring->queued > 0) {
+        const int ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            bptree_debug_print(pager->enable_debug, "io_uring_enter submit failed (errno %d)\n", errno);
+            return; // the sqes stay in the ring and go with the next submit
+        }
+        ring->queued -= (unsigned)ret;
+        ring->in_flight += (unsigned)ret;
+    }
+}
+
+// consume the completions, if wait block until at least one read complete
+static void bptree_uring_reap(bptree_pager* pager, const bool wait) {
+    bptree_uring* ring = pager->ring;
+    bptree_uring_submit(pager);
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); // cqe content is visible after this load
+        const bool completed = head != tail;
+        while (head != tail) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            bptree_frame* frame = &pager->frames[(int)cqe->user_data];
+            frame->io_pending = false;
+            ring->in_flight--;
+            if (cqe->res != (int)pager->page_size) { // error or read past the end: forget the page, fetch will read it again
+                bptree_debug_print(pager->enable_debug, "Async read failed (page %llu, res %d)\n", (unsigned long long)frame->page_id, cqe->res);
+                bptree_pager_table_remove(pager, frame->page_id);
+                frame->page_id = BPTREE_INVALID_PAGE;
+            } else {
+                frame->node->next = NULL; // a pointer read from disk mean nothing
+            }
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE); // give the cqes back to the kernel
+        if (completed || !wait || ring->in_flight == 0) return;
+        const int ret = (int)syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            bptree_debug_print(pager->enable_debug, "io_uring_enter wait failed (errno %d)\n", errno);
+            return;
+        }
+    }
+}
+
+// queue a read of page id into frame f
+static void bptree_uring_queue_read(bptree_pager* pager, const int f, const bptree_page_id id) {
+    bptree_uring* ring = pager->ring;
+    while (ring->queued + ring->in_flight >= ring->cq_entries) bptree_uring_reap(pager, true); // never let the completion queue overflow
+    const unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) bptree_uring_submit(pager); // submission ring full
+    const unsigned idx = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = pager->fd;
+    sqe->addr = (uint64_t)(uintptr_t)pager->frames[f].node;
+    sqe->len = (unsigned)pager->page_size;
+    sqe->off = id * pager->page_size;
+    sqe->user_data = (uint64_t)f;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE); // the kernel may read the sqe once the tail move
+    ring->queued++;
+}
+
+static void bptree_uring_destroy(bptree_pager* pager) {
+    bptree_uring* ring = pager->ring;
+    if (!ring) return;
+    while (ring->queued > 0 || ring->in_flight > 0) {
+        const unsigned before = ring->queued + ring->in_flight;
+        bptree_uring_reap(pager, true);
+        if (ring->queued + ring->in_flight == before) break; // the ring is broken, nothing more will complete
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+    pager->ring = NULL;
+}
+#endif
+
+/*
+    start reading the pages that are not in the pool, a later fetch wait for the read instead of issuing its own
+    with io_uring every read is in flight at the same time, without it the kernel is only hinted with posix_fadvise
+*/
+static void bptree_pager_prefetch(bptree_pager* pager, const bptree_page_id* ids, const int n) {
+#ifdef BPTREE_IO_URING
+    if (pager->ring) {
+        for (int i = 0; i < n; i++) {
+            if (ids[i] == BPTREE_INVALID_PAGE || bptree_pager_lookup(pager, ids[i]) >= 0) continue; // cached or already in flight
+            const int f = bptree_pager_victim(pager);
+            if (f < 0) break; // every frame is pinned or reading, the rest will be read on demand
+            bptree_frame* frame = &pager->frames[f];
+            frame->page_id = ids[i];
+            frame->pin_count = 0;
+            frame->dirty = false;
+            frame->referenced = true; // survive one turn of the clock before it's used
+            frame->io_pending = true;
+            bptree_pager_table_insert(pager, f);
+            bptree_uring_queue_read(pager, f, ids[i]);
+            pager->stats.async_reads++;
+        }
+        bptree_uring_submit(pager);
+        return;
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+        if (ids[i] == BPTREE_INVALID_PAGE || bptree_pager_lookup(pager, ids[i]) >= 0) continue;
+        posix_fadvise(pager->fd, (off_t)(ids[i] * pager->page_size), (off_t)pager->page_size, POSIX_FADV_WILLNEED);
+        pager->stats.async_reads++;
+    }
+}
+
+static void bptree_pager_destroy(bptree_pager* pager) {
+    if (!pager) return;
+#ifdef BPTREE_IO_URING
+    bptree_uring_destroy(pager); // wait for the reads in flight before their frames are freed
+#endif
+    if (pager->fd >= 0) close(pager->fd);
+    free(pager->pool_memory);
+    free(pager->frames);
+    free(pager->table);
+    free(pager);
+}
+
+static bptree_pager* bptree_pager_open(const char* path, const size_t page_size, const size_t pool_bytes, const int max_keys, const bool enable_debug) {
+    const int frame_count = (int)(pool_bytes / page_size);
+    if (frame_count < BPTREE_PAGER_MIN_FRAMES) {
+        bptree_debug_print(enable_debug, "Buffer pool of %zu bytes hold less than %d pages of %zu bytes\n", pool_bytes, BPTREE_PAGER_MIN_FRAMES, page_size);
+        return NULL;
+    }
+    bptree_pager* pager = calloc(1, sizeof(bptree_pager));
+    if (!pager) return NULL;
+    pager->fd = -1;
+    pager->page_size = page_size;
+    pager->frame_count = frame_count;
+    pager->enable_debug = enable_debug;
+    pager->stats.frame_count = frame_count;
+    pager->stats.page_size = page_size;
+
+    int table_size = 1;
+    while (table_size < 2 * frame_count) table_size <<= 1; // keep the load factor under 1/2 so probe chains stay short
+    pager->table_mask = table_size - 1;
+    pager->table = malloc((size_t)table_size * sizeof(int));
+    pager->frames = calloc((size_t)frame_count, sizeof(bptree_frame));
+    pager->pool_memory = aligned_alloc(BPTREE_PAGE_ALIGN, (size_t)frame_count * page_size);
+    if (!pager->table || !pager->frames || !pager->pool_memory) {
+        bptree_pager_destroy(pager);
+        return NULL;
+    }
+    memset(pager->table, -1, (size_t)table_size * sizeof(int)); // all bytes 0xff is -1
+    for (int f = 0; f < frame_count; f++) {
+        pager->frames[f].node = (bptree_node*)((char*)pager->pool_memory + (size_t)f * page_size);
+    }
+
+    pager->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (pager->fd < 0) {
+        bptree_debug_print(enable_debug, "Can't open page file %s\n", path);
+        bptree_pager_destroy(pager);
+        return NULL;
+    }
+#ifdef BPTREE_IO_URING
+    bptree_uring_setup(pager);
+#endif
+    const off_t file_size = lseek(pager->fd, 0, SEEK_END);
+    if (file_size == 0) { // new file: the caller create the root page
+        pager->header.magic = BPTREE_PAGER_MAGIC;
+        pager->header.page_size = page_size;
+        pager->header.page_count = 1; // the header page
+        pager->header.root_page = BPTREE_INVALID_PAGE;
+        pager->header.max_keys = max_keys;
+        return pager;
+    }
+    if (pread(pager->fd, &pager->header, sizeof(bptree_page_header), 0) != (ssize_t)sizeof(bptree_page_header)
+        || pager->header.magic != BPTREE_PAGER_MAGIC || pager->header.page_size != page_size || pager->header.max_keys != max_keys) {
+        bptree_debug_print(enable_debug, "Page file %s is not a tree with pages of %zu bytes and max_keys %d\n", path, page_size, max_keys);
+        bptree_pager_destroy(pager);
+        return NULL;
+    }
+    return pager;
+}
+
+// size of one page: the biggest node rounded up to a sector
+static size_t bptree_paged_page_size(const bptree* tree) {
+    const size_t leaf = bptree_node_alloc_size(tree, true);
+    const size_t internal = bptree_node_alloc_size(tree, false);
+    const size_t size = leaf > internal ? leaf : internal;
+    return (size + BPTREE_PAGE_ALIGN - 1) & ~(size_t)(BPTREE_PAGE_ALIGN - 1);
+}
+
+BPTREE_API bptree* bptree_paged_open(const char* path, const int max_keys,
+                                     int (*compare)(const bptree_key_t*, const bptree_key_t*),
+                                     const size_t pool_bytes, const bool enable_debug) {
+    if (!path || max_keys < 3) return NULL; // a split need at least 2 keys on each side
+    bptree* tree = calloc(1, sizeof(bptree));
+    if (!tree) return NULL;
+    tree->max_keys = max_keys;
+    tree->min_leaf_keys = (max_keys + 1) / 2;
+    tree->min_internal_keys = max_keys / 2;
+    tree->leaf_low = tree->min_leaf_keys;
+    tree->internal_low = tree->min_internal_keys;
+    tree->leaf_high = max_keys;
+    tree->internal_high = max_keys;
+    tree->compare = compare ? compare : bptree_default_compare;
+#ifdef BPTREE_KEY_TYPE_STRING
+    tree->bytewise_order = tree->compare == bptree_default_compare;
+#endif
+    tree->enable_debug = enable_debug;
+    tree->root = NULL; // the root is a page, see pager->header.root_page
+
+    bptree_pager* pager = bptree_pager_open(path, bptree_paged_page_size(tree), pool_bytes, max_keys, enable_debug);
+    if (!pager) {
+        free(tree);
+        return NULL;
+    }
+    tree->pager = pager;
+    if (pager->header.root_page == BPTREE_INVALID_PAGE) { // fresh file: an empty leaf is the root
+        bptree_node* root = bptree_pager_new_page(pager, true);
+        if (!root) {
+            bptree_pager_destroy(pager);
+            free(tree);
+            return NULL;
+        }
+        pager->header.root_page = root->page_id;
+        pager->header.height = 1;
+        bptree_pager_unpin(pager, root, true);
+    }
+    tree->count = (int)pager->header.count;
+    tree->height = pager->header.height;
+    bptree_debug_print(enable_debug, "Paged tree opened: %s, page size %zu, %d frames, %d keys\n", path, pager->page_size, pager->frame_count, tree->count);
+    return tree;
+}
+
+BPTREE_API bptree_status bptree_paged_flush(bptree* tree) {
+    if (!tree || !tree->pager) return BPTREE_INVALID_ARGUMENT;
+    bptree_pager* pager = tree->pager;
+    for (int f = 0; f < pager->used_frames; f++) {
+        bptree_frame* frame = &pager->frames[f];
+        if (frame->page_id == BPTREE_INVALID_PAGE || !frame->dirty) continue;
+        if (bptree_pager_write_page(pager, frame->page_id, frame->node) != BPTREE_OK) return BPTREE_INTERNAL_ERROR;
+        frame->dirty = false;
+    }
+    pager->header.count = tree->count;
+    pager->header.height = tree->height;
+    if (bptree_pager_write_header(pager) != BPTREE_OK) return BPTREE_INTERNAL_ERROR;
+    return fsync(pager->fd) == 0 ? BPTREE_OK : BPTREE_INTERNAL_ERROR;
+}
+
+BPTREE_API bptree_status bptree_paged_close(bptree* tree) {
+    if (!tree || !tree->pager) return BPTREE_INVALID_ARGUMENT;
+    const bptree_status status = bptree_paged_flush(tree);
+    bptree_pager_destroy(tree->pager);
+    free(tree);
+    return status;
+}
+
+BPTREE_API bptree_status bptree_paged_get(const bptree* tree, const bptree_key_t* key, bptree_value_t* out) {
+    if (!tree || !tree->pager || !key) return BPTREE_INVALID_ARGUMENT;
+    bptree_pager* pager = tree->pager;
+    bptree_page_id id = pager->header.root_page;
+    for (;;) {
+        bptree_node* node = bptree_pager_fetch(pager, id);
+        if (!node) return BPTREE_INTERNAL_ERROR;
+        if (node->is_leaf) {
+            const int idx = bptree_node_lower_bound(tree, node, key);
+            const bool found = idx < node->num_keys && tree->compare(&bptree_node_keys(node)[idx], key) == 0;
+            if (found && out) *out = bptree_node_values(node, tree->max_keys)[idx];
+            bptree_pager_unpin(pager, node, false);
+            return found ? BPTREE_OK : BPTREE_KEY_NOT_FOUND;
+        }
+        id = bptree_node_child_ids(node, tree->max_keys)[bptree_node_child_index(tree, node, key)];
+        bptree_pager_unpin(pager, node, false); // only one page of the path is pinned at a time
+    }
+}
+
+BPTREE_API bool bptree_paged_contains(const bptree* tree, const bptree_key_t* key) {
+    return bptree_paged_get(tree, key, NULL) == BPTREE_OK;
+}
+
+/*
+    descend to the leaf that cover key, record the pages and the child index choosed at each level
+    the leaf itself is not read (all leaves are at depth height - 1) so callers can read it ahead
+    high_key (optional) get the first separator on the right of the path above the leaf's parent: the smallest key after the leaves of that parent
+*/
+static bptree_status bptree_paged_find_path(const bptree* tree, const bptree_key_t* key, bptree_page_id* page_stack, int* index_stack, int* depth,
+                                            bptree_key_t* high_key, bool* has_high_key) {
+    bptree_pager* pager = tree->pager;
+    if (tree->height > BPTREE_MAX_HEIGHT) return BPTREE_INTERNAL_ERROR;
+    bptree_page_id id = pager->header.root_page;
+    if (has_high_key) *has_high_key = false;
+    int d = 0;
+    for (; d < tree->height - 1; d++) {
+        bptree_node* node = bptree_pager_fetch(pager, id);
+        if (!node) return BPTREE_INTERNAL_ERROR;
+        page_stack[d] = id;
+        index_stack[d] = bptree_node_child_index(tree, node, key);
+        if (has_high_key && d < tree->height - 2 && index_stack[d] < node->num_keys) { // deeper levels give a tighter bound
+            *high_key = bptree_node_keys(node)[index_stack[d]];
+            *has_high_key = true;
+        }
+        id = bptree_node_child_ids(node, tree->max_keys)[index_stack[d]];
+        bptree_pager_unpin(pager, node, false);
+    }
+    page_stack[d] = id;
+    *depth = d;
+    return BPTREE_OK;
+}
+
+/*
+    give back what a split reserved when it failed before changing anything, in reverse order: a page at the end of the file
+    shrink it again, one taken from the free list go back on it
+*/
+static void bptree_paged_split_abort(bptree_pager* pager, bptree_node** path, const int n_path, bptree_node** fresh, int n_fresh) {
+    for (int i = 0; i < n_path; i++) bptree_pager_unpin(pager, path[i], false);
+    while (n_fresh > 0) {
+        const bptree_page_id id = fresh[--n_fresh]->page_id;
+        if (id != pager->header.page_count - 1) {
+            bptree_pager_free_page(pager, fresh[n_fresh]);
+            continue;
+        }
+        bptree_frame* frame = &pager->frames[bptree_pager_lookup(pager, id)];
+        bptree_pager_table_remove(pager, id);
+        frame->page_id = BPTREE_INVALID_PAGE; // the victim search reuse the empty frame
+        frame->pin_count = 0;
+        frame->dirty = false;
+        pager->header.page_count--;
+    }
+}
+
+/*
+    a full leaf split up to the first ancestor with room, or up to a new root
+    every page of that path is pinned and every new page allocated before the leaf is changed,
+    so a pool with no free frame or an I/O error fail the put and leave the file as it was
+*/
+BPTREE_API bptree_status bptree_paged_put(bptree* tree, const bptree_key_t* key, const bptree_value_t value) {
+    if (!tree || !tree->pager || !key) return BPTREE_INVALID_ARGUMENT;
+    bptree_pager* pager = tree->pager;
+    const int max_keys = tree->max_keys;
+    bptree_page_id page_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    const bptree_status status = bptree_paged_find_path(tree, key, page_stack, index_stack, &depth, NULL, NULL);
+    if (status != BPTREE_OK) return status;
+
+    bptree_node* leaf = bptree_pager_fetch(pager, page_stack[depth]);
+    if (!leaf) return BPTREE_INTERNAL_ERROR;
+    bptree_key_t* keys = bptree_node_keys(leaf);
+    bptree_value_t* values = bptree_node_values(leaf, max_keys);
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx < leaf->num_keys && tree->compare(&keys[idx], key) == 0) {
+        bptree_pager_unpin(pager, leaf, false);
+        return BPTREE_DUPLICATE_KEY;
+    }
+
+    // path[0] is the leaf, path[i] its ancestor at level depth - i, the last one has room unless the root split too
+    bptree_node* path[BPTREE_MAX_HEIGHT];
+    bptree_node* fresh[BPTREE_MAX_HEIGHT + 1]; // fresh[i] the right half of path[i], then the new root
+    int n_path = 1;
+    int n_fresh = 0;
+    path[0] = leaf;
+    bool new_root = leaf->num_keys == max_keys;
+    for (int d = depth - 1; new_root && d >= 0; d--) {
+        bptree_node* parent = bptree_pager_fetch(pager, page_stack[d]);
+        if (!parent) {
+            bptree_paged_split_abort(pager, path, n_path, fresh, n_fresh);
+            return BPTREE_INTERNAL_ERROR;
+        }
+        path[n_path++] = parent;
+        new_root = parent->num_keys == max_keys;
+    }
+    if (new_root && tree->height >= BPTREE_MAX_HEIGHT) {
+        bptree_debug_print(tree->enable_debug, "Tree can't grow over BPTREE_MAX_HEIGHT (%d)\n", BPTREE_MAX_HEIGHT);
+        bptree_paged_split_abort(pager, path, n_path, fresh, n_fresh);
+        return BPTREE_ALLOCATION_FAILURE;
+    }
+    const int n_split = leaf->num_keys < max_keys ? 0 : (new_root ? n_path : n_path - 1);
+    for (; n_fresh < n_split + (new_root ? 1 : 0); n_fresh++) {
+        fresh[n_fresh] = bptree_pager_new_page(pager, n_fresh == 0);
+        if (!fresh[n_fresh]) {
+            bptree_paged_split_abort(pager, path, n_path, fresh, n_fresh);
+            return BPTREE_ALLOCATION_FAILURE;
+        }
+    }
+
+    // nothing can fail from here
+    memmove(&keys[idx + 1], &keys[idx], (size_t)(leaf->num_keys - idx) * sizeof(bptree_key_t));
+    memmove(&values[idx + 1], &values[idx], (size_t)(leaf->num_keys - idx) * sizeof(bptree_value_t));
+    keys[idx] = *key;
+    values[idx] = value;
+    leaf->num_keys++;
+    tree->count++;
+    if (n_split == 0) {
+        bptree_pager_unpin(pager, leaf, true);
+        return BPTREE_OK;
+    }
+
+    // leaf overflow: move the upper half to the new page linked after it
+    bptree_node* right = fresh[0];
+    const int left_keys = leaf->num_keys / 2;
+    const int right_keys = leaf->num_keys - left_keys;
+    memcpy(bptree_node_keys(right), &keys[left_keys], (size_t)right_keys * sizeof(bptree_key_t));
+    memcpy(bptree_node_values(right, max_keys), &values[left_keys], (size_t)right_keys * sizeof(bptree_value_t));
+    right->num_keys = right_keys;
+    leaf->num_keys = left_keys;
+    right->next_page = leaf->next_page;
+    leaf->next_page = right->page_id;
+    bptree_key_t separator = bptree_node_keys(right)[0];
+    bptree_debug_print(tree->enable_debug, "Split leaf page %llu\n", (unsigned long long)page_stack[depth]);
+
+    for (int i = 1; i < n_path; i++) {
+        bptree_node* parent = path[i];
+        bptree_key_t* parent_keys = bptree_node_keys(parent);
+        bptree_page_id* child_ids = bptree_node_child_ids(parent, max_keys);
+        const int pos = index_stack[depth - i]; // the split child, the new sibling go just after it
+        memmove(&parent_keys[pos + 1], &parent_keys[pos], (size_t)(parent->num_keys - pos) * sizeof(bptree_key_t));
+        memmove(&child_ids[pos + 2], &child_ids[pos + 1], (size_t)(parent->num_keys - pos) * sizeof(bptree_page_id));
+        parent_keys[pos] = separator;
+        child_ids[pos + 1] = fresh[i - 1]->page_id;
+        parent->num_keys++;
+        if (i == n_split) break; // the first ancestor with room
+
+        // the parent hold the temporary extra key: split it, keys[mid] move up
+        right = fresh[i];
+        const int mid = parent->num_keys / 2;
+        const int right_internal = parent->num_keys - mid - 1;
+        memcpy(bptree_node_keys(right), &parent_keys[mid + 1], (size_t)right_internal * sizeof(bptree_key_t));
+        memcpy(bptree_node_child_ids(right, max_keys), &child_ids[mid + 1], (size_t)(right_internal + 1) * sizeof(bptree_page_id));
+        right->num_keys = right_internal;
+        parent->num_keys = mid;
+        separator = parent_keys[mid];
+        bptree_debug_print(tree->enable_debug, "Split internal page %llu at level %d\n", (unsigned long long)page_stack[depth - i], depth - i);
+    }
+
+    if (new_root) { // the root was split: a new root with one separator and two childrens
+        bptree_node* root = fresh[n_split];
+        bptree_node_keys(root)[0] = separator;
+        bptree_node_child_ids(root, max_keys)[0] = page_stack[0];
+        bptree_node_child_ids(root, max_keys)[1] = fresh[n_split - 1]->page_id;
+        root->num_keys = 1;
+        pager->header.root_page = root->page_id;
+        tree->height++;
+        bptree_debug_print(tree->enable_debug, "Root page split, new height %d\n", tree->height);
+    }
+    for (int i = 0; i < n_path; i++) bptree_pager_unpin(pager, path[i], true);
+    for (int i = 0; i < n_fresh; i++) bptree_pager_unpin(pager, fresh[i], true);
+    return BPTREE_OK;
+}
+
+// a root with one child and no key give its place to that child, until the root has keys or is the leaf
+static void bptree_paged_collapse_root(bptree* tree) {
+    bptree_pager* pager = tree->pager;
+    while (tree->height > 1) {
+        bptree_node* root = bptree_pager_fetch(pager, pager->header.root_page);
+        if (!root) return; // a root with a single child still route every key
+        if (root->num_keys > 0) {
+            bptree_pager_unpin(pager, root, false);
+            return;
+        }
+        pager->header.root_page = bptree_node_child_ids(root, tree->max_keys)[0];
+        tree->height--;
+        bptree_pager_free_page(pager, root);
+        bptree_debug_print(tree->enable_debug, "Root page collapsed, new height %d\n", tree->height);
+    }
+}
+
+/*
+    take the pinned empty leaf at the end of a recorded path out of the tree and free its page
+        the ancestors that only had this leaf under them are freed too, the first one with a key lose the child and a separator
+        the leaf before it in the chain (rightmost leaf of the subtree left of the path) is linked to the one after it
+    every page is pinned before anything change, a failed read leave the empty leaf where it is, the tree stay valid
+*/
+static void bptree_paged_unlink_leaf(bptree* tree, const bptree_page_id* page_stack, const int* index_stack, const int depth, bptree_node* leaf) {
+    bptree_pager* pager = tree->pager;
+    const int max_keys = tree->max_keys;
+    bptree_node* path[BPTREE_MAX_HEIGHT]; // path[d] the ancestor at level d, from depth - 1 up to the first one with a key
+    int top = depth - 1;
+    for (;; top--) {
+        path[top] = bptree_pager_fetch(pager, page_stack[top]);
+        if (!path[top] || path[top]->num_keys > 0 || top == 0) break;
+    }
+    if (!path[top] || path[top]->num_keys == 0) { // a read failed, or the leaf is the only one of the tree
+        for (int d = path[top] ? top : top + 1; d < depth; d++) bptree_pager_unpin(pager, path[d], false);
+        bptree_pager_unpin(pager, leaf, true);
+        return;
+    }
+
+    bptree_node* prev = NULL; // the leaf whose next_page is this one, none for the first leaf
+    int level = top; // the ancestors under top have a single child, the deepest one with a child on the left is at most there
+    while (level >= 0 && index_stack[level] == 0) level--;
+    if (level >= 0) {
+        bptree_page_id id = page_stack[level];
+        for (int d = level; d < depth && id != BPTREE_INVALID_PAGE; d++) { // the child on the left, then rightmost ones down to the leaves
+            bptree_node* node = bptree_pager_fetch(pager, id);
+            id = node ? bptree_node_child_ids(node, max_keys)[d == level ? index_stack[d] - 1 : node->num_keys] : BPTREE_INVALID_PAGE;
+            if (node) bptree_pager_unpin(pager, node, false);
+        }
+        if (id != BPTREE_INVALID_PAGE) prev = bptree_pager_fetch(pager, id);
+        if (!prev) {
+            for (int d = top; d < depth; d++) bptree_pager_unpin(pager, path[d], false);
+            bptree_pager_unpin(pager, leaf, true);
+            return;
+        }
+    }
+
+    // nothing can fail from here
+    if (prev) {
+        prev->next_page = leaf->next_page;
+        bptree_pager_unpin(pager, prev, true);
+    }
+    bptree_node* parent = path[top];
+    bptree_key_t* parent_keys = bptree_node_keys(parent);
+    bptree_page_id* child_ids = bptree_node_child_ids(parent, max_keys);
+    const int pos = index_stack[top];
+    const int sep = pos > 0 ? pos - 1 : 0; // the separator on the left of the child, or on its right for the first child
+    memmove(&parent_keys[sep], &parent_keys[sep + 1], (size_t)(parent->num_keys - sep - 1) * sizeof(bptree_key_t));
+    memmove(&child_ids[pos], &child_ids[pos + 1], (size_t)(parent->num_keys - pos) * sizeof(bptree_page_id));
+    parent->num_keys--;
+    bptree_pager_unpin(pager, parent, true);
+    for (int d = top + 1; d < depth; d++) bptree_pager_free_page(pager, path[d]);
+    bptree_pager_free_page(pager, leaf);
+    bptree_debug_print(tree->enable_debug, "Freed empty leaf page %llu\n", (unsigned long long)page_stack[depth]);
+}
+
+BPTREE_API bptree_status bptree_paged_remove(bptree* tree, const bptree_key_t* key) {
+    if (!tree || !tree->pager || !key) return BPTREE_INVALID_ARGUMENT;
+    bptree_pager* pager = tree->pager;
+    bptree_page_id page_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    const bptree_status status = bptree_paged_find_path(tree, key, page_stack, index_stack, &depth, NULL, NULL);
+    if (status != BPTREE_OK) return status;
+
+    bptree_node* leaf = bptree_pager_fetch(pager, page_stack[depth]);
+    if (!leaf) return BPTREE_INTERNAL_ERROR;
+    bptree_key_t* keys = bptree_node_keys(leaf);
+    bptree_value_t* values = bptree_node_values(leaf, tree->max_keys);
+    const int idx = bptree_node_lower_bound(tree, leaf, key);
+    if (idx >= leaf->num_keys || tree->compare(&keys[idx], key) != 0) {
+        bptree_pager_unpin(pager, leaf, false);
+        return BPTREE_KEY_NOT_FOUND;
+    }
+    // separators stay valid bounds when a key leave a leaf, so no parent page is touched unless the leaf is emptied
+    memmove(&keys[idx], &keys[idx + 1], (size_t)(leaf->num_keys - idx - 1) * sizeof(bptree_key_t));
+    memmove(&values[idx], &values[idx + 1], (size_t)(leaf->num_keys - idx - 1) * sizeof(bptree_value_t));
+    leaf->num_keys--;
+    tree->count--;
+    if (leaf->num_keys == 0 && depth > 0) {
+        bptree_paged_unlink_leaf(tree, page_stack, index_stack, depth, leaf);
+    } else {
+        bptree_pager_unpin(pager, leaf, true);
+    }
+    bptree_paged_collapse_root(tree);
+    return BPTREE_OK;
+}
+
+/*
+    read ahead up to count leaves starting at the leaf that cover key
+    the page ids come from the parent of that leaf (internal pages are resident) so the reads don't wait on each other like following next_page would
+    *covered get the number of leaves requested, next_key the smallest key after them, return false when there is no leaf after them
+*/
+static bool bptree_paged_readahead(const bptree* tree, const bptree_key_t* key, const int count, bptree_key_t* next_key, int* covered) {
+    *covered = 0;
+    if (tree->height < 2) return false; // a root leaf has no siblings
+    bptree_page_id page_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    bool has_high_key;
+    bptree_key_t high_key;
+    if (bptree_paged_find_path(tree, key, page_stack, index_stack, &depth, &high_key, &has_high_key) != BPTREE_OK) return false;
+    bptree_node* parent = bptree_pager_fetch(tree->pager, page_stack[depth - 1]);
+    if (!parent) return false;
+    const int first = index_stack[depth - 1];
+    const int last = (first + count < parent->num_keys + 1) ? first + count : parent->num_keys + 1; // exclusive
+    bptree_pager_prefetch(tree->pager, &bptree_node_child_ids(parent, tree->max_keys)[first], last - first);
+    *covered = last - first;
+    bool more = has_high_key;
+    if (last <= parent->num_keys) { // the parent has more childrens, keys[last - 1] is the minimum of child[last]
+        *next_key = bptree_node_keys(parent)[last - 1];
+        more = true;
+    } else if (has_high_key) { // continue in the next parent
+        *next_key = high_key;
+    }
+    bptree_pager_unpin(tree->pager, parent, false);
+    return more;
+}
+
+BPTREE_API bptree_status bptree_paged_get_range(const bptree* tree, const bptree_key_t* start, const bptree_key_t* end, bptree_value_t** out_values, int* n_results) {
+    if (!tree || !tree->pager || !start || !end || !out_values || !n_results) return BPTREE_INVALID_ARGUMENT;
+    *out_values = NULL;
+    *n_results = 0;
+    if (tree->compare(start, end) > 0) return BPTREE_OK; // empty range
+    bptree_pager* pager = tree->pager;
+    int capacity = 16;
+    bptree_value_t* results = malloc((size_t)capacity * sizeof(bptree_value_t));
+    if (!results) return BPTREE_ALLOCATION_FAILURE;
+
+    bptree_page_id page_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    if (bptree_paged_find_path(tree, start, page_stack, index_stack, &depth, NULL, NULL) != BPTREE_OK) {
+        free(results);
+        return BPTREE_INTERNAL_ERROR;
+    }
+
+    bptree_key_t ahead_key = *start; // where the next read ahead window start
+    bool ahead_more = true;
+    int ahead_left = 0; // leaves requested ahead and not consumed yet
+    bptree_page_id id = page_stack[depth];
+    int n = 0;
+    bool done = false;
+    while (!done && id != BPTREE_INVALID_PAGE) {
+        if (ahead_more && ahead_left <= BPTREE_READAHEAD_LEAVES / 2 && tree->compare(&ahead_key, end) <= 0) { // keep a window in flight
+            int covered;
+            ahead_more = bptree_paged_readahead(tree, &ahead_key, BPTREE_READAHEAD_LEAVES, &ahead_key, &covered);
+            ahead_left += covered;
+        }
+        bptree_node* leaf = bptree_pager_fetch(pager, id);
+        if (!leaf) {
+            free(results);
+            return BPTREE_INTERNAL_ERROR;
+        }
+        if (ahead_left > 0) ahead_left--;
+        const bptree_key_t* keys = bptree_node_keys(leaf);
+        const bptree_value_t* values = bptree_node_values(leaf, tree->max_keys);
+        for (int i = bptree_node_lower_bound(tree, leaf, start); i < leaf->num_keys; i++) {
+            if (tree->compare(&keys[i], end) > 0) {
+                done = true;
+                break;
+            }
+            if (n == capacity) {
+                capacity *= 2;
+                bptree_value_t* grown = realloc(results, (size_t)capacity * sizeof(bptree_value_t));
+                if (!grown) {
+                    bptree_pager_unpin(pager, leaf, false);
+                    free(results);
+                    return BPTREE_ALLOCATION_FAILURE;
+                }
+                results = grown;
+            }
+            results[n++] = values[i];
+        }
+        id = leaf->next_page;
+        bptree_pager_unpin(pager, leaf, false);
+    }
+    *out_values = results;
+    *n_results = n;
+    return BPTREE_OK;
+}
+
+/*
+    batched lookup in chunks of half the pool
+        first resolve the leaf page of every key of the chunk (internal levels only)
+        then read ahead all those leaves at once and search them when they arrive
+*/
+BPTREE_API bptree_status bptree_paged_get_batch(const bptree* tree, const bptree_key_t* keys, const int n, bptree_value_t* out_values, bptree_status* out_status) {
+    if (!tree || !tree->pager || (n > 0 && (!keys || !out_values || !out_status)) || n < 0) return BPTREE_INVALID_ARGUMENT;
+    bptree_pager* pager = tree->pager;
+    const int chunk = pager->frame_count / 2; // prefetched leaves must not evict each other before they are searched
+    bptree_page_id* leaf_ids = malloc((size_t)chunk * sizeof(bptree_page_id));
+    if (!leaf_ids) return BPTREE_ALLOCATION_FAILURE;
+    bptree_page_id page_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    for (int base = 0; base < n; base += chunk) {
+        const int m = (n - base < chunk) ? n - base : chunk;
+        for (int i = 0; i < m; i++) {
+            if (bptree_paged_find_path(tree, &keys[base + i], page_stack, index_stack, &depth, NULL, NULL) != BPTREE_OK) {
+                free(leaf_ids);
+                return BPTREE_INTERNAL_ERROR;
+            }
+            leaf_ids[i] = page_stack[depth];
+        }
+        bptree_pager_prefetch(pager, leaf_ids, m);
+        for (int i = 0; i < m; i++) {
+            bptree_node* leaf = bptree_pager_fetch(pager, leaf_ids[i]);
+            if (!leaf) {
+                free(leaf_ids);
+                return BPTREE_INTERNAL_ERROR;
+            }
+            const int idx = bptree_node_lower_bound(tree, leaf, &keys[base + i]);
+            if (idx < leaf->num_keys && tree->compare(&bptree_node_keys(leaf)[idx], &keys[base + i]) == 0) {
+                out_values[base + i] = bptree_node_values(leaf, tree->max_keys)[idx];
+                out_status[base + i] = BPTREE_OK;
+            } else {
+                out_status[base + i] = BPTREE_KEY_NOT_FOUND;
+            }
+            bptree_pager_unpin(pager, leaf, false);
+        }
+    }
+    free(leaf_ids);
+    return BPTREE_OK;
+}
+
+BPTREE_API bptree_pager_stats bptree_paged_get_io_stats(const bptree* tree) {
+    bptree_pager_stats stats = {0};
+    if (tree && tree->pager) {
+        stats = tree->pager->stats;
+        stats.page_count = tree->pager->header.page_count;
+        stats.free_pages = tree->pager->header.free_count;
+    }
+    return stats;
+}
+#endif
+
+
+#endif // BPTREE_IMPLEMENTATION
+
+#ifdef __cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif // BPTREE_H
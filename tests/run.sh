@@ -0,0 +1,43 @@
+#!/bin/sh
+# build tests/test_bptree.c once per mode with the sanitizers and run it, exit non zero on the first failure
+# usage: tests/run.sh [ops] [seeds], CC and CFLAGS can be overridden
+set -e
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-std=c11 -O1 -g -Wall -Wextra -Werror -fsanitize=address,undefined -fno-sanitize-recover=all -fno-omit-frame-pointer"}
+OPS=${1:-100000}
+SEEDS=${2:-3}
+OUT=${TMPDIR:-/tmp}/bptree_tests
+mkdir -p "$OUT"
+
+run_mode() {
+    name=$1
+    shift
+    $CC $CFLAGS -Iinclude "$@" tests/test_bptree.c -o "$OUT/$name"
+    seed=1
+    while [ "$seed" -le "$SEEDS" ]; do
+        (cd "$OUT" && "./$name" "$OPS" "$seed" > /dev/null) || { echo "FAIL $name (seed $seed)"; exit 1; }
+        seed=$((seed + 1))
+    done
+    echo "ok   $name"
+}
+
+run_mode default
+run_mode keys_only -DBPTREE_KEYS_ONLY
+run_mode multimap -DBPTREE_MULTIMAP
+run_mode varlen -DBPTREE_KEY_TYPE_VARLEN
+run_mode string -DBPTREE_KEY_TYPE_STRING
+run_mode prefix -DBPTREE_KEY_TYPE_STRING -DBPTREE_PREFIX_COMPRESSION
+run_mode compressed -DBPTREE_COMPRESSED_LEAVES
+run_mode lazy -DBPTREE_LAZY_REBALANCE
+run_mode compressed_lazy -DBPTREE_COMPRESSED_LEAVES -DBPTREE_LAZY_REBALANCE
+run_mode varlen_lazy -DBPTREE_KEY_TYPE_VARLEN -DBPTREE_LAZY_REBALANCE
+run_mode message_buffers -DBPTREE_MESSAGE_BUFFERS
+run_mode message_buffers_keys_only -DBPTREE_MESSAGE_BUFFERS -DBPTREE_KEYS_ONLY
+run_mode memtable -DBPTREE_MEMTABLE
+run_mode memtable_keys_only -DBPTREE_MEMTABLE -DBPTREE_KEYS_ONLY
+run_mode static -DBPTREE_STATIC
+run_mode paged -DBPTREE_PAGED
+if [ "$(uname)" = Linux ]; then
+    run_mode paged_io_uring -DBPTREE_PAGED -DBPTREE_IO_URING
+fi
@@ -0,0 +1,978 @@
+/*
+    randomized test of the public api against a reference map
+    build it once per mode with the mode macros on the command line, tests/run.sh does every mode with the sanitizers:
+        cc -std=c11 -fsanitize=address,undefined -Iinclude tests/test_bptree.c -o test_bptree [-DBPTREE_...]
+        ./test_bptree [ops] [seed]
+    keys are 0 .. TEST_KEYS - 1 mapped to each key type in the same order, the reference keep what the tree should hold
+*/
+
+#define BPTREE_IMPLEMENTATION
+#define BPTREE_VALUE_TYPE int64_t
+#ifdef BPTREE_KEY_TYPE_STRING
+#define BPTREE_KEY_SIZE 16
+#endif
+#include "bptree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_KEYS 3000
+#define TEST_MAX_VALUES 4 // values of a key in BPTREE_MULTIMAP
+
+#define CHECK(cond)                                                                       \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s (op %d)\n", __FILE__, __LINE__, #cond, op); \
+            exit(1);                                                                      \
+        }                                                                                 \
+    } while (0)
+
+static int op; // operation being checked, printed on failure
+
+// the reference: values of each present key, one unless BPTREE_MULTIMAP
+static int ref_count[TEST_KEYS];
+#ifndef BPTREE_KEYS_ONLY
+static int64_t ref_values[TEST_KEYS][TEST_MAX_VALUES];
+#endif
+static int ref_keys;
+
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13; // xorshift64
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+// a key slot and the bytes a varlen key point to, the tree copy what it keep so the bytes only live for the call
+typedef struct {
+    bptree_key_t key;
+    char bytes[32];
+} test_key;
+
+// key number i, the keys of every type sort like the numbers
+static void make_key(test_key* k, const int i) {
+#if defined(BPTREE_KEY_TYPE_STRING)
+    memset(&k->key, 0, sizeof(k->key));
+    snprintf(k->key.data, sizeof(k->key.data), "key:%08d", i); // a long shared prefix for BPTREE_PREFIX_COMPRESSION
+#elif defined(BPTREE_KEY_TYPE_VARLEN)
+    const int len = snprintf(k->bytes, sizeof(k->bytes), i % 3 ? "k%07d" : "k%07d-stored-apart", i); // inline and out of line keys
+    k->key = bptree_key_make(k->bytes, (uint32_t)len);
+#else
+    k->key = (bptree_key_t)i * 7; // gaps so the compressed leaves get deltas over 1
+#endif
+}
+
+#if !defined(BPTREE_KEYS_ONLY) && !defined(BPTREE_MULTIMAP)
+static int64_t make_value(const int i) {
+    return (int64_t)i * 1000 + (int64_t)(rng() % 1000);
+}
+#endif
+
+#ifdef BPTREE_MULTIMAP
+static void ref_remove_value(const int i, const int v) {
+    for (int j = v + 1; j < ref_count[i]; j++) ref_values[i][j - 1] = ref_values[i][j];
+    if (--ref_count[i] == 0) ref_keys--;
+}
+#endif
+
+#ifndef BPTREE_PAGED
+#if !defined(BPTREE_KEYS_ONLY) && !defined(BPTREE_MULTIMAP)
+static bool add_one(bptree_value_t* value, const bool exists, void* ctx) {
+    (void)ctx;
+    if (exists) (*value)++;
+    return exists; // don't create absent keys
+}
+#endif
+
+// every key is checked with a lookup and the whole tree with one range
+static void check_all(bptree* tree) {
+    CHECK(bptree_check_invariants(tree));
+#ifndef BPTREE_MESSAGE_BUFFERS // pending messages are only counted once flushed
+    CHECK(tree->count == ref_keys);
+#endif
+    test_key k;
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        CHECK(bptree_contains(tree, &k.key) == (ref_count[i] > 0));
+#ifndef BPTREE_KEYS_ONLY
+        bptree_value_t v;
+        const bptree_status status = bptree_get(tree, &k.key, &v);
+        CHECK(status == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+        if (ref_count[i]) CHECK(v == ref_values[i][0]);
+#endif
+    }
+#ifndef BPTREE_KEYS_ONLY
+    test_key start, end;
+    make_key(&start, 0);
+    make_key(&end, TEST_KEYS - 1);
+    bptree_value_t* values;
+    int n;
+    CHECK(bptree_get_range(tree, &start.key, &end.key, &values, &n) == BPTREE_OK);
+    int at = 0;
+    for (int i = 0; i < TEST_KEYS; i++) {
+        for (int j = 0; j < ref_count[i]; j++, at++) CHECK(at < n && values[at] == ref_values[i][j]);
+    }
+    CHECK(at == n);
+    bptree_free_range_results(values);
+#endif
+}
+
+// keys held by the leaves and separators held by the internal nodes under node
+static size_t used_slots(const bptree* tree, bptree_node* node) {
+    size_t n = (size_t)node->num_keys;
+    if (node->is_leaf) return n;
+    bptree_node** children = bptree_node_children(node, tree->max_keys);
+    for (int i = 0; i <= node->num_keys; i++) n += used_slots(tree, children[i]);
+    return n;
+}
+
+// the maintenance calls must leave the content unchanged
+static void maintain(bptree* tree) {
+    switch (rng() % 6) {
+    case 0:
+#ifdef BPTREE_MESSAGE_BUFFERS
+        CHECK(bptree_flush_messages(tree) == BPTREE_OK);
+        CHECK(tree->count == ref_keys);
+#endif
+#ifdef BPTREE_MEMTABLE
+        CHECK(bptree_merge_memtable(tree) == BPTREE_OK);
+        CHECK(tree->count == ref_keys);
+#endif
+        break;
+    case 1:
+#ifdef BPTREE_COMPRESSED_LEAVES
+        CHECK(bptree_compress_leaves(tree) == BPTREE_OK);
+#endif
+#ifdef BPTREE_LAZY_REBALANCE
+        bptree_compact(tree, (int)(rng() % 8));
+#endif
+        break;
+    case 2:
+#ifndef BPTREE_MESSAGE_BUFFERS
+        bptree_defragment(tree, 1 + (int)(rng() % 64), (int)(rng() % 2) * 80);
+#endif
+        break;
+    case 3:
+        bptree_shrink(tree);
+        break;
+    case 4: {
+        const int samples = 1 + (int)(rng() % 64);
+        const bptree_stats_ex stats = bptree_get_stats_ex(tree, samples);
+        CHECK(stats.bytes == bptree_memory_usage(tree) && stats.leaf_nodes == (size_t)bptree_get_stats(tree).leaf_count);
+        CHECK(stats.sampled_leaves == (stats.leaf_nodes <= (size_t)samples ? (int)stats.leaf_nodes : samples));
+        CHECK(stats.sample_min <= stats.fill_p10 && stats.fill_p10 <= stats.fill_p50);
+        CHECK(stats.fill_p50 <= stats.fill_p90 && stats.fill_p90 <= 1.0);
+        CHECK(stats.used_key_slots == used_slots(tree, tree->root));
+        break;
+    }
+    default: {
+#if !defined(BPTREE_MULTIMAP)
+        bptree_frozen* frozen = bptree_freeze(tree);
+        CHECK(frozen && frozen->count == ref_keys);
+        test_key k;
+        for (int i = 0; i < TEST_KEYS; i += 1 + (int)(rng() % 16)) {
+            make_key(&k, i);
+            CHECK(bptree_frozen_contains(frozen, &k.key) == (ref_count[i] > 0));
+#ifndef BPTREE_KEYS_ONLY
+            bptree_value_t v;
+            if (ref_count[i]) CHECK(bptree_frozen_get(frozen, &k.key, &v) == BPTREE_OK && v == ref_values[i][0]);
+#endif
+        }
+        const int first = (int)(rng() % TEST_KEYS);
+        const int last = first + 200 < TEST_KEYS ? first + 200 : TEST_KEYS - 1;
+        test_key end;
+        make_key(&k, first);
+        make_key(&end, last);
+        const bptree_key_t* keys;
+        const bptree_value_t* values;
+        int n;
+        CHECK(bptree_frozen_range(frozen, &k.key, &end.key, &keys, &values, &n) == BPTREE_OK);
+        int at = 0;
+        for (int i = first; i <= last; i++) {
+            if (!ref_count[i]) continue;
+            CHECK(at < n);
+#ifndef BPTREE_KEYS_ONLY
+            CHECK(values[at] == ref_values[i][0]);
+#endif
+            at++;
+        }
+        CHECK(at == n);
+        bptree_frozen_free(frozen);
+#endif
+        break;
+    }
+    }
+}
+
+#if !defined(BPTREE_MULTIMAP)
+// frozen copies of every size around the block and leaf boundaries, the odd keys are missing
+static void test_freeze_sizes(void) {
+    for (int count = 0; count < 700; count += 1 + count / 8) {
+        bptree* tree = bptree_create(5, NULL, false);
+        CHECK(tree);
+        test_key k;
+        for (int i = 0; i < count; i++) {
+            make_key(&k, 2 * i);
+#ifdef BPTREE_KEYS_ONLY
+            CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+            CHECK(bptree_put(tree, &k.key, i) == BPTREE_OK);
+#endif
+        }
+        bptree_frozen* frozen = bptree_freeze(tree);
+        bptree_free(tree); // the copy outlive the tree
+        CHECK(frozen && frozen->count == count);
+        for (int i = 0; i < 2 * count + 2; i++) {
+            make_key(&k, i);
+            CHECK(bptree_frozen_contains(frozen, &k.key) == (i % 2 == 0 && i < 2 * count));
+#ifndef BPTREE_KEYS_ONLY
+            bptree_value_t v;
+            const bptree_status status = bptree_frozen_get(frozen, &k.key, &v);
+            CHECK(status == (i % 2 == 0 && i < 2 * count ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+            if (status == BPTREE_OK) CHECK(v == i / 2);
+#endif
+        }
+        bptree_frozen_free(frozen);
+    }
+}
+#endif
+
+// put keys 0 .. count - 1 in the given order, step 1 is ascending and -1 descending
+static bptree* put_sequence(const int max_keys, const int count, const int step) {
+    bptree* tree = bptree_create(max_keys, NULL, false);
+    CHECK(tree);
+    test_key k;
+    for (int n = 0; n < count; n++) {
+        make_key(&k, step > 0 ? n : count - 1 - n);
+#if defined(BPTREE_KEYS_ONLY)
+        CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+        CHECK(bptree_put(tree, &k.key, n) == BPTREE_OK);
+#endif
+    }
+    CHECK(bptree_check_invariants(tree));
+    return tree;
+}
+
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+// leaves from the first, the last one is allowed to be short
+static int count_short_leaves(const bptree* tree) {
+    int short_leaves = 0;
+    for (const bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf->next; leaf = leaf->next) {
+        if (leaf->num_keys < tree->max_keys) short_leaves++;
+    }
+    return short_leaves;
+}
+#endif
+
+// ascending keys go to the rightmost leaf without a descent and fill every leaf
+static void test_append(void) {
+    bptree* tree = put_sequence(16, TEST_KEYS, 1);
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE) // their puts don't reach the leaves one by one
+    CHECK(count_short_leaves(tree) == 0);
+#endif
+    test_key k;
+    for (int i = TEST_KEYS - 1; i >= TEST_KEYS / 2; i--) { // the rightmost leaf move back through the merges
+        make_key(&k, i);
+        CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+    }
+    for (int i = TEST_KEYS / 2; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+#if defined(BPTREE_KEYS_ONLY)
+        CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+        CHECK(bptree_put(tree, &k.key, i) == BPTREE_OK);
+#endif
+    }
+    CHECK(bptree_check_invariants(tree));
+    bptree_free(tree);
+}
+
+// a run of ascending or descending keys split next to the new key instead of at the median
+static void test_split_point(void) {
+    for (int step = -1; step <= 1; step += 2) {
+        bptree* tree = put_sequence(32, TEST_KEYS, step);
+#ifdef BPTREE_MESSAGE_BUFFERS
+        CHECK(bptree_flush_messages(tree) == BPTREE_OK);
+#endif
+        const bptree_stats stats = bptree_get_stats(tree);
+        CHECK(stats.count == TEST_KEYS && stats.height == tree->height);
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE) // their puts don't reach the leaves one by one
+        CHECK(stats.leaf_fill > 0.95);
+#endif
+        bptree_free(tree);
+    }
+}
+
+// random puts spread a full leaf into a sibling before splitting, so the leaves end up well over half full
+static void test_spread(void) {
+    static int order[TEST_KEYS];
+    for (int i = 0; i < TEST_KEYS; i++) order[i] = i;
+    for (int i = TEST_KEYS - 1; i > 0; i--) { // shuffle
+        const int j = (int)(rng() % (uint32_t)(i + 1));
+        const int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    bptree* tree = bptree_create(32, NULL, false);
+    CHECK(tree);
+    test_key k;
+    for (int n = 0; n < TEST_KEYS; n++) {
+        make_key(&k, order[n]);
+#if defined(BPTREE_KEYS_ONLY)
+        CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+        CHECK(bptree_put(tree, &k.key, n) == BPTREE_OK);
+#endif
+    }
+    CHECK(bptree_check_invariants(tree));
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+    CHECK(bptree_get_stats(tree).leaf_fill > 0.8); // about 0.7 with plain splits
+#endif
+    bptree_free(tree);
+}
+
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+// leaves taken under their minimum but not under the low watermark are left alone, the defaults rebalance them
+// low 0 is free at empty: only the leaves emptied at the end are merged away
+static void test_watermarks(void) {
+    for (int low = -1; low <= 25; low += low < 0 ? 1 : 25) {
+        bptree* tree = bptree_create(16, NULL, false);
+        CHECK(tree);
+        CHECK(bptree_set_watermarks(tree, 60, 100) == BPTREE_INVALID_ARGUMENT);
+        CHECK(bptree_set_watermarks(tree, 25, 40) == BPTREE_INVALID_ARGUMENT);
+        if (low >= 0) CHECK(bptree_set_watermarks(tree, low, 90) == BPTREE_OK);
+        test_key k;
+        for (int i = 0; i < 1600; i++) {
+            make_key(&k, i);
+#if defined(BPTREE_KEYS_ONLY)
+            CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+            CHECK(bptree_put(tree, &k.key, i) == BPTREE_OK);
+#endif
+        }
+        CHECK(bptree_set_watermarks(tree, 25, 90) == BPTREE_INVALID_ARGUMENT); // not on a tree with keys
+        for (int i = 0; i < 1600; i++) { // full leaves of 16 go down to about 6 keys
+            make_key(&k, i);
+            if (i % 5 < 3) CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+        }
+        CHECK(bptree_check_invariants(tree));
+#ifdef BPTREE_LAZY_REBALANCE // every rebalance wait for bptree_compact
+        while (!bptree_compact(tree, 8)) {
+        }
+        CHECK(bptree_check_invariants(tree));
+#else
+        const bptree_stats stats = bptree_get_stats(tree);
+        CHECK(low >= 0 ? stats.rebalances_deferred > 0 : stats.rebalances_deferred == 0);
+#endif
+        for (int i = 800; i < 1600; i++) { // empty the upper half
+            make_key(&k, i);
+            if (i % 5 >= 3) CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+        }
+#ifdef BPTREE_LAZY_REBALANCE
+        while (!bptree_compact(tree, 8)) {
+        }
+#endif
+        CHECK(bptree_check_invariants(tree) && bptree_get_stats(tree).leaf_count <= 50); // the 50 emptied leaves are gone
+        bptree_free(tree);
+    }
+}
+#endif
+
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+// a full pass leave the leaves one after the other in memory, only the chunk ends break the runs
+static void test_defragment(void) {
+    bptree* tree = bptree_create(16, NULL, false);
+    CHECK(tree);
+    test_key k;
+    for (int n = 0; n < TEST_KEYS; n++) { // scattered splits
+        make_key(&k, n * 7 % TEST_KEYS);
+#if defined(BPTREE_KEYS_ONLY)
+        CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+        CHECK(bptree_put(tree, &k.key, n * 7 % TEST_KEYS) == BPTREE_OK);
+#endif
+    }
+    for (int i = 0; i < TEST_KEYS; i += 3) {
+        make_key(&k, i);
+        CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+    }
+    const double fill = bptree_get_stats(tree).leaf_fill;
+    int calls = 0;
+    while (!bptree_defragment(tree, 7, 80)) calls++;
+    CHECK(calls > 0 && bptree_check_invariants(tree));
+    const size_t stride = bptree_chunk_stride(tree);
+    int leaves = 1, adjacent = 0;
+    for (const bptree_node* leaf = bptree_edge_leaf(tree->root, tree->max_keys, false); leaf->next; leaf = leaf->next) {
+        leaves++;
+        if ((const char*)leaf->next == (const char*)leaf + stride) adjacent++;
+    }
+    CHECK(adjacent >= leaves - 1 - leaves / BPTREE_DEFRAG_CHUNK);
+    CHECK(bptree_get_stats(tree).leaf_fill > fill); // the refill at 80
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        CHECK(bptree_contains(tree, &k.key) == (i % 3 != 0));
+    }
+    bptree_free(tree);
+}
+
+// the merges after a mass remove leave the chunks sparse, the shrink copy their leaves out and free them
+static void test_shrink(void) {
+    bptree* tree = put_sequence(16, TEST_KEYS, 1);
+    while (!bptree_defragment(tree, 64, 0)) {
+    }
+    test_key k;
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        if (i % 5 < 3) CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+    }
+#ifdef BPTREE_LAZY_REBALANCE
+    while (!bptree_compact(tree, 8)) {
+    }
+#endif
+    CHECK(bptree_shrink(tree) > 0 && bptree_check_invariants(tree));
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        CHECK(bptree_contains(tree, &k.key) == (i % 5 >= 3));
+    }
+    bptree_free(tree);
+}
+
+// a tree never defragmented get its leaves refilled, the emptied ones freed
+static void test_shrink_malloced(void) {
+    bptree* tree = put_sequence(16, TEST_KEYS, 1);
+    test_key k;
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        if (i % 5 < 3) CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+    }
+#ifdef BPTREE_LAZY_REBALANCE
+    while (!bptree_compact(tree, 8)) {
+    }
+#endif
+    const size_t used = bptree_memory_usage(tree);
+    const size_t reclaimed = bptree_shrink(tree);
+    CHECK(bptree_check_invariants(tree) && bptree_memory_usage(tree) < used && reclaimed >= used - bptree_memory_usage(tree));
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        CHECK(bptree_contains(tree, &k.key) == (i % 5 >= 3));
+    }
+    bptree_free(tree);
+}
+
+// a put over the cap fail before it split anything, lifting the cap let it through
+static void test_memory_limit(void) {
+    bptree* tree = put_sequence(16, TEST_KEYS / 2, 1);
+    const size_t used = bptree_memory_usage(tree);
+    CHECK(used > 0 && bptree_set_memory_limit(tree, used) == BPTREE_OK);
+    test_key k;
+    int i = TEST_KEYS / 2;
+    bptree_status status = BPTREE_OK;
+    for (; i < TEST_KEYS && status == BPTREE_OK; i++) {
+        make_key(&k, i);
+#if defined(BPTREE_KEYS_ONLY)
+        status = bptree_put(tree, &k.key);
+#else
+        status = bptree_put(tree, &k.key, i);
+#endif
+    }
+    CHECK(status == BPTREE_ALLOCATION_FAILURE && bptree_memory_usage(tree) <= used);
+    CHECK(!bptree_contains(tree, &k.key) && tree->count == i - 1 && bptree_check_invariants(tree));
+    CHECK(bptree_set_memory_limit(tree, 0) == BPTREE_OK);
+#if defined(BPTREE_KEYS_ONLY)
+    CHECK(bptree_put(tree, &k.key) == BPTREE_OK);
+#else
+    CHECK(bptree_put(tree, &k.key, i) == BPTREE_OK);
+#endif
+    CHECK(bptree_memory_usage(tree) > used);
+    for (int j = 0; j < i; j++) { // the count follow the frees down
+        make_key(&k, j);
+        CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+    }
+#ifdef BPTREE_LAZY_REBALANCE
+    while (!bptree_compact(tree, 8)) {
+    }
+#endif
+    CHECK(bptree_memory_usage(tree) < used / 8 && bptree_check_invariants(tree));
+    bptree_free(tree);
+#ifdef BPTREE_COMPRESSED_LEAVES
+    tree = put_sequence(16, TEST_KEYS, 1); // removes at the cap unpack leaves over it and still go through
+    CHECK(bptree_compress_leaves(tree) == BPTREE_OK);
+    CHECK(bptree_set_memory_limit(tree, bptree_memory_usage(tree)) == BPTREE_OK);
+    for (int j = 0; j < TEST_KEYS; j++) {
+        make_key(&k, j);
+        CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+    }
+    CHECK(tree->count == 0 && bptree_check_invariants(tree));
+    bptree_free(tree);
+#endif
+}
+#endif
+
+static void run(const int max_keys, const int ops) {
+    bptree* tree = bptree_create(max_keys, NULL, false);
+    CHECK(tree);
+    if (max_keys == 16) CHECK(bptree_set_watermarks(tree, 25, 90) == BPTREE_OK); // the hysteresis on one of the fanouts
+    if (max_keys == 4) CHECK(bptree_set_watermarks(tree, 0, 100) == BPTREE_OK); // free at empty on another
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+    bptree_finger finger;
+    bptree_finger_init(&finger, tree);
+#endif
+    test_key k;
+    for (op = 0; op < ops; op++) {
+        const int i = rng() % 100 < 80 ? (int)(rng() % TEST_KEYS) : (int)(rng() % 64) * (TEST_KEYS / 64); // some hot keys
+        make_key(&k, i);
+        const uint32_t kind = rng() % 100;
+        if (kind < 45) { // put
+#if defined(BPTREE_KEYS_ONLY)
+            const bptree_status status = bptree_put(tree, &k.key);
+#ifdef BPTREE_MESSAGE_BUFFERS
+            CHECK(status == BPTREE_OK); // a put message is not checked against the leaves
+#else
+            CHECK(status == (ref_count[i] ? BPTREE_DUPLICATE_KEY : BPTREE_OK));
+#endif
+            if (!ref_count[i]) {
+                ref_count[i] = 1;
+                ref_keys++;
+            }
+#elif defined(BPTREE_MULTIMAP)
+            const int64_t v = (int64_t)i * 10 + (int64_t)(rng() % TEST_MAX_VALUES);
+            int at = 0;
+            while (at < ref_count[i] && ref_values[i][at] != v) at++;
+            if (at == ref_count[i] && ref_count[i] == TEST_MAX_VALUES) continue;
+            CHECK(bptree_put(tree, &k.key, v) == (at < ref_count[i] ? BPTREE_DUPLICATE_KEY : BPTREE_OK));
+            if (at == ref_count[i]) {
+                if (ref_count[i]++ == 0) ref_keys++;
+                ref_values[i][at] = v;
+            }
+#else
+            const int64_t v = make_value(i);
+            bptree_status status;
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+            status = rng() % 4 ? bptree_put(tree, &k.key, v) : bptree_finger_put(&finger, &k.key, v);
+            CHECK(status == (ref_count[i] ? BPTREE_DUPLICATE_KEY : BPTREE_OK));
+            if (ref_count[i]) continue;
+#elif defined(BPTREE_MEMTABLE)
+            status = bptree_put(tree, &k.key, v);
+            CHECK(status == (ref_count[i] ? BPTREE_DUPLICATE_KEY : BPTREE_OK));
+            if (ref_count[i]) continue;
+#else
+            status = bptree_put(tree, &k.key, v);
+            CHECK(status == BPTREE_OK); // buffered puts overwrite
+#endif
+            if (!ref_count[i]) ref_keys++;
+            ref_count[i] = 1;
+            ref_values[i][0] = v;
+#endif
+        } else if (kind < 75) { // remove
+            const bptree_status status = bptree_remove(tree, &k.key);
+#ifdef BPTREE_MESSAGE_BUFFERS
+            CHECK(status == BPTREE_OK || (!ref_count[i] && status == BPTREE_KEY_NOT_FOUND)); // a remove message is not checked
+#else
+            CHECK(status == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+#endif
+            if (ref_count[i]) ref_keys--;
+            ref_count[i] = 0;
+        } else if (kind < 85) { // lookup
+#ifndef BPTREE_KEYS_ONLY
+            bptree_value_t v;
+            bptree_status status = bptree_get(tree, &k.key, &v);
+            CHECK(status == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+            if (ref_count[i]) CHECK(v == ref_values[i][0]);
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+            status = bptree_finger_get(&finger, &k.key, &v);
+            CHECK(status == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+            if (ref_count[i]) CHECK(v == ref_values[i][0]);
+#endif
+#endif
+            CHECK(bptree_contains(tree, &k.key) == (ref_count[i] > 0));
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE)
+            CHECK(bptree_finger_contains(&finger, &k.key) == (ref_count[i] > 0));
+#endif
+        } else if (kind < 93) { // single value updates, or the values of one key
+#if defined(BPTREE_MULTIMAP)
+            const bptree_value_t* values;
+            int n;
+            const bptree_status status = bptree_get_values(tree, &k.key, &values, &n);
+            CHECK(status == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+            if (ref_count[i]) {
+                CHECK(n == ref_count[i]);
+                for (int j = 0; j < n; j++) CHECK(values[j] == ref_values[i][j]);
+                const int drop = (int)(rng() % (uint32_t)n);
+                CHECK(bptree_remove_value(tree, &k.key, ref_values[i][drop]) == BPTREE_OK);
+                ref_remove_value(i, drop);
+            }
+#elif !defined(BPTREE_KEYS_ONLY)
+            bptree_value_t old = -1;
+            const int64_t v = make_value(i);
+            switch (rng() % 3) {
+            case 0:
+                CHECK(bptree_upsert(tree, &k.key, add_one, NULL) == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+                if (ref_count[i]) ref_values[i][0]++;
+                break;
+            case 1:
+                CHECK(bptree_put_if_absent(tree, &k.key, v, &old) == (ref_count[i] ? BPTREE_DUPLICATE_KEY : BPTREE_OK));
+                if (ref_count[i]) {
+                    CHECK(old == ref_values[i][0]);
+                } else {
+                    ref_count[i] = 1;
+                    ref_values[i][0] = v;
+                    ref_keys++;
+                }
+                break;
+            default:
+                CHECK(bptree_replace(tree, &k.key, v, &old) == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+                if (ref_count[i]) {
+                    CHECK(old == ref_values[i][0]);
+                    ref_values[i][0] = v;
+                }
+                break;
+            }
+#endif
+        } else if (kind < 98) { // range
+#ifndef BPTREE_KEYS_ONLY
+            const int span = (int)(rng() % 200);
+            const int last = i + span < TEST_KEYS ? i + span : TEST_KEYS - 1;
+            test_key end;
+            make_key(&end, last);
+            bptree_value_t* values;
+            int n;
+            CHECK(bptree_get_range(tree, &k.key, &end.key, &values, &n) == BPTREE_OK);
+            int at = 0;
+            for (int j = i; j <= last; j++) {
+                for (int m = 0; m < ref_count[j]; m++, at++) CHECK(at < n && values[at] == ref_values[j][m]);
+            }
+            CHECK(at == n);
+            bptree_free_range_results(values);
+#endif
+        } else {
+            maintain(tree);
+        }
+        if (op % 2000 == 0) check_all(tree);
+    }
+    check_all(tree);
+
+    // remove everything: the tree must go back to one empty leaf
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        bptree_remove(tree, &k.key);
+        if (ref_count[i]) ref_keys--;
+        ref_count[i] = 0;
+    }
+#ifdef BPTREE_MESSAGE_BUFFERS
+    CHECK(bptree_flush_messages(tree) == BPTREE_OK);
+#endif
+#ifdef BPTREE_LAZY_REBALANCE
+    while (!bptree_compact(tree, 64)) {
+    }
+#endif
+    check_all(tree);
+    CHECK(tree->count == 0 && tree->height == 1);
+    bptree_free(tree);
+}
+#else
+// same traffic through the bptree_paged_* calls, the file is closed and reopened on the way
+static void run(const int max_keys, const int ops) {
+    const char* path = "test_bptree.db";
+    remove(path);
+    const size_t pool = rng() % 2 ? 16 * 1024 : 1024 * 1024; // a small pool evict often and can refuse deep splits
+    bptree* tree = bptree_paged_open(path, max_keys, NULL, pool, false);
+    CHECK(tree);
+    test_key k;
+    for (op = 0; op < ops; op++) {
+        const int i = (int)(rng() % TEST_KEYS);
+        make_key(&k, i);
+        const uint32_t kind = rng() % 100;
+        if (kind < 50) {
+            const int64_t v = make_value(i);
+            const bptree_status status = bptree_paged_put(tree, &k.key, v);
+            if (status == BPTREE_ALLOCATION_FAILURE) continue; // every frame pinned, the file is unchanged
+            CHECK(status == (ref_count[i] ? BPTREE_DUPLICATE_KEY : BPTREE_OK));
+            if (ref_count[i]) continue;
+            ref_count[i] = 1;
+            ref_values[i][0] = v;
+            ref_keys++;
+        } else if (kind < 75) {
+            CHECK(bptree_paged_remove(tree, &k.key) == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+            if (ref_count[i]) ref_keys--;
+            ref_count[i] = 0;
+        } else if (kind < 90) {
+            bptree_value_t v;
+            CHECK(bptree_paged_get(tree, &k.key, &v) == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+            if (ref_count[i]) CHECK(v == ref_values[i][0]);
+            CHECK(bptree_paged_contains(tree, &k.key) == (ref_count[i] > 0));
+        } else if (kind < 95) {
+            const int last = i + 300 < TEST_KEYS ? i + 300 : TEST_KEYS - 1;
+            test_key end;
+            make_key(&end, last);
+            bptree_value_t* values;
+            int n;
+            CHECK(bptree_paged_get_range(tree, &k.key, &end.key, &values, &n) == BPTREE_OK);
+            int at = 0;
+            for (int j = i; j <= last; j++) {
+                if (ref_count[j]) CHECK(at < n && values[at++] == ref_values[j][0]);
+            }
+            CHECK(at == n);
+            bptree_free_range_results(values);
+        } else if (kind < 99) {
+            bptree_key_t keys[32];
+            bptree_value_t values[32];
+            bptree_status status[32];
+            int ids[32];
+            for (int j = 0; j < 32; j++) {
+                ids[j] = (int)(rng() % TEST_KEYS);
+                make_key(&k, ids[j]);
+                keys[j] = k.key;
+            }
+            CHECK(bptree_paged_get_batch(tree, keys, 32, values, status) == BPTREE_OK);
+            for (int j = 0; j < 32; j++) {
+                CHECK(status[j] == (ref_count[ids[j]] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+                if (ref_count[ids[j]]) CHECK(values[j] == ref_values[ids[j]][0]);
+            }
+        } else {
+            bptree_value_t* values;
+            int n;
+            CHECK(bptree_get_range(tree, &k.key, &k.key, &values, &n) == BPTREE_INVALID_ARGUMENT); // bptree_paged_get_range is the one
+            CHECK(bptree_put(tree, &k.key, 1) == BPTREE_INVALID_ARGUMENT); // the generic calls refuse a paged tree
+            CHECK(!bptree_contains(tree, &k.key));
+            CHECK(bptree_paged_close(tree) == BPTREE_OK);
+            tree = bptree_paged_open(path, max_keys, NULL, pool, false);
+            CHECK(tree && tree->count == ref_keys);
+        }
+    }
+    for (int i = 0; i < TEST_KEYS; i++) {
+        make_key(&k, i);
+        bptree_value_t v;
+        CHECK(bptree_paged_get(tree, &k.key, &v) == (ref_count[i] ? BPTREE_OK : BPTREE_KEY_NOT_FOUND));
+        if (ref_count[i]) CHECK(v == ref_values[i][0]);
+        ref_count[i] = 0;
+    }
+    CHECK(tree->count == ref_keys);
+    ref_keys = 0;
+    bptree_free(tree); // close it like bptree_paged_close
+    remove(path);
+}
+
+// leaves in the chain from the first one, and the empty ones among them
+static int paged_leaves(bptree* tree, int* empty) {
+    bptree_page_id page_stack[BPTREE_MAX_HEIGHT];
+    int index_stack[BPTREE_MAX_HEIGHT];
+    int depth;
+    test_key k;
+    make_key(&k, 0);
+    CHECK(bptree_paged_find_path(tree, &k.key, page_stack, index_stack, &depth, NULL, NULL) == BPTREE_OK);
+    int n = 0;
+    *empty = 0;
+    for (bptree_page_id id = page_stack[depth]; id != BPTREE_INVALID_PAGE; n++) {
+        bptree_node* leaf = bptree_pager_fetch(tree->pager, id);
+        CHECK(leaf && leaf->is_leaf);
+        if (leaf->num_keys == 0) (*empty)++;
+        id = leaf->next_page;
+        bptree_pager_unpin(tree->pager, leaf, false);
+    }
+    return n;
+}
+
+// removes free the pages of the leaves they empty and the puts after them reuse those pages, the file stop growing
+static void test_paged_free_pages(void) {
+    const char* path = "test_bptree_free.db";
+    remove(path);
+    bptree* tree = bptree_paged_open(path, 8, NULL, 1024 * 1024, false);
+    CHECK(tree);
+    test_key k;
+    uint64_t pages = 0;
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < TEST_KEYS; i++) {
+            make_key(&k, (i * 7 + round) % TEST_KEYS); // a different order each round
+            CHECK(bptree_paged_put(tree, &k.key, i) == BPTREE_OK);
+        }
+        if (round == 0) pages = bptree_paged_get_io_stats(tree).page_count;
+        CHECK(bptree_paged_get_io_stats(tree).page_count <= pages + pages / 4);
+        for (int i = 0; i < TEST_KEYS; i++) {
+            make_key(&k, i);
+            if (i % 10 != 0 || round == 3) CHECK(bptree_paged_remove(tree, &k.key) == BPTREE_OK);
+        }
+        int empty;
+        const int leaves = paged_leaves(tree, &empty);
+        CHECK(empty == (round == 3 ? 1 : 0) && bptree_paged_get_io_stats(tree).free_pages > 0);
+        if (round == 3) CHECK(leaves == 1 && tree->height == 1); // every key gone: the root is a leaf again
+        for (int i = 0; i < TEST_KEYS && round < 3; i += 10) { // the keys left for the next round
+            make_key(&k, i);
+            CHECK(bptree_paged_remove(tree, &k.key) == BPTREE_OK);
+        }
+        CHECK(bptree_paged_close(tree) == BPTREE_OK);
+        tree = bptree_paged_open(path, 8, NULL, 1024 * 1024, false); // the free list is in the file header
+        CHECK(tree && tree->count == 0 && bptree_paged_get_io_stats(tree).free_pages > 0);
+    }
+    bptree_value_t* values;
+    int n;
+    test_key end;
+    make_key(&k, 0);
+    make_key(&end, TEST_KEYS - 1);
+    CHECK(bptree_paged_get_range(tree, &k.key, &end.key, &values, &n) == BPTREE_OK && n == 0);
+    bptree_free_range_results(values);
+    bptree_free(tree);
+    remove(path);
+}
+#endif
+
+#ifdef BPTREE_MESSAGE_BUFFERS
+// a flush stopped by the memory limit give the rest of its batch back to the buffers, nothing is lost
+// the slack let some splits of a batch through before one fail, the rest then go back to the nodes split off
+static void test_flush_at_limit(void) {
+    for (int slack = 0; slack < 8; slack++) {
+        bptree* tree = put_sequence(4, TEST_KEYS / 2, 1); // small nodes: the parents of the leaves split during a batch
+        CHECK(bptree_flush_messages(tree) == BPTREE_OK);
+        const size_t used = bptree_memory_usage(tree);
+        CHECK(bptree_set_memory_limit(tree, used + (size_t)slack * used / 200) == BPTREE_OK);
+        test_key k;
+        int refused = 0;
+        for (int i = TEST_KEYS / 2; i < TEST_KEYS; i++) {
+            make_key(&k, i);
+#if defined(BPTREE_KEYS_ONLY)
+            const bptree_status status = bptree_put(tree, &k.key);
+#else
+            const bptree_status status = bptree_put(tree, &k.key, i);
+#endif
+            CHECK(status == BPTREE_OK || status == BPTREE_ALLOCATION_FAILURE); // the message is stored before the flush
+            if (status != BPTREE_OK) refused++;
+        }
+        CHECK(refused > 0 && bptree_check_invariants(tree));
+        CHECK(bptree_flush_messages(tree) == BPTREE_ALLOCATION_FAILURE && bptree_check_invariants(tree));
+        CHECK(bptree_set_memory_limit(tree, 0) == BPTREE_OK && bptree_flush_messages(tree) == BPTREE_OK);
+        CHECK(tree->count == TEST_KEYS && bptree_check_invariants(tree));
+        for (int i = 0; i < TEST_KEYS; i++) {
+            make_key(&k, i);
+            CHECK(bptree_contains(tree, &k.key));
+        }
+        bptree_free(tree);
+    }
+}
+#endif
+
+#ifdef BPTREE_MEMTABLE
+static int same_order(const bptree_key_t* a, const bptree_key_t* b) {
+    return bptree_default_compare(a, b);
+}
+
+static bptree_status put_key(bptree* tree, const int i) {
+    test_key k;
+    make_key(&k, i);
+#if defined(BPTREE_KEYS_ONLY)
+    return bptree_put(tree, &k.key);
+#else
+    return bptree_put(tree, &k.key, i);
+#endif
+}
+
+// a put of a key already in a leaf or in the buffer is refused like in the other modes, with the filter or without it
+static void test_memtable_duplicates(void) {
+    for (int custom = 0; custom < 2; custom++) {
+        bptree* tree = bptree_create(16, custom ? same_order : NULL, false);
+        CHECK(tree && (tree->filter == NULL) == (custom == 1)); // a custom order can't be hashed, every put descend
+        for (int i = 0; i < 2000; i++) CHECK(put_key(tree, i) == BPTREE_OK);
+        for (int i = 0; i < 2000; i += 7) CHECK(put_key(tree, i) == BPTREE_DUPLICATE_KEY);
+        CHECK(tree->count == 2000 && tree->memtable_count > 0 && bptree_check_invariants(tree));
+        CHECK(bptree_merge_memtable(tree) == BPTREE_OK && tree->count == 2000);
+        CHECK(put_key(tree, 5) == BPTREE_DUPLICATE_KEY && tree->count == 2000);
+        test_key k;
+        for (int i = 0; i < 1000; i++) {
+            make_key(&k, i);
+            CHECK(bptree_remove(tree, &k.key) == BPTREE_OK);
+        }
+        for (int i = 0; i < 1000; i++) CHECK(put_key(tree, i) == BPTREE_OK); // removed keys stay in the filter, the descent clear them
+        CHECK(tree->count == 2000 && bptree_check_invariants(tree));
+        bptree_free(tree);
+    }
+}
+#endif
+
+#ifdef BPTREE_KEY_TYPE_VARLEN
+// keys on both sides of BPTREE_KEY_INLINE_MAX, each one a prefix of the next so the separators get cut short
+static void test_key_lengths(void) {
+    bptree* tree = bptree_create(4, NULL, false);
+    CHECK(tree);
+    char bytes[40];
+    memset(bytes, 'k', sizeof(bytes));
+    for (uint32_t len = 1; len < sizeof(bytes); len++) {
+        const bptree_key_t key = bptree_key_make(bytes, len);
+        CHECK(bptree_put(tree, &key, (int64_t)len) == BPTREE_OK);
+    }
+    CHECK(bptree_check_invariants(tree));
+    for (uint32_t len = 1; len < sizeof(bytes); len++) {
+        const bptree_key_t key = bptree_key_make(bytes, len);
+        bptree_value_t v;
+        CHECK(bptree_get(tree, &key, &v) == BPTREE_OK && v == (int64_t)len);
+    }
+    bptree_free(tree);
+}
+#endif
+
+#ifdef BPTREE_KEY_TYPE_STRING
+static int sign(const int x) {
+    return (x > 0) - (x < 0);
+}
+
+// random bytes, high ones and zeros included, must sort like memcmp whatever byte the keys first differ at
+static void test_key_order(void) {
+    bptree* tree = bptree_create(8, NULL, false);
+    CHECK(tree);
+    for (int n = 0; n < 20000; n++) {
+        bptree_key_t a, b;
+        for (int j = 0; j < BPTREE_KEY_SIZE; j++) a.data[j] = (char)(rng() % 4 ? rng() : 0);
+        b = a;
+        b.data[rng() % BPTREE_KEY_SIZE] = (char)rng();
+        CHECK(sign(bptree_default_compare(&a, &b)) == sign(memcmp(a.data, b.data, BPTREE_KEY_SIZE)));
+        const bptree_status status = bptree_put(tree, &a, n);
+        CHECK(status == BPTREE_OK || status == BPTREE_DUPLICATE_KEY);
+    }
+    CHECK(bptree_check_invariants(tree));
+    bptree_free(tree);
+}
+#endif
+
+int main(int argc, char** argv) {
+    const int ops = argc > 1 ? atoi(argv[1]) : 100000;
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if (rng_state == 0) rng_state = 1;
+#ifdef BPTREE_KEY_TYPE_VARLEN
+    test_key_lengths();
+#endif
+#ifdef BPTREE_KEY_TYPE_STRING
+    test_key_order();
+#endif
+#if !defined(BPTREE_PAGED) && !defined(BPTREE_MULTIMAP)
+    test_freeze_sizes();
+#endif
+#ifndef BPTREE_PAGED
+    test_append();
+    test_split_point();
+    test_spread();
+#if !defined(BPTREE_MESSAGE_BUFFERS) && !defined(BPTREE_MEMTABLE) // their writes don't all reach the leaves
+    test_watermarks();
+    test_defragment();
+    test_shrink();
+    test_shrink_malloced();
+    test_memory_limit();
+#endif
+#endif
+#ifdef BPTREE_MESSAGE_BUFFERS
+    test_flush_at_limit();
+#endif
+#ifdef BPTREE_MEMTABLE
+    test_memtable_duplicates();
+#endif
+#ifdef BPTREE_PAGED
+    test_paged_free_pages();
+#endif
+    const int fanouts[] = {3, 4, 16, 64};
+    for (size_t f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); f++) {
+        memset(ref_count, 0, sizeof(ref_count));
+        ref_keys = 0;
+        run(fanouts[f], ops);
+        printf("max_keys %d: ok\n", fanouts[f]);
+    }
+    return 0;
+}